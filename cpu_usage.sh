@@ -0,0 +1,19 @@
+#!/bin/sh
+#Prints how much CPU the protocol kernel threads use over a period of time (10 seconds by default)
+#Run it with the old driver loaded and again with the new one to compare them
+seconds=${1:-10}
+ticks=`getconf CLK_TCK`
+
+cpu_ticks() {
+    #utime + stime, fields 14 and 15 of /proc/<pid>/stat
+    awk '{print $14 + $15}' /proc/$1/stat
+}
+
+#Every line has its own thread, named master_thread<line> or slave_thread<line>
+for pid in `pgrep '^(master|slave)_thread[0-9]*$'`; do
+    name=`cat /proc/${pid}/comm`
+    start=`cpu_ticks ${pid}`
+    sleep ${seconds}
+    end=`cpu_ticks ${pid}`
+    echo "${name} (pid ${pid}): `echo "${start} ${end} ${ticks} ${seconds}" | awk '{printf "%.1f", ($2 - $1) * 100 / ($3 * $4)}'`% of one CPU"
+done
@@ -12,26 +12,124 @@
 #include <linux/delay.h>
 #include <linux/kthread.h>
 #include <linux/mutex.h>
+#include <linux/hrtimer.h>
+#include <linux/sched.h>
+#include <linux/interrupt.h>
+#include <linux/wait.h>
+#include <linux/bitops.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/eventfd.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+#include <linux/atomic.h>
+#include <linux/cpumask.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/version.h>
+#include "protocol.h"
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("tuna-yapakci");
 
 #define MAGIC 'k'
 #define USER_APP_REG _IOW(MAGIC, 1, int*)
 #define USER_APP_UNREG _IO(MAGIC, 2)
+#define GPIO_SET_TIMING_PROFILE _IOW(MAGIC, 3, int*)
+#define GPIO_GET_TIMING_PROFILE _IOR(MAGIC, 4, int*)
+#define GPIO_SET_EVENTFD _IOW(MAGIC, 5, int*)
+#define GPIO_RING_DOORBELL _IO(MAGIC, 6)
+#define GPIO_WRITE_BATCH _IOW(MAGIC, 7, struct BatchWrite*)
+#define GPIO_SET_DEST _IOW(MAGIC, 8, int*)
+#define GPIO_GET_BUS_SLAVES _IOR(MAGIC, 9, uint8_t*)
+#define GPIO_GET_TX_ERRORS _IOR(MAGIC, 10, int*)
+#define GPIO_SET_TX_CLASS _IOW(MAGIC, 11, struct TxClass*)
+#define GPIO_SET_LINK_CONFIG _IOW(MAGIC, 12, struct LineConfig*)
+#define GPIO_GET_LINK_CONFIG _IOR(MAGIC, 13, struct LineConfig*)
 #define SIGDATARECV 47
 #define MASTERNAME "gpio_master"
 #define SLAVENAME "gpio_slave"
 
+//--------------------Kernel compatibility--------------------
+
+//eventfd_signal() lost its count in 6.8, it always adds 1 now
+static inline void rx_eventfd_signal(struct eventfd_ctx *ctx){
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+    eventfd_signal(ctx);
+#else
+    eventfd_signal(ctx, 1);
+#endif
+}
+
+//write_iter() gets user memory as a list of buffers or, since 6.0, as a single one (ITER_UBUF: io_uring writes
+//and writev() of one buffer)
+static inline bool iter_from_user(const struct iov_iter *iter){
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+    return user_backed_iter(iter);
+#else
+    return iter_is_iovec(iter);
+#endif
+}
+
+//Bytes left in the user buffer the iterator is in. iov_iter_iovec() covers single buffers since 6.4, before that
+//a single buffer is simply the rest of the iterator
+static inline size_t iter_segment_length(const struct iov_iter *iter){
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)) && (LINUX_VERSION_CODE < KERNEL_VERSION(6, 4, 0))
+    if(iter_is_ubuf(iter)) {
+        return iov_iter_count(iter);
+    }
+#endif
+    return iov_iter_iovec(iter).iov_len;
+}
+
 //--------------------Prototypes and Structures--------------------
 
 static ssize_t gpio_read(struct file *filp, char __user *buff, size_t count, loff_t *offp);
 static ssize_t gpio_write(struct file *filp, const char __user *buff, size_t count, loff_t *offp);
+static ssize_t gpio_write_iter(struct kiocb *iocb, struct iov_iter *from);
 static int gpio_open(struct inode *inode, struct file *file);
 static int gpio_close(struct inode *inode, struct file *file);
 static long gpioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+static __poll_t gpio_poll(struct file *filp, poll_table *wait);
+static int gpio_mmap(struct file *filp, struct vm_area_struct *vma);
+struct GpioLine;
+static int set_rx_eventfd(struct GpioLine *line, int fd);
+#ifdef GPIO_LINK_SOFT_WIRE
+static void soft_wire_leave(struct GpioLine *line);
+#endif
+
+//Argument of GPIO_SET_TX_CLASS: the class (TX_CLASS_URGENT to TX_CLASS_BULK, see protocol.h) of the messages
+//written to this open file from now on, and how long they may wait to be sent in microseconds (0 == forever)
+struct TxClass {
+    int32_t tx_class;
+    uint32_t deadline_us;
+};
 
-struct gpio_dev {
-    struct cdev cdev;
+//Argument of GPIO_SET_LINK_CONFIG and GPIO_GET_LINK_CONFIG: the protocol options of one line, same meaning as the
+//module parameters with the same names (which every line starts with). bus_mode applies to the whole module
+struct LineConfig {
+    int32_t frame_mode;
+    int32_t fec_mode;
+    int32_t session_mode;
+    int32_t turnaround;
+    int32_t reply_window_us;
+    int32_t negotiate_speed;
+    int32_t max_retries;
+    int32_t retry_backoff_us;
+    int32_t idle_poll_min_us;
+    int32_t idle_poll_max_us;
+    int32_t idle_poll_backoff;
+    int32_t rx_full_policy;
+    int32_t tx_scheduler;
+    int32_t tx_weights[NUM_TX_CLASSES];
+};
+
+//Argument of GPIO_WRITE_BATCH. records points to the messages, each one with its length (2 bytes, little endian)
+//in front, the same way read() returns them, size is the total size in bytes
+struct BatchWrite {
+    uint64_t records;
+    uint32_t size;
+    uint32_t pad;
 };
 
 static struct file_operations gpio_fops = {
@@ -40,661 +138,1464 @@ static struct file_operations gpio_fops = {
     .release = gpio_close,
     .read = gpio_read,
     .write = gpio_write,
+    .write_iter = gpio_write_iter,
     .unlocked_ioctl = gpioctl,
+    .poll = gpio_poll,
+    .mmap = gpio_mmap,
 };
 
-//This part implements a circular fifo queue
-static const int queue_size = 5;
-
-struct Data {
-    uint8_t length;
-    char buffer[10];
+//First page of the memory user space gets with mmap. Every index is on its own cache line, because the two sides
+//of a ring write different ones. The send ring slots start at tx_offset and the receive ring slots at rx_offset
+struct RingControl {
+    uint32_t tx_head;
+    uint32_t pad0[15];
+    uint32_t tx_tail;
+    uint32_t pad1[15];
+    uint32_t rx_head;
+    uint32_t pad2[15];
+    uint32_t rx_tail;
+    uint32_t pad3[15];
+    uint32_t tx_depth;
+    uint32_t rx_depth;
+    uint32_t slot_size;
+    uint32_t tx_offset;
+    uint32_t rx_offset;
 };
 
-struct DataQueue {
-    int first_pos;
-    int data_count;
-    struct Data *array_pt;
+//Every open file of a line has its own class for the messages written to it (GPIO_SET_TX_CLASS)
+struct GpioFile {
+    struct GpioLine *line;
+    int tx_class;
+    unsigned int deadline_us;
 };
 
-static int data_queue_init(struct DataQueue *queue){
-    queue->first_pos = 0;
-    queue->data_count = 0;
-    queue->array_pt = kmalloc(sizeof(struct Data)*queue_size, GFP_KERNEL);
-    if(queue->array_pt == NULL) {
+//Ring with its own memory, never mapped
+static int data_ring_init(struct DataRing *ring, unsigned int depth){
+    depth = roundup_pow_of_two(depth);
+    ring->own_head = 0;
+    ring->own_tail = 0;
+    ring->head = &ring->own_head;
+    ring->tail = &ring->own_tail;
+    ring->mask = depth - 1;
+    ring->slots = kvcalloc(depth, sizeof(struct Data), GFP_KERNEL);
+    if(ring->slots == NULL) {
         return -1;
     }
     return 0;
 }
 
-static int data_queue_free(struct DataQueue *queue){
-    kfree(queue->array_pt);
-    return 0;
+static void data_ring_free(struct DataRing *ring){
+    kvfree(ring->slots);
+    ring->slots = NULL;
 }
 
-static int data_push(struct DataQueue *queue, struct Data data) {
-    if (queue->data_count == queue_size) {
-        return -1;
-    }
-    queue->array_pt[(queue->first_pos + queue->data_count) % queue_size] = data;
-    queue->data_count += 1;
-    return 0;
-}
+//--------------------Variables---------------------------------
 
-static int data_add_front(struct DataQueue *queue, struct Data data) {
-    int new_pos;
-    if (queue->data_count == queue_size) {
-        return -1;
-    }
-    new_pos = (queue->first_pos) - 1;
-    if (new_pos == -1) {
-        new_pos = queue_size - 1;
-    }
-    queue->first_pos = new_pos;
-    queue->array_pt[queue->first_pos] = data;
-    queue->data_count += 1;
-    return 0;
-}
+//Lines are numbered in the order of the gpio_pins parameter, line n is minor n of the character device
+#define MAX_LINES 16
+
+//Everything that belongs to one GPIO line, link is the protocol state of it (see protocol.h)
+struct GpioLine {
+    struct Link link;
+    //Protocol options of the line (link.config points here), the module parameters until GPIO_SET_LINK_CONFIG
+    struct LinkConfig config;
+    int pin;
+    //CPU the protocol thread runs on, -1 lets the scheduler pick one
+    int cpu;
+    struct cdev cdev;
 
-//This function copies first element and removes it from the queue
-static int data_pop(struct DataQueue *queue, struct Data *data_to_copy) {
-    int i;
-    if (queue->data_count == 0) {
-        return -1;
-    }
-    queue->data_count -= 1;
-    data_to_copy->length = (queue->array_pt[queue->first_pos]).length;
-    for (i = 0; i < data_to_copy->length; i += 1){
-        data_to_copy->buffer[i] = queue->array_pt[queue->first_pos].buffer[i];
-    }
-    queue->first_pos = (queue->first_pos + 1) % queue_size;
-    return 0;
-}
+    //task_struct for the kernel thread that gets created when a process registers
+    struct task_struct *comm_thread;
+
+    //Memory of the send and receive rings, a RingControl page followed by the slots of both rings.
+    //It can be mapped into user space, then the app is the producer of the send ring and the consumer of the receive
+    //ring instead of write() and read(). rings_mapped counts the mappings that are still there
+    void *shared_rings;
+    unsigned long shared_rings_size;
+    atomic_t rings_mapped;
+
+    //A variable that holds the PID of current registered process (-1 means no process is registered,
+    //0 means an app is registered but doesn't want signals, it reads, polls or uses an eventfd instead)
+    int registered_process;
+    // and a task_struct related to that process
+    struct task_struct *task;
+
+    //Received messages that were dropped because the receive ring was full (with rx_full_policy=1)
+    unsigned int rx_dropped;
+
+    //The master sleeps here while the receive ring is full, reading from the dev file wakes it up
+    wait_queue_head_t rx_space_wq;
+    //Readers (blocking reads and poll) wait here for received messages, and writers for room in the send ring
+    wait_queue_head_t rx_data_wq;
+    wait_queue_head_t tx_space_wq;
+    //The master waits here between resets, writers wake it up as soon as they queue a message
+    wait_queue_head_t tx_wq;
+
+    //Optional eventfd that gets signaled for every received message, so user space can wait on it together with
+    //other file descriptors. The lock only keeps the ioctl from replacing it while the protocol thread signals it
+    struct eventfd_ctx *rx_eventfd;
+    spinlock_t rx_eventfd_lock;
+
+    //Set when a message is given up (see max_retries) until user space hears about it, the next write fails with EIO
+    //and poll reports an error
+    atomic_t tx_error;
+
+    //Mutexes to guard shared memory, mtx1 for readers and mtx2 for writers
+    struct mutex mtx1;
+    struct mutex mtx2;
+
+    //Falling edge interrupt of the pin. The protocol thread arms it when it waits for the other side,
+    //the handler stores when the edge happened so bit timing starts from the real edge
+    int irq;
+    int edge_armed;
+    int edge_seen;
+    u64 edge_timestamp;
+    wait_queue_head_t edge_wq;
+
+    //Where messages written to a bus master go
+    int bus_dest;
+
+#ifdef GPIO_LINK_SOFT_WIRE
+    //Software wire the line is on instead of its pin (0 == the pin is the wire), if it pulls that wire low and if
+    //it is set up far enough to get edges from the others (both flags only change with wire_lock held)
+    int wire_group;
+    int wire_driving;
+    int wire_joined;
+#endif
+
+    //cleanup helper variables, useful for error handling
+    int device_registered;
+    int gpio_requested;
+    int kthread_started;
+    int rings_allocated;
+    int irq_requested;
+};
 
-//This function just copies the first element
-static int data_read_top(struct DataQueue *queue, struct Data *data_to_copy) {
-    int i;
-    if (queue->data_count == 0) {
-        return -1;
-    }
-    data_to_copy->length = (queue->array_pt[queue->first_pos]).length;
-    for (i = 0; i < data_to_copy->length; i += 1){
-        data_to_copy->buffer[i] = queue->array_pt[queue->first_pos].buffer[i];
-    }
-    return 0;
-}
+static struct GpioLine *lines = NULL;
+static int num_lines = 0;
 
-/* This function was for debugging
-static void data_print(struct DataQueue *queue) {
-    int i;
-    printk("Printing data\n");
-    for (i = 0; i < queue->data_count; i += 1){
-        printk("Data %d: %s", i, (queue->array_pt[(queue->first_pos + i) % queue_size]).buffer);
-    }
-}
-*/
-//--------------------Variables---------------------------------
+//debugfs directory with a stats file for every line
+static struct dentry *debugfs_dir = NULL;
 
 //Stuff needed to initialize a character device
 static dev_t dev = 0;
-struct gpio_dev g_dev;
-
-//task_struct for the kernel thread that gets created when a process registers
-struct task_struct *comm_thread;
-
-//Queue to store messages that are going to get sent
-struct DataQueue queue_to_send;
-
-//A variable that holds the PID of current registered process (-1 means no process is registered)
-static int registered_process = -1;
-// and a task_struct related to that process
-struct task_struct *task;
-
-//Following variables hold last read message and make sure it is read before another one arrives
-struct Data received_data;
-static int prev_data_not_read = 0;
-
-//Mutexes to guard shared memory
-struct mutex mtx1;
-struct mutex mtx2;
-
-//Stores a kernel timestamp, needed for accuracy of timing during communication
-static u64 timer;
-
-//Enables indicating the pin number during initialization
+#define DEVICE_NAME "gpio_link"
+
+//How many messages can wait to be sent, rounded up to a power of two. Every slot takes about 4KB.
+//tx_queue_depth is the ring of the normal class (the one that can be mapped), class_queue_depth the rings of the
+//urgent, reply and bulk classes
+static int tx_queue_depth = 256;
+module_param(tx_queue_depth, int, S_IRUGO);
+static int class_queue_depth = 16;
+module_param(class_queue_depth, int, S_IRUGO);
+
+//How the next message is picked from the rings of the classes. 0 == strict priority, urgent messages first, then
+//replies, normal and bulk ones. 1 == weighted fair, every class with messages gets a share of the line by its entry
+//in tx_weights (urgent, reply, normal, bulk), so bulk transfers still move while there is other traffic.
+//Messages past their deadline are dropped instead of sent in both cases
+static int tx_scheduler = 0;
+module_param(tx_scheduler, int, S_IRUGO);
+static int tx_weights[NUM_TX_CLASSES] = {8, 4, 2, 1};
+static int num_tx_weights = NUM_TX_CLASSES;
+module_param_array(tx_weights, int, &num_tx_weights, S_IRUGO);
+
+//How many received messages can wait to be read, rounded up to a power of two. Every slot takes about 4KB
+static int rx_queue_depth = 64;
+module_param(rx_queue_depth, int, S_IRUGO);
+
+//What happens when a message arrives and the receive ring is full, 0 == the frame is answered with busy and
+//the sender keeps it until there is room again, 1 == the oldest unread message is dropped to make room
+static int rx_full_policy = 0;
+module_param(rx_full_policy, int, S_IRUGO);
+
+//Waits sleep on a high resolution timer and only busy wait for this long before the deadline.
+//Raise it if edges come late because the thread wakes up too slowly on your system
+static int spin_window_us = 5;
+module_param(spin_window_us, int, S_IRUGO);
+
+//Gap between resets on the master, in microseconds. Right after a message was sent or received it is
+//idle_poll_min_us, every reset where nobody had anything makes it idle_poll_backoff times longer, up to
+//idle_poll_max_us. Writing a message ends the wait right away, so the ceiling only adds latency to messages from the
+//slave. Lower values answer the slave faster, higher ones use less CPU while the line is quiet.
+//(idle_poll_min_us=10000 idle_poll_max_us=10000 polls like older versions did)
+static int idle_poll_min_us = 200;
+module_param(idle_poll_min_us, int, S_IRUGO);
+static int idle_poll_max_us = 10000;
+module_param(idle_poll_max_us, int, S_IRUGO);
+static int idle_poll_backoff = 2;
+module_param(idle_poll_backoff, int, S_IRUGO);
+
+//One entry per line: the pin, its role (master == 0, slave == 1) and optionally the CPU its protocol thread is
+//bound to (-1 or leaving it out lets the scheduler pick). For example gpio_pins=22,17 comm_roles=0,1 thread_cpus=2,3
 //S_IRUGO means the parameter can be read but cannot be changed
+static int gpio_pins[MAX_LINES];
+static int num_gpio_pins = 0;
+module_param_array(gpio_pins, int, &num_gpio_pins, S_IRUGO);
+static int comm_roles[MAX_LINES];
+static int num_comm_roles = 0;
+module_param_array(comm_roles, int, &num_comm_roles, S_IRUGO);
+static int thread_cpus[MAX_LINES];
+static int num_thread_cpus = 0;
+module_param_array(thread_cpus, int, &num_thread_cpus, S_IRUGO);
+
+#ifdef GPIO_LINK_SOFT_WIRE
+//Debug builds only (make SOFT_WIRE=1), for testing without jumper wires: lines with the same number here (1-16, one
+//entry per line like gpio_pins, 0 or leaving it out uses the pin) share an open drain wire inside the module instead
+//of their pins. The pins are still requested but never driven, so the virtual lines of gpio-sim or gpio-mockup can
+//be used (see gpio_sim_setup.sh). For example gpio_pins=512,513 comm_roles=0,1 wire_groups=1,1
+static int wire_groups[MAX_LINES];
+static int num_wire_groups = 0;
+module_param_array(wire_groups, int, &num_wire_groups, S_IRUGO);
+//How many lines pull each software wire low right now
+static atomic_t wire_low[MAX_LINES + 1];
+//Lines join and leave the wires and hand out edges with this held
+static DEFINE_SPINLOCK(wire_lock);
+#endif
+
+//Single line setup of older versions, only used when gpio_pins is not given
 static int gpio_pin_number = -1;
 module_param(gpio_pin_number, int, S_IRUGO);
-
-//master == 0, slave == 1;
 static int comm_role = 0;
 module_param(comm_role, int, S_IRUGO);
 
+//Frame format used when sending, 0 == fixed 13 byte frames padded with 0xFF,
+//1 == variable length frames that end right after the checksum,
+//2 == variable length frames sent as one continuous bit stream without the gap after every byte.
+//Reading side accepts all of them, so only set 1 or 2 if the other side runs this version of the driver
+static int frame_mode = 0;
+module_param(frame_mode, int, S_IRUGO);
+
+//When 1, frames are sent with forward error correction (twice as long on the line, but single bit errors
+//don't need a retransmission). Needs frame_mode=1 or 2, the reader handles both
+static int fec_mode = 0;
+module_param(fec_mode, int, S_IRUGO);
+
+//When 1 (on both sides), the reader of the last frame of a session answers with ACK_REPLY if it has a message itself,
+//and sends it right away instead of waiting for the next reset. Needs frame_mode=1 or 2. With reply_window_us the
+//app is told about the message before the ACK and the reader waits that long for it to queue an answer, so
+//request/response traffic takes a single reset (every ACK is delayed by up to that much when no answer comes)
+static int turnaround = 0;
+module_param(turnaround, int, S_IRUGO);
+static int reply_window_us = 0;
+module_param(reply_window_us, int, S_IRUGO);
+
+//How many times a frame is sent again after a NAK or a missing ACK before its message is given up.
+//With frame_mode=1 or 2 the tries follow each other right away, the first one retry_backoff_us later and every
+//other one twice as long after the previous (at most 4ms). With fixed frames every try needs a new reset
+static int max_retries = 2;
+module_param(max_retries, int, S_IRUGO);
+static int retry_backoff_us = 250;
+module_param(retry_backoff_us, int, S_IRUGO);
+
+//When 1, everything in the queue is sent after a single reset, each frame tells the reader if another one follows.
+//Needs frame_mode=1 or 2
+static int session_mode = 0;
+module_param(session_mode, int, S_IRUGO);
+
+//Timing profile, 0 == standard (100us bits), 1 == fast (50us bits), 2 == overdrive (20us bits).
+//Without negotiation both sides have to use the same one. With negotiate_speed=1 (on both sides) this is the fastest
+//one this side supports, the master offers it after every reset and the slave answers with the one both support
+static int timing_profile = 0;
+module_param(timing_profile, int, S_IRUGO);
+static int negotiate_speed = 0;
+module_param(negotiate_speed, int, S_IRUGO);
+
+//When 1, masters talk to several slaves on the same line, every slave needs its address in bus_addresses (one entry
+//per line like gpio_pins, 1-127, entries of masters are ignored). Slaves are found with a scan when the master starts
+static int bus_mode = 0;
+module_param(bus_mode, int, S_IRUGO);
+static int bus_addresses[MAX_LINES];
+static int num_bus_addresses = 0;
+module_param_array(bus_addresses, int, &num_bus_addresses, S_IRUGO);
+
+//The parameters above that protocol.c needs, after they are checked. Every line starts with a copy
+static struct LinkConfig default_config;
+
 //cleanup helper variables, useful for error handling
 static int chrdev_allocated = 0;
-static int device_registered = 0;
-static int gpio_requested = 0;
-static int kthread_started = 0;
-static int queue_kmalloc = 0;
 
 //--------------------Auxiliary Functions------------------------
 
 //Self explanatory, gets called when unloading module, or failure during initialization
-static void cleanup_func(void){
-    if(queue_kmalloc) {
-        data_queue_free(&queue_to_send);
+static void cleanup_line(struct GpioLine *line){
+    int i;
+    if(line->kthread_started) {
+        kthread_stop(line->comm_thread);
     }
-    if(kthread_started) {
-        kthread_stop(comm_thread);
+#ifdef GPIO_LINK_SOFT_WIRE
+    soft_wire_leave(line);
+#endif
+    if(line->rx_eventfd != NULL) {
+        set_rx_eventfd(line, -1);
     }
-    if(gpio_requested) {
-        gpio_free(gpio_pin_number);
+    if(line->rings_allocated) {
+        for (i = 0; i < NUM_TX_CLASSES; i += 1) {
+            if(i != TX_CLASS_NORMAL) {
+                data_ring_free(&line->link.tx_rings[i]);
+            }
+        }
+        vfree(line->shared_rings);
+    }
+    if(line->irq_requested) {
+        free_irq(line->irq, line);
     }
-    if(device_registered) {
-        cdev_del(&(g_dev.cdev));
+    if(line->gpio_requested) {
+        gpio_free(line->pin);
+    }
+    if(line->device_registered) {
+        cdev_del(&line->cdev);
+    }
+}
+
+static void cleanup_func(void){
+    int i;
+    for (i = 0; i < num_lines; i += 1) {
+        cleanup_line(&lines[i]);
     }
+    debugfs_remove_recursive(debugfs_dir);
+    kfree(lines);
     if(chrdev_allocated) {
-        unregister_chrdev_region(dev,1);
+        unregister_chrdev_region(dev, num_lines);
     }
-    
 }
 
-//Sets up and adds a character device to the system
-static int gpio_setup_cdev(struct gpio_dev *g_dev){
-    cdev_init(&g_dev->cdev, &gpio_fops);
-    g_dev->cdev.owner = THIS_MODULE;
-    g_dev->cdev.ops = &gpio_fops;
-    if(cdev_add(&g_dev->cdev, dev, 1) < 0){
+//Sets up and adds the character device of a line to the system (minor number is the line index)
+static int gpio_setup_cdev(struct GpioLine *line){
+    cdev_init(&line->cdev, &gpio_fops);
+    line->cdev.owner = THIS_MODULE;
+    line->cdev.ops = &gpio_fops;
+    if(cdev_add(&line->cdev, MKDEV(MAJOR(dev), line->link.index), 1) < 0){
         return -1;
     }
     return 0;
 }
 
 //Sends data received signal to the registered process (user app)
-static void signal_to_pid_datarecv(void){
-    if (registered_process > 0){
-        if(send_sig_info(SIGDATARECV, (struct kernel_siginfo*) 1, task) < 0) {
+static void signal_to_pid_datarecv(struct GpioLine *line){
+    if (line->registered_process > 0){
+        if(send_sig_info(SIGDATARECV, (struct kernel_siginfo*) 1, line->task) < 0) {
             printk(KERN_WARNING "Error sending data receive signal\n");
         }
     }
 }
 
-
-//Functions that implement our communication protocol
-//(more info on the report)
-static int reset(void);
-static char read_byte(void);
-static void read_message(void);
-static void send_message(void);
-static void send_byte(char byte);
-
-static int reset(void) {
-    //reset returns -1 if no presence, 0 if no msg from slave, 1 if 
-    // there is a message from the slave, 2 if slave has no msg but master has
-    int slave_present;
-    int slave_message;
-    int master_message;
-    mutex_lock(&mtx2);
-    master_message = (queue_to_send.data_count > 0);
-    mutex_unlock(&mtx2);
-    gpio_direction_output(gpio_pin_number, 0);
-    timer = ktime_get_ns();
-    if(master_message) {
-        //udelay(300);
-        timer += 300000;
-        while(timer > ktime_get_ns()) {}
-        gpio_direction_input(gpio_pin_number);
-        //udelay(200);
-        timer += 200000;
-        while(timer > ktime_get_ns()) {}
-    }
-    else{
-        //udelay(500);
-        timer += 500000;
-        while(timer > ktime_get_ns()) {}
-        gpio_direction_input(gpio_pin_number);
-    }
-    //udelay(100);
-    timer += 100000;
-    while(timer > ktime_get_ns()) {}
-    slave_present = (gpio_get_value(gpio_pin_number) == 0);
-    //udelay(150);
-    timer += 150000;
-    while(timer > ktime_get_ns()) {}
-    slave_message = (gpio_get_value(gpio_pin_number) == 0);
-    //udelay(150);
-    timer += 150000;
-    while(timer > ktime_get_ns()) {}
-    if(!slave_present){
-        return -1;
-    }
-    else if(slave_message) {
-        return 1;
-    }
-    else if (master_message){
-        return 2;
-    }
-    else{
-        return 0;
+//Wakes up everyone waiting for received data
+static void notify_data_received(struct GpioLine *line){
+    unsigned long flags;
+    wake_up_interruptible(&line->rx_data_wq);
+    spin_lock_irqsave(&line->rx_eventfd_lock, flags);
+    if(line->rx_eventfd != NULL) {
+        rx_eventfd_signal(line->rx_eventfd);
     }
+    spin_unlock_irqrestore(&line->rx_eventfd_lock, flags);
+    signal_to_pid_datarecv(line);
 }
 
-static char read_byte(void){
-    char byte = 0x00;
-    int b[8];
-    int i;
-    timer = ktime_get_ns();
-    for(i = 0; i < 8; i += 1){
-        //udelay(40);
-        timer += 40000;
-        while(timer > ktime_get_ns()) {}
-        b[i] = gpio_get_value(gpio_pin_number);
-        //udelay(60);
-        timer += 60000;
-        while(timer > ktime_get_ns()) {}
+//Replaces the registered eventfd (fd < 0 just removes it)
+static int set_rx_eventfd(struct GpioLine *line, int fd){
+    struct eventfd_ctx *new_ctx = NULL;
+    struct eventfd_ctx *old_ctx;
+    unsigned long flags;
+    if(fd >= 0) {
+        new_ctx = eventfd_ctx_fdget(fd);
+        if(IS_ERR(new_ctx)) {
+            return -1;
+        }
     }
-
-    for(i = 0; i < 8; i += 1){
-        byte = byte | (b[i] << i);
+    spin_lock_irqsave(&line->rx_eventfd_lock, flags);
+    old_ctx = line->rx_eventfd;
+    line->rx_eventfd = new_ctx;
+    spin_unlock_irqrestore(&line->rx_eventfd_lock, flags);
+    if(old_ctx != NULL) {
+        eventfd_ctx_put(old_ctx);
     }
-    //udelay(750);
-    timer += 750000;
-    while(timer > ktime_get_ns()) {}
-    return byte;
+    return 0;
 }
 
-static void read_message(void){
-    char message[13];
-    int i;
-    int msg_length;
-    char checksum;
-    int is_corrupted = 0;
 
-    for (i = 0; i < 13; i += 1){
-        message[i] = read_byte();
-    }
+//Protocol threads, the protocol itself is in protocol.c
+static int master_mode(void *p) {
+    struct GpioLine *line = p;
+    printk("Kernel thread for master started on line %d!\n", line->link.index);
+    link_master_loop(&line->link);
+    return 0;
+}
+
+static int slave_mode(void *p) {
+    struct GpioLine *line = p;
+    printk("Kernel thread for slave started on line %d!\n", line->link.index);
+    link_slave_loop(&line->link);
+    return 0;
+}
+
+//--------------------HAL------------------------------------------
+//What protocol.c needs from the line, see protocol.h
+
+static struct GpioLine *link_line(struct Link *link) {
+    return container_of(link, struct GpioLine, link);
+}
 
-    if(message[0] != 0xAA) {
-        is_corrupted = 1;
+//Interrupt handler for falling edges, our own edges while sending also end up here but are ignored
+static irqreturn_t falling_edge_handler(int irq, void *dev_id) {
+    struct GpioLine *line = dev_id;
+    u64 now = ktime_get_ns();
+    if(READ_ONCE(line->edge_armed)) {
+        line->edge_timestamp = now;
+        WRITE_ONCE(line->edge_armed, 0);
+        smp_wmb();
+        WRITE_ONCE(line->edge_seen, 1);
+        wake_up(&line->edge_wq);
     }
+    return IRQ_HANDLED;
+}
 
-    msg_length = (int) message[1];
+#ifdef GPIO_LINK_SOFT_WIRE
+//--------------------Software wire--------------------
+//Lines on a software wire (see wire_groups) pull it low by counting themselves in wire_low, the one that brings it
+//from released to low calls the edge handler of every other line on it, like the interrupt of a real pin would.
+//Interrupts are off meanwhile like in a real handler, and wire_lock keeps lines from joining or leaving
+
+static void soft_wire_join(struct GpioLine *line) {
+    unsigned long flags;
+    spin_lock_irqsave(&wire_lock, flags);
+    line->wire_joined = 1;
+    spin_unlock_irqrestore(&wire_lock, flags);
+}
 
-    if((msg_length < 0) || (msg_length > 10)) {
-        is_corrupted = 1;
+static void soft_wire_leave(struct GpioLine *line) {
+    unsigned long flags;
+    spin_lock_irqsave(&wire_lock, flags);
+    line->wire_joined = 0;
+    if(line->wire_driving) {
+        line->wire_driving = 0;
+        atomic_dec(&wire_low[line->wire_group]);
     }
-    else {
-        checksum = message[0];
-        for (i = 1; i < msg_length + 2; i += 1) {
-            checksum = checksum ^ message[i];
-        }
-        if(checksum != message[2 + msg_length]) {
-            is_corrupted = 1;
+    spin_unlock_irqrestore(&wire_lock, flags);
+}
+
+static void soft_wire_low(struct GpioLine *line) {
+    unsigned long flags;
+    int i;
+    spin_lock_irqsave(&wire_lock, flags);
+    if(!line->wire_driving) {
+        line->wire_driving = 1;
+        if(atomic_inc_return(&wire_low[line->wire_group]) == 1) {
+            for (i = 0; i < num_lines; i += 1) {
+                if((&lines[i] != line) && lines[i].wire_joined && (lines[i].wire_group == line->wire_group)) {
+                    falling_edge_handler(0, &lines[i]);
+                }
+            }
         }
     }
+    spin_unlock_irqrestore(&wire_lock, flags);
+}
 
-    if(is_corrupted) {
-        mdelay(15);
-        send_byte(0x00);
-        
+static void soft_wire_release(struct GpioLine *line) {
+    unsigned long flags;
+    spin_lock_irqsave(&wire_lock, flags);
+    if(line->wire_driving) {
+        line->wire_driving = 0;
+        atomic_dec(&wire_low[line->wire_group]);
     }
-    else {
-        mutex_lock(&mtx1);
-        received_data.length = msg_length;
-        for (i = 0; i < msg_length; i += 1) {
-            received_data.buffer[i] = message[2 + i];
-        }
-        prev_data_not_read = 1;
-        mutex_unlock(&mtx1);
-        mdelay(15);
-        send_byte(0x0F);
+    spin_unlock_irqrestore(&wire_lock, flags);
+}
+#endif
+
+void hal_line_low(struct Link *link) {
+    struct GpioLine *line = link_line(link);
+#ifdef GPIO_LINK_SOFT_WIRE
+    if(line->wire_group != 0) {
+        soft_wire_low(line);
+        return;
+    }
+#endif
+    gpio_direction_output(line->pin, 0);
+}
 
-        signal_to_pid_datarecv();
+void hal_line_release(struct Link *link) {
+    struct GpioLine *line = link_line(link);
+#ifdef GPIO_LINK_SOFT_WIRE
+    if(line->wire_group != 0) {
+        soft_wire_release(line);
+        return;
     }
+#endif
+    gpio_direction_input(line->pin);
 }
 
-static void send_byte(char byte) {
-    int i;
-    int b[8];
-    timer = ktime_get_ns();
-    for(i = 0; i < 8; i += 1) {
-        b[i] = (int) ((byte >> i) & (0x01));
-    }
-    for(i = 0; i < 8; i += 1) {
-        if (b[i] == 0)  {
-            gpio_direction_output(gpio_pin_number, 0);
-            //udelay(65);
-            timer += 65000;
-            while(timer > ktime_get_ns()) {}
-            gpio_direction_input(gpio_pin_number);
-            //udelay(35);
-            timer += 35000;
-            while(timer > ktime_get_ns()) {}
-        }
-        else{
-            gpio_direction_output(gpio_pin_number, 0);
-            //udelay(15);
-            timer += 15000;
-            while(timer > ktime_get_ns()) {}
-            gpio_direction_input(gpio_pin_number);
-            //udelay(85);
-            timer += 85000;
-            while(timer > ktime_get_ns()) {}
-        }   
-    }
-    //udelay(750);
-    timer += 750000;
-    while(timer > ktime_get_ns()) {}
-}
-
-static void send_message(void) {
-    struct Data dt;
-    int i;
-    char checksum;
-    char ack;
-    int rest;
+int hal_line_read(struct Link *link) {
+    struct GpioLine *line = link_line(link);
+#ifdef GPIO_LINK_SOFT_WIRE
+    if(line->wire_group != 0) {
+        return atomic_read(&wire_low[line->wire_group]) == 0;
+    }
+#endif
+    return gpio_get_value(line->pin);
+}
 
-    mutex_lock(&mtx2);
-    data_read_top(&queue_to_send, &dt); //this doesn't fail unless the queue is empty (we always check before calling send_message())
-    mutex_unlock(&mtx2);
+u64 hal_now(struct Link *link) {
+    return ktime_get_ns();
+}
 
-    rest = 10 - (dt.length);
-    checksum = 0xAA ^ (dt.length);
-    for (i = 0; i < dt.length; i += 1) {
-        checksum = checksum ^ dt.buffer[i];
+//Sleeps on a high resolution timer until shortly before the deadline, then busy waits the last few
+//microseconds. The edges are as accurate as with a busy loop but the CPU is free while waiting.
+//Returns how late it is when the wait ends
+u64 hal_wait_until(struct Link *link, u64 deadline) {
+    u64 spin_window = (u64) spin_window_us * NSEC_PER_USEC;
+    ktime_t wakeup;
+    u64 now;
+
+    if(deadline > ktime_get_ns() + spin_window) {
+        wakeup = ns_to_ktime(deadline - spin_window);
+        set_current_state(TASK_UNINTERRUPTIBLE);
+        schedule_hrtimeout_range(&wakeup, 0, HRTIMER_MODE_ABS);
     }
-    send_byte((char) 0xAA);
-    send_byte((char) dt.length);
-    for (i = 0; i < dt.length; i += 1) {
-        send_byte(dt.buffer[i]);
+    while(deadline > (now = ktime_get_ns())) {}
+    return now - deadline;
+}
+
+//Sleeps on the interrupt until the other side pulls the line low
+int hal_wait_for_edge(struct Link *link, u64 timeout_ns) {
+    struct GpioLine *line = link_line(link);
+    WRITE_ONCE(line->edge_seen, 0);
+    WRITE_ONCE(line->edge_armed, 1);
+    smp_mb();
+    //The line might have gone low before the interrupt was armed
+    if((hal_line_read(link) == 0) && (!READ_ONCE(line->edge_seen))) {
+        WRITE_ONCE(line->edge_armed, 0);
+        link->timer = ktime_get_ns();
+        return 0;
     }
-    send_byte(checksum);
-    for (i = 0; i < rest; i += 1) {
-        send_byte((char) 0xFF);
+    if(timeout_ns == 0) {
+        wait_event_interruptible(line->edge_wq, READ_ONCE(line->edge_seen) || kthread_should_stop());
     }
-    mdelay(10);
-    while((gpio_get_value(gpio_pin_number) == 1)  && (!kthread_should_stop())) {
-            //busy wait
+    else {
+        //The protocol timeouts are a few hundred microseconds to a few milliseconds, shorter than a jiffy at HZ=100
+        //or 250 (and an overdrive quiet line wait even at 1000), so they need the hrtimer
+        wait_event_interruptible_hrtimeout(line->edge_wq, READ_ONCE(line->edge_seen) || kthread_should_stop(),
+                                           ns_to_ktime(timeout_ns));
     }
-    ack = read_byte();
-    if(ack == 0x0F){
-        mutex_lock(&mtx2);
-        data_pop(&queue_to_send, &dt);
-        mutex_unlock(&mtx2);
+    WRITE_ONCE(line->edge_armed, 0);
+    if(!READ_ONCE(line->edge_seen)) {
+        return -1;
     }
-
+    smp_rmb();
+    link->timer = line->edge_timestamp;
+    return 0;
 }
 
-static int master_mode(void *p) {
-    printk("Kernel thread for master started!\n");
+void hal_wait_for_tx(struct Link *link, u64 ns) {
+    wait_event_interruptible_hrtimeout(link_line(link)->tx_wq, (link_tx_pending(link) > 0) || kthread_should_stop(),
+                                       ns_to_ktime(ns));
+}
 
-    while(!kthread_should_stop()) {
-        int status;
+//Reading from the dev file (or the doorbell of a mapped ring) wakes this up
+void hal_wait_for_rx_space(struct Link *link, u64 ns) {
+    wait_event_interruptible_hrtimeout(link_line(link)->rx_space_wq,
+                                       (data_ring_claim(&link->rx_ring) != NULL) || kthread_should_stop(),
+                                       ns_to_ktime(ns));
+}
 
-        mutex_lock(&mtx1);
-        if(prev_data_not_read) {
-            mutex_unlock(&mtx1);
-            continue;
-        }
-        mutex_unlock(&mtx1);
+int hal_should_stop(struct Link *link) {
+    return kthread_should_stop();
+}
 
-        status = reset();
-        if(status == -1) {
-            //printk("Master: Slave is not present\n");
-        }
-        else if (status == 0) {
-            //printk("Master: Nobody has a message\n");
-        }
-        else if (status == 1) {
-            //printk("Master: Slave has a message\n");
-            read_message();
-        }
-        else {
-            //printk("Master: Master has a message");
-            send_message();
-        }
-        mdelay(10);
+//Only drops when a reader isn't in the middle of reading. A mapped receive ring belongs to the app, it always
+//gets backpressure
+int hal_rx_drop_oldest(struct Link *link) {
+    struct GpioLine *line = link_line(link);
+    if((atomic_read(&line->rings_mapped) > 0) || (!mutex_trylock(&line->mtx1))) {
+        return -1;
+    }
+    if(data_ring_peek(&link->rx_ring) != NULL) {
+        data_ring_commit(&link->rx_ring);
+        line->rx_dropped += 1;
     }
+    mutex_unlock(&line->mtx1);
     return 0;
 }
 
-static int slave_mode(void *p) {
-    printk("Kernel thread for slave started!\n");
-
-    while(!kthread_should_stop()) {
-        int send_mode;
-        int read_mode = 0;
-        
-        mutex_lock(&mtx1);
-        if(prev_data_not_read) {
-            mutex_unlock(&mtx1);
-            continue;
-        }
-        mutex_unlock(&mtx1);
-
-        mutex_lock(&mtx2);
-        send_mode = (queue_to_send.data_count > 0);
-        mutex_unlock(&mtx2);
-
-        while((gpio_get_value(gpio_pin_number) == 1) && (!kthread_should_stop())) {
-            //busy wait
-        }
-
-        timer = ktime_get_ns();
-        //udelay(350);
-        timer += 350000;
-        while(timer > ktime_get_ns()) {}
-        read_mode = (gpio_get_value(gpio_pin_number) == 1);
-        //udelay(200);
-        timer += 200000;
-        while(timer > ktime_get_ns()) {}
-        gpio_direction_output(gpio_pin_number, 0);
-        //udelay(100);
-        timer += 100000;
-        while(timer > ktime_get_ns()) {}
-        gpio_direction_input(gpio_pin_number);
-        if(send_mode) {
-            //printk("Slave: Sending message");
-            //udelay(50);
-            timer += 50000;
-            while(timer > ktime_get_ns()) {}
-            gpio_direction_output(gpio_pin_number, 0);
-            //udelay(100);
-            timer += 100000;
-            while(timer > ktime_get_ns()) {}
-            gpio_direction_input(gpio_pin_number);
-            //udelay(100);
-            timer += 100000;
-            while(timer > ktime_get_ns()) {}
-            send_message();
-        }
-        else if(read_mode){
-            //printk("Slave: Reading message");
-            //udelay(250);
-            timer += 250000;
-            while(timer > ktime_get_ns()) {}
-            read_message();
-        }
-        else {
-            //udelay(250);
-            timer += 250000;
-            while(timer > ktime_get_ns()) {}
-        }
-    }
-    return 0;
+void hal_message_received(struct Link *link) {
+    notify_data_received(link_line(link));
 }
 
+void hal_message_sent(struct Link *link) {
+    wake_up_interruptible(&link_line(link)->tx_space_wq);
+}
+
+void hal_message_failed(struct Link *link) {
+    atomic_set(&link_line(link)->tx_error, 1);
+}
 
 //----------------File Operation Functions------------------------
 
-//There is nothing specific we do when the dev file gets opened or closed
+//Every minor number is a line, the file remembers which one it is and the class of what is written to it
 static int gpio_open(struct inode *inode, struct file *file){
-    //printk("Device file opened\n");
+    struct GpioFile *gpio_file = kzalloc(sizeof(struct GpioFile), GFP_KERNEL);
+    if(gpio_file == NULL) {
+        return -ENOMEM;
+    }
+    gpio_file->line = container_of(inode->i_cdev, struct GpioLine, cdev);
+    gpio_file->tx_class = TX_CLASS_NORMAL;
+    file->private_data = gpio_file;
     return 0;
 }
 
 static int gpio_close(struct inode *inode, struct file *file){
-    //printk("Device file closed\n");
+    kfree(file->private_data);
     return 0;
 }
 
+static struct GpioLine *file_line(struct file *file){
+    return ((struct GpioFile *) file->private_data)->line;
+}
+
 //Sends the received data to the user space (when dev file is read)
+//Every message is the message length in two bytes (little endian) followed by the message, a single read
+//returns as many whole messages as fit in the buffer. On a bus master the address of the slave that sent the
+//message comes between the length and the message
 static ssize_t gpio_read(struct file *filp, char __user *buff, size_t count, loff_t *offp){
-    uint8_t len;
-    mutex_lock(&mtx1);
-    if (prev_data_not_read == 0) {
-        mutex_unlock(&mtx1);
+    struct GpioLine *line = file_line(filp);
+    struct Data *slot;
+    uint8_t len[3];
+    int prefix = link_is_bus_master(&line->link) ? 3 : 2;
+    ssize_t total = 0;
+    //Same for the receive ring, the app consumes it directly when it is mapped
+    if(atomic_read(&line->rings_mapped) > 0) {
+        printk(KERN_WARNING "Rings are mapped, use them instead of read\n");
         return -1;
     }
-    len = received_data.length;
-    if(copy_to_user(buff, &len, 1) > 0){
-        mutex_unlock(&mtx1);
+    mutex_lock(&line->mtx1);
+    slot = data_ring_peek(&line->link.rx_ring);
+    //Without O_NONBLOCK the read sleeps until a message arrives
+    while (slot == NULL) {
+        mutex_unlock(&line->mtx1);
+        if (filp->f_flags & O_NONBLOCK) {
+            return -EAGAIN;
+        }
+        if (wait_event_interruptible(line->rx_data_wq, data_ring_peek(&line->link.rx_ring) != NULL) != 0) {
+            return -ERESTARTSYS;
+        }
+        mutex_lock(&line->mtx1);
+        slot = data_ring_peek(&line->link.rx_ring);
+    }
+    if (count < slot->length + prefix) {
+        mutex_unlock(&line->mtx1);
+        printk(KERN_WARNING "Read buffer too small\n");
         return -1;
     }
-    if(copy_to_user(buff + 1, received_data.buffer, received_data.length) > 0){
-        mutex_unlock(&mtx1);
+    while((slot != NULL) && (total + slot->length + prefix <= count)) {
+        len[0] = (uint8_t) (slot->length & 0xFF);
+        len[1] = (uint8_t) (slot->length >> 8);
+        len[2] = slot->address;
+        if(copy_to_user(buff + total, len, prefix) > 0){
+            break;
+        }
+        if(copy_to_user(buff + total + prefix, slot->buffer, slot->length) > 0){
+            break;
+        }
+        total += slot->length + prefix;
+        data_ring_commit(&line->link.rx_ring);
+        slot = data_ring_peek(&line->link.rx_ring);
+    }
+    mutex_unlock(&line->mtx1);
+    wake_up_interruptible(&line->rx_space_wq);
+    if(total == 0) {
         return -1;
     }
-    prev_data_not_read = 0;
-    mutex_unlock(&mtx1);
+    return total;
+}
+
+//Readable when a received message is waiting, writable when there is room in the send ring of the file's class
+static __poll_t gpio_poll(struct file *filp, poll_table *wait){
+    struct GpioFile *gpio_file = filp->private_data;
+    struct GpioLine *line = gpio_file->line;
+    __poll_t mask = 0;
+    poll_wait(filp, &line->rx_data_wq, wait);
+    poll_wait(filp, &line->tx_space_wq, wait);
+    if(data_ring_peek(&line->link.rx_ring) != NULL) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    if(data_ring_claim(&line->link.tx_rings[gpio_file->tx_class]) != NULL) {
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+    //A message was given up since the app last heard about it
+    if(atomic_read(&line->tx_error)) {
+        mask |= EPOLLERR;
+    }
+    return mask;
+}
+
+static void gpio_vma_open(struct vm_area_struct *vma){
+    struct GpioLine *line = vma->vm_private_data;
+    atomic_inc(&line->rings_mapped);
+}
+
+static void gpio_vma_close(struct vm_area_struct *vma){
+    struct GpioLine *line = vma->vm_private_data;
+    atomic_dec(&line->rings_mapped);
+}
+
+static const struct vm_operations_struct gpio_vm_ops = {
+    .open = gpio_vma_open,
+    .close = gpio_vma_close,
+};
+
+//Maps the RingControl page and the slots of both rings (see struct RingControl for the layout)
+static int gpio_mmap(struct file *filp, struct vm_area_struct *vma){
+    struct GpioLine *line = file_line(filp);
+    if((vma->vm_pgoff != 0) || (vma->vm_end - vma->vm_start > line->shared_rings_size)) {
+        return -EINVAL;
+    }
+    if(remap_vmalloc_range(vma, line->shared_rings, 0) < 0) {
+        return -EAGAIN;
+    }
+    vma->vm_ops = &gpio_vm_ops;
+    vma->vm_private_data = line;
+    gpio_vma_open(vma);
     return 0;
 }
 
-//Adds data written to dev file to the queue
-static ssize_t gpio_write(struct file *filp, const char __user *buff, size_t count, loff_t *offp){
-    char msg[10];
-    struct Data tmp;
-    int i;
+//Messages copied into the ring of a class by one write that are not published yet, so a whole batch shows up at
+//once. They all get the same deadline
+struct WriteBatch {
+    struct DataRing *ring;
+    unsigned int count;
+    u64 deadline;
+};
+
+//Starts a batch for the class of the file. Returns -1 if the ring of that class belongs to a mapping
+static int batch_init(struct GpioFile *gpio_file, struct WriteBatch *batch){
+    struct GpioLine *line = gpio_file->line;
+    //Once the send ring is mapped the app is its producer, a second one would break it
+    if((gpio_file->tx_class == TX_CLASS_NORMAL) && (atomic_read(&line->rings_mapped) > 0)) {
+        printk(KERN_WARNING "Rings are mapped, use them instead of write\n");
+        return -1;
+    }
+    batch->ring = &line->link.tx_rings[gpio_file->tx_class];
+    batch->count = 0;
+    batch->deadline = 0;
+    if(gpio_file->deadline_us > 0) {
+        batch->deadline = ktime_get_ns() + (u64) gpio_file->deadline_us * NSEC_PER_USEC;
+    }
+    return 0;
+}
 
-    if(count > 10) {
+//Next free slot of the batch for a message of count bytes (mtx2 has to be held), NULL if the message is invalid
+//or the ring is full
+static struct Data *batch_claim(struct GpioLine *line, struct WriteBatch *batch, size_t count){
+    struct Data *slot;
+
+    if(count > MAX_MESSAGE_LENGTH) {
         printk("Data too big\n");
+        return NULL;
+    }
+    if((count > MAX_PAYLOAD_LENGTH) && (line->config.frame_mode == 0)) {
+        printk(KERN_WARNING "Messages longer than %d bytes need frame_mode=1 or 2\n", MAX_PAYLOAD_LENGTH);
+        return NULL;
+    }
+    if(link_is_bus_master(&line->link) && (line->bus_dest == 0)) {
+        printk(KERN_WARNING "Set the slave address with GPIO_SET_DEST before writing\n");
+        return NULL;
+    }
+    slot = data_ring_claim_nth(batch->ring, batch->count);
+    if(slot == NULL) {
+        line->link.stats.tx_queue_full += 1;
+        printk(KERN_WARNING "Queue is full, write failed\n");
+        return NULL;
+    }
+    return slot;
+}
+
+//Adds a slot filled by batch_claim()'s caller to the batch
+static void batch_fill(struct GpioLine *line, struct WriteBatch *batch, struct Data *slot, size_t count){
+    slot->address = (uint8_t) line->bus_dest;
+    slot->length = count;
+    slot->deadline = batch->deadline;
+    batch->count += 1;
+}
+
+//Copies a message from user space into the next free slot of the batch (mtx2 has to be held).
+//Returns 0 if it was added and -1 if it is invalid, couldn't be read or the ring is full
+static int batch_add(struct GpioLine *line, struct WriteBatch *batch, const char __user *buff, size_t count){
+    struct Data *slot = batch_claim(line, batch, count);
+    if(slot == NULL) {
         return -1;
     }
-    if(copy_from_user(msg, buff, count) > 0) {
+    if(copy_from_user(slot->buffer, buff, count) > 0) {
         printk(KERN_WARNING "Error writing data");
         return -1;
     }
+    batch_fill(line, batch, slot, count);
+    return 0;
+}
 
-    for (i = 0; i < count; i += 1){
-        tmp.buffer[i] = msg[i];
+//Same as batch_add() for the next count bytes of a write_iter() iterator, which moves past them
+static int batch_add_iter(struct GpioLine *line, struct WriteBatch *batch, struct iov_iter *from, size_t count){
+    struct Data *slot = batch_claim(line, batch, count);
+    if(slot == NULL) {
+        return -1;
     }
-    tmp.length = count;
-    //Send responses first by adding them on the front 
-    if (tmp.buffer[0] == 0xBC) {
-        mutex_lock(&mtx2);
-        if (data_add_front(&queue_to_send, tmp) < 0) {
-            mutex_unlock(&mtx2);
-            printk(KERN_WARNING "Queue is full, write failed\n");
-            return -1;
-        };
-        mutex_unlock(&mtx2);
+    if(copy_from_iter(slot->buffer, count, from) != count) {
+        printk(KERN_WARNING "Error writing data");
+        return -1;
     }
-    else {
-        mutex_lock(&mtx2);
-        if (data_push(&queue_to_send, tmp) < 0) {
-            mutex_unlock(&mtx2);
-            printk(KERN_WARNING "Queue is full, write failed\n");
-            return -1;
-        };
-        mutex_unlock(&mtx2);
+    batch_fill(line, batch, slot, count);
+    return 0;
+}
+
+static void batch_publish(struct GpioLine *line, struct WriteBatch *batch){
+    data_ring_publish_n(batch->ring, batch->count);
+    //The master may be waiting for the next poll
+    if(batch->count > 0) {
+        wake_up_interruptible(&line->tx_wq);
+    }
+}
+
+//Adds data written to dev file to the queue
+//Messages longer than 10 bytes are sent as fragments, which only works if the other side runs this driver
+static ssize_t gpio_write(struct file *filp, const char __user *buff, size_t count, loff_t *offp){
+    struct GpioLine *line = file_line(filp);
+    struct WriteBatch batch;
+    int result;
+    //A message that was given up is reported to the next writer, once
+    if(atomic_xchg(&line->tx_error, 0)) {
+        return -EIO;
+    }
+    //mtx2 only keeps writers apart, the protocol thread never takes it. The message is copied from user space
+    //straight into its slot, which the protocol thread can't see until it is published
+    mutex_lock(&line->mtx2);
+    if(batch_init(filp->private_data, &batch) < 0) {
+        mutex_unlock(&line->mtx2);
+        return -1;
+    }
+    result = batch_add(line, &batch, buff, count);
+    batch_publish(line, &batch);
+    mutex_unlock(&line->mtx2);
+
+    if(result < 0) {
+        return -1;
     }
     return count;
 }
 
+//writev() queues every buffer as a separate message. They are published together, so the protocol thread
+//(and other writers) see either none or all of the ones that were accepted. Returns the number of bytes in the
+//accepted buffers, which stop at the first one that doesn't fit
+static ssize_t gpio_write_iter(struct kiocb *iocb, struct iov_iter *from){
+    struct GpioLine *line = file_line(iocb->ki_filp);
+    struct WriteBatch batch;
+    ssize_t accepted = 0;
+    size_t length;
+
+    if(!iter_from_user(from)) {
+        return -EINVAL;
+    }
+    //A message that was given up is reported to the next writer, once
+    if(atomic_xchg(&line->tx_error, 0)) {
+        return -EIO;
+    }
+    mutex_lock(&line->mtx2);
+    if(batch_init(iocb->ki_filp->private_data, &batch) < 0) {
+        mutex_unlock(&line->mtx2);
+        return -1;
+    }
+    //The iterator is only used through its accessors, the message is the rest of the buffer it is in.
+    //An empty buffer can't be stepped over that way, so it ends the batch like an invalid one
+    while(iov_iter_count(from) > 0) {
+        length = iter_segment_length(from);
+        if((length == 0) || (batch_add_iter(line, &batch, from, length) < 0)) {
+            break;
+        }
+        accepted += length;
+    }
+    batch_publish(line, &batch);
+    mutex_unlock(&line->mtx2);
+
+    if(batch.count == 0) {
+        return -1;
+    }
+    return accepted;
+}
+
+//GPIO_WRITE_BATCH queues every record in the buffer the same way, returns how many messages were accepted
+static long write_batch(struct GpioFile *gpio_file, unsigned long arg){
+    struct GpioLine *line = gpio_file->line;
+    struct WriteBatch batch;
+    struct BatchWrite request;
+    const char __user *records;
+    uint8_t len[2];
+    uint32_t pos = 0;
+    size_t length;
+
+    if(copy_from_user(&request, (struct BatchWrite*) arg, sizeof(request)) > 0) {
+        return -1;
+    }
+    //A message that was given up is reported to the next writer, once
+    if(atomic_xchg(&line->tx_error, 0)) {
+        return -EIO;
+    }
+    records = (const char __user *) (uintptr_t) request.records;
+    mutex_lock(&line->mtx2);
+    if(batch_init(gpio_file, &batch) < 0) {
+        mutex_unlock(&line->mtx2);
+        return -1;
+    }
+    while(pos + 2 <= request.size) {
+        if(copy_from_user(len, records + pos, 2) > 0) {
+            break;
+        }
+        length = len[0] | (len[1] << 8);
+        if(length > request.size - pos - 2) {
+            printk(KERN_WARNING "Batch record goes past the end of the buffer\n");
+            break;
+        }
+        if(batch_add(line, &batch, records + pos + 2, length) < 0) {
+            break;
+        }
+        pos += 2 + length;
+    }
+    batch_publish(line, &batch);
+    mutex_unlock(&line->mtx2);
+    return batch.count;
+}
+
+//Checks protocol options (from the module parameters or GPIO_SET_LINK_CONFIG), returns -1 if they can't be used.
+//Options that need frame_mode=1 or 2 are turned off with a warning instead
+static int check_link_config(struct LinkConfig *c){
+    int i;
+    if((c->idle_poll_min_us < 1) || (c->idle_poll_max_us < c->idle_poll_min_us) || (c->idle_poll_backoff < 1)) {
+        printk(KERN_WARNING "Invalid idle poll parameters\n");
+        return -1;
+    }
+    if((c->max_retries < 0) || (c->retry_backoff_us < 0)) {
+        printk(KERN_WARNING "Invalid retry parameters\n");
+        return -1;
+    }
+    if((c->frame_mode < 0) || (c->frame_mode > 2) || ((c->rx_full_policy != 0) && (c->rx_full_policy != 1))) {
+        printk(KERN_WARNING "Invalid frame_mode or rx_full_policy\n");
+        return -1;
+    }
+    if((c->tx_scheduler != TX_SCHEDULER_STRICT) && (c->tx_scheduler != TX_SCHEDULER_WEIGHTED)) {
+        printk(KERN_WARNING "Invalid tx_scheduler\n");
+        return -1;
+    }
+    for (i = 0; i < NUM_TX_CLASSES; i += 1) {
+        if((c->tx_weights[i] < 1) || (c->tx_weights[i] > 1000)) {
+            printk(KERN_WARNING "tx_weights needs a weight between 1 and 1000 for each of the %d classes\n",
+                   NUM_TX_CLASSES);
+            return -1;
+        }
+    }
+    if(c->fec_mode && (c->frame_mode == 0)) {
+        printk(KERN_WARNING "fec_mode needs frame_mode=1 or 2, FEC is disabled\n");
+        c->fec_mode = 0;
+    }
+    if(c->turnaround && (c->frame_mode == 0)) {
+        printk(KERN_WARNING "turnaround needs frame_mode=1 or 2, it is disabled\n");
+        c->turnaround = 0;
+    }
+    if(c->reply_window_us < 0) {
+        c->reply_window_us = 0;
+    }
+    if(c->session_mode && (c->frame_mode == 0)) {
+        printk(KERN_WARNING "session_mode needs frame_mode=1 or 2, sessions are disabled\n");
+        c->session_mode = 0;
+    }
+    return 0;
+}
+
+static void line_config_from_link(struct LineConfig *to, const struct LinkConfig *from){
+    int i;
+    to->frame_mode = from->frame_mode;
+    to->fec_mode = from->fec_mode;
+    to->session_mode = from->session_mode;
+    to->turnaround = from->turnaround;
+    to->reply_window_us = from->reply_window_us;
+    to->negotiate_speed = from->negotiate_speed;
+    to->max_retries = from->max_retries;
+    to->retry_backoff_us = from->retry_backoff_us;
+    to->idle_poll_min_us = from->idle_poll_min_us;
+    to->idle_poll_max_us = from->idle_poll_max_us;
+    to->idle_poll_backoff = from->idle_poll_backoff;
+    to->rx_full_policy = from->rx_full_policy;
+    to->tx_scheduler = from->tx_scheduler;
+    for (i = 0; i < NUM_TX_CLASSES; i += 1) {
+        to->tx_weights[i] = from->tx_weights[i];
+    }
+}
+
+//GPIO_SET_LINK_CONFIG replaces the protocol options of the line. The protocol thread reads them all the time, so
+//they can only change while no app is registered (mtx2 keeps writers from checking lengths against a half new one)
+static long set_link_config(struct GpioLine *line, unsigned long arg){
+    struct LineConfig request;
+    struct LinkConfig config;
+    int i;
+
+    if(copy_from_user(&request, (struct LineConfig*) arg, sizeof(request)) > 0) {
+        return -1;
+    }
+    config = line->config;
+    config.frame_mode = request.frame_mode;
+    config.fec_mode = request.fec_mode;
+    config.session_mode = request.session_mode;
+    config.turnaround = request.turnaround;
+    config.reply_window_us = request.reply_window_us;
+    config.negotiate_speed = request.negotiate_speed;
+    config.max_retries = request.max_retries;
+    config.retry_backoff_us = request.retry_backoff_us;
+    config.idle_poll_min_us = request.idle_poll_min_us;
+    config.idle_poll_max_us = request.idle_poll_max_us;
+    config.idle_poll_backoff = request.idle_poll_backoff;
+    config.rx_full_policy = request.rx_full_policy;
+    config.tx_scheduler = request.tx_scheduler;
+    for (i = 0; i < NUM_TX_CLASSES; i += 1) {
+        config.tx_weights[i] = request.tx_weights[i];
+    }
+    if(check_link_config(&config) < 0) {
+        return -1;
+    }
+
+    mutex_lock(&line->mtx2);
+    if(line->registered_process >= 0) {
+        mutex_unlock(&line->mtx2);
+        printk(KERN_WARNING "%s: the protocol options can't change while an app is registered\n", line->link.name);
+        return -1;
+    }
+    line->config = config;
+    //Starts over like a freshly loaded line, with the profile it was set to
+    link_init(&line->link, &line->config);
+    mutex_unlock(&line->mtx2);
+    printk(KERN_INFO "%s: protocol options changed, frame_mode %d\n", line->link.name, config.frame_mode);
+    return 0;
+}
+
 //Does things that are necessary to register and unregister user level processes
 static long gpioctl(struct file *filp, unsigned int cmd, unsigned long arg){
+    struct GpioFile *gpio_file = filp->private_data;
+    struct GpioLine *line = gpio_file->line;
     if(cmd == USER_APP_REG) {
-        if (registered_process >= 0) {
+        if (line->registered_process >= 0) {
             printk(KERN_WARNING "User app already registered\n");
             return -1;
         }
-        if(copy_from_user(&registered_process, (int*) arg, 4) > 0) {
+        if(copy_from_user(&line->registered_process, (int*) arg, 4) > 0) {
             printk(KERN_WARNING "Error reading pid\n");
             return -1;
         }
         else{
-            task = pid_task(find_get_pid(registered_process), PIDTYPE_PID);
-            printk(KERN_INFO "Registered pid: %d\n", registered_process);
+            if(line->registered_process > 0) {
+                line->task = pid_task(find_get_pid(line->registered_process), PIDTYPE_PID);
+            }
+            printk(KERN_INFO "Registered pid: %d\n", line->registered_process);
 
-            kthread_started = 1;
-            if(comm_role == 0) {
-                comm_thread = kthread_run(master_mode, NULL, "master_thread");
+            if(line->link.role == 0) {
+                line->comm_thread = kthread_create(master_mode, line, "master_thread%d", line->link.index);
+            }
+            else {
+                line->comm_thread = kthread_create(slave_mode, line, "slave_thread%d", line->link.index);
+            }
+            if(IS_ERR(line->comm_thread)) {
+                printk(KERN_WARNING "Couldn't start the protocol thread\n");
+                line->registered_process = -1;
+                return -1;
             }
-            else if(comm_role == 1) {
-                comm_thread = kthread_run(slave_mode, NULL, "slave_thread");
+            //Threads of different lines can be bound to different CPUs, so they don't share a core's timing budget
+            if(line->cpu >= 0) {
+                kthread_bind(line->comm_thread, line->cpu);
             }
+            line->kthread_started = 1;
+            wake_up_process(line->comm_thread);
             return 0;
         }
     }
+    if(cmd == GPIO_SET_TIMING_PROFILE) {
+        int new_profile;
+        if(copy_from_user(&new_profile, (int*) arg, sizeof(int)) > 0) {
+            return -1;
+        }
+        if((new_profile < 0) || (new_profile >= NUM_TIMING_PROFILES)) {
+            printk(KERN_WARNING "Invalid timing profile\n");
+            return -1;
+        }
+        //Also clears any fallback, with negotiation it is used from the next reset on
+        line->link.timing_profile = new_profile;
+        line->link.allowed_profile = new_profile;
+        if(!line->config.negotiate_speed) {
+            line->link.active_profile = new_profile;
+        }
+        printk(KERN_INFO "Timing profile set to %s\n", timing_profiles[new_profile].name);
+        return 0;
+    }
+    if(cmd == GPIO_GET_TIMING_PROFILE) {
+        if(copy_to_user((int*) arg, &line->link.active_profile, sizeof(int)) > 0) {
+            return -1;
+        }
+        return 0;
+    }
+    if(cmd == GPIO_SET_EVENTFD) {
+        int fd;
+        if(copy_from_user(&fd, (int*) arg, sizeof(int)) > 0) {
+            return -1;
+        }
+        if(set_rx_eventfd(line, fd) < 0) {
+            printk(KERN_WARNING "Invalid eventfd\n");
+            return -1;
+        }
+        return 0;
+    }
+    if(cmd == GPIO_WRITE_BATCH) {
+        return write_batch(gpio_file, arg);
+    }
+    if(cmd == GPIO_SET_TX_CLASS) {
+        struct TxClass tx_class;
+        if(copy_from_user(&tx_class, (struct TxClass*) arg, sizeof(tx_class)) > 0) {
+            return -1;
+        }
+        if((tx_class.tx_class < 0) || (tx_class.tx_class >= NUM_TX_CLASSES)) {
+            printk(KERN_WARNING "Invalid message class\n");
+            return -1;
+        }
+        //Taken under mtx2, so a write in progress uses either the old or the new class
+        mutex_lock(&line->mtx2);
+        gpio_file->tx_class = tx_class.tx_class;
+        gpio_file->deadline_us = tx_class.deadline_us;
+        mutex_unlock(&line->mtx2);
+        return 0;
+    }
+    if(cmd == GPIO_SET_LINK_CONFIG) {
+        return set_link_config(line, arg);
+    }
+    if(cmd == GPIO_GET_LINK_CONFIG) {
+        struct LineConfig config;
+        line_config_from_link(&config, &line->config);
+        if(copy_to_user((struct LineConfig*) arg, &config, sizeof(config)) > 0) {
+            return -1;
+        }
+        return 0;
+    }
+    if(cmd == GPIO_SET_DEST) {
+        int address;
+        if(copy_from_user(&address, (int*) arg, sizeof(int)) > 0) {
+            return -1;
+        }
+        if((!link_is_bus_master(&line->link)) || (address < 1) || (address >= BUS_ADDRESSES)) {
+            printk(KERN_WARNING "Invalid slave address\n");
+            return -1;
+        }
+        //Messages that are already queued keep the address they were written with
+        mutex_lock(&line->mtx2);
+        line->bus_dest = address;
+        mutex_unlock(&line->mtx2);
+        return 0;
+    }
+    if(cmd == GPIO_GET_BUS_SLAVES) {
+        //Bitmap of the slaves the master sees on the bus, bit n of byte n / 8 is address n
+        uint8_t slaves[BUS_ADDRESSES / 8] = {0};
+        int address;
+        for(address = 1; address < BUS_ADDRESSES; address += 1) {
+            if(READ_ONCE(line->link.bus_slaves[address].present)) {
+                slaves[address / 8] |= 1 << (address % 8);
+            }
+        }
+        if(copy_to_user((uint8_t*) arg, slaves, sizeof(slaves)) > 0) {
+            return -1;
+        }
+        return 0;
+    }
+    if(cmd == GPIO_GET_TX_ERRORS) {
+        //Number of messages given up since the module was loaded, also clears the error poll reports
+        int failed = line->link.tx_failed;
+        atomic_set(&line->tx_error, 0);
+        if(copy_to_user((int*) arg, &failed, sizeof(int)) > 0) {
+            return -1;
+        }
+        return 0;
+    }
+    if(cmd == GPIO_RING_DOORBELL) {
+        //The app consumed messages from the mapped receive ring (the master may be waiting for room)
+        //or posted some to the send ring (it may be waiting for the next poll)
+        wake_up_interruptible(&line->rx_space_wq);
+        wake_up_interruptible(&line->tx_wq);
+        return 0;
+    }
     if(cmd == USER_APP_UNREG) {
-        if (registered_process < 0) {
+        if (line->registered_process < 0) {
             printk(KERN_WARNING "No app is registered\n");
         }
         else {
-            registered_process = -1;
-            kthread_stop(comm_thread);
-            kthread_started = 0;
-            mutex_lock(&mtx2);
-            queue_to_send.data_count = 0;
-            queue_to_send.first_pos = 0;
-            mutex_unlock(&mtx2);
+            int i;
+            line->registered_process = -1;
+            kthread_stop(line->comm_thread);
+            line->kthread_started = 0;
+            //With the protocol thread stopped this is the only consumer, so it can drop everything left
+            mutex_lock(&line->mtx2);
+            for (i = 0; i < NUM_TX_CLASSES; i += 1) {
+                data_ring_clear(&line->link.tx_rings[i]);
+            }
+            mutex_unlock(&line->mtx2);
+            line->link.sending_slot = NULL;
+            line->link.next_fragment_to_send = 0;
             printk(KERN_INFO "User app unregistered\n");
         }
     }
     return 0;
 }
 
-//-----------------Initializer----------------------------------
+//-----------------Statistics-----------------------------------
 
-//This function is called to load the driver into the kernel (by insmod)
-static int __init gpio_driver_init(void){
-    char* name;
-    mutex_init(&mtx1);
-    mutex_init(&mtx2);
-    if(comm_role == 0) {
-        name = MASTERNAME;
+//Contents of /sys/kernel/debug/gpio_link/<line name>, one "name value" pair per line so it is easy to scrape
+static int gpio_stats_show(struct seq_file *m, void *v){
+    struct GpioLine *line = m->private;
+    struct LinkStats *stats = &line->link.stats;
+    int i;
+
+    seq_printf(m, "frames_sent %llu\n", stats->frames_sent);
+    seq_printf(m, "bytes_sent %llu\n", stats->bytes_sent);
+    seq_printf(m, "frames_received %llu\n", stats->frames_received);
+    seq_printf(m, "bytes_received %llu\n", stats->bytes_received);
+    seq_printf(m, "checksum_errors %llu\n", stats->checksum_errors);
+    seq_printf(m, "naks_sent %llu\n", stats->naks_sent);
+    seq_printf(m, "naks_received %llu\n", stats->naks_received);
+    seq_printf(m, "ack_timeouts %llu\n", stats->ack_timeouts);
+    seq_printf(m, "retries %llu\n", stats->retries);
+    seq_printf(m, "busy_sent %llu\n", stats->busy_sent);
+    seq_printf(m, "busy_received %llu\n", stats->busy_received);
+    seq_printf(m, "tx_queue_full %llu\n", stats->tx_queue_full);
+    seq_printf(m, "tx_expired %llu\n", stats->tx_expired);
+    seq_printf(m, "tx_failed %u\n", line->link.tx_failed);
+    seq_printf(m, "rx_dropped %u\n", line->rx_dropped);
+    seq_printf(m, "resets %llu\n", stats->resets);
+    seq_printf(m, "no_presence %llu\n", stats->no_presence);
+    for (i = 0; i < NUM_PHASES; i += 1) {
+        seq_printf(m, "phase_%s_ns %llu\n", phase_names[i], stats->phase_ns[i]);
     }
-    else if (comm_role == 1) {
-        name = SLAVENAME;
+    //Lower bound of every bucket in microseconds
+    seq_printf(m, "late_0us %llu\n", stats->lateness[0]);
+    for (i = 1; i < LATENESS_BUCKETS; i += 1) {
+        seq_printf(m, "late_%uus %llu\n", 1U << (i - 1), stats->lateness[i]);
     }
-    printk("%s pin is %d\n", name, gpio_pin_number);
-    
-    chrdev_allocated = 1;
-    if(alloc_chrdev_region(&dev, 0, 1, name) < 0) {
-        printk(KERN_WARNING "Error during dev number allocation\n");
-        cleanup_func();
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(gpio_stats);
+
+//-----------------Initializer----------------------------------
+
+//Allocates the mappable memory of the send and receive rings and fills in the RingControl page
+static int alloc_shared_rings(struct GpioLine *line){
+    struct RingControl *control;
+    unsigned int tx_depth = roundup_pow_of_two(tx_queue_depth);
+    unsigned int rx_depth = roundup_pow_of_two(rx_queue_depth);
+
+    line->shared_rings_size = PAGE_ALIGN(PAGE_SIZE + (unsigned long) (tx_depth + rx_depth) * sizeof(struct Data));
+    //vmalloc_user memory is zeroed and can be given to remap_vmalloc_range
+    line->shared_rings = vmalloc_user(line->shared_rings_size);
+    if(line->shared_rings == NULL) {
         return -1;
     }
+    control = line->shared_rings;
+    control->tx_depth = tx_depth;
+    control->rx_depth = rx_depth;
+    control->slot_size = sizeof(struct Data);
+    control->tx_offset = PAGE_SIZE;
+    control->rx_offset = PAGE_SIZE + tx_depth * sizeof(struct Data);
+    data_ring_init_shared(&line->link.tx_rings[TX_CLASS_NORMAL], tx_depth, &control->tx_head, &control->tx_tail,
+                          (struct Data *) (line->shared_rings + control->tx_offset));
+    data_ring_init_shared(&line->link.rx_ring, rx_depth, &control->rx_head, &control->rx_tail,
+                          (struct Data *) (line->shared_rings + control->rx_offset));
+    return 0;
+}
+
+//Sets up a single line: its pin, the interrupt and the rings
+static int gpio_line_init(struct GpioLine *line){
+    int i;
+    snprintf(line->link.name, sizeof(line->link.name), "%s%d", (line->link.role == 0) ? MASTERNAME : SLAVENAME,
+             line->link.index);
+    printk("%s pin is %d\n", line->link.name, line->pin);
+
+    mutex_init(&line->mtx1);
+    mutex_init(&line->mtx2);
+    init_waitqueue_head(&line->rx_space_wq);
+    init_waitqueue_head(&line->rx_data_wq);
+    init_waitqueue_head(&line->tx_space_wq);
+    init_waitqueue_head(&line->tx_wq);
+    init_waitqueue_head(&line->edge_wq);
+    spin_lock_init(&line->rx_eventfd_lock);
+    atomic_set(&line->rings_mapped, 0);
+    atomic_set(&line->tx_error, 0);
+    line->registered_process = -1;
+    line->irq = -1;
+    line->link.timing_profile = timing_profile;
+    line->config = default_config;
+    link_init(&line->link, &line->config);
+
+    if((line->cpu >= 0) && ((line->cpu >= nr_cpu_ids) || (!cpu_online(line->cpu)))) {
+        printk(KERN_WARNING "CPU %d is not available, %s thread is not bound\n", line->cpu, line->link.name);
+        line->cpu = -1;
+    }
 
-    device_registered = 1;
-    if(gpio_setup_cdev(&g_dev) < 0){
+    line->device_registered = 1;
+    if(gpio_setup_cdev(line) < 0){
         printk(KERN_WARNING "Error adding device\n");
-        cleanup_func();
         return -1;
     }
 
-    if(gpio_is_valid(gpio_pin_number) == false){
+    if(gpio_is_valid(line->pin) == false){
         printk(KERN_WARNING "Invalid GPIO\n");
-        cleanup_func();
         return -1;
     }
 
-    gpio_requested = 1;
-    if(gpio_request(gpio_pin_number, name) < 0) {
+    line->gpio_requested = 1;
+    if(gpio_request(line->pin, line->link.name) < 0) {
         printk(KERN_WARNING "GPIO request error\n");
-        cleanup_func();
         return -1;
     }
-    gpio_direction_input(gpio_pin_number);
+    gpio_direction_input(line->pin);
+
+    //The interrupt stays enabled, the handler only does something while the protocol thread waits for an edge
+    //(lines used as interrupts can still be switched to output with the legacy gpio_direction_output),
+    //lines on a software wire get their edges from hal_line_low instead
+#ifdef GPIO_LINK_SOFT_WIRE
+    if(line->wire_group == 0) {
+#endif
+        line->irq = gpio_to_irq(line->pin);
+        if((line->irq < 0) || (request_irq(line->irq, falling_edge_handler, IRQF_TRIGGER_FALLING, line->link.name, line) < 0)) {
+            printk(KERN_WARNING "GPIO interrupt request error\n");
+            return -1;
+        }
+        line->irq_requested = 1;
+#ifdef GPIO_LINK_SOFT_WIRE
+    }
+#endif
+
+    line->rings_allocated = 1;
+    if(alloc_shared_rings(line) < 0) {
+        printk(KERN_WARNING "Allocating the message queues failed\n");
+        return -1;
+    }
+    for (i = 0; i < NUM_TX_CLASSES; i += 1) {
+        if((i != TX_CLASS_NORMAL) && (data_ring_init(&line->link.tx_rings[i], class_queue_depth) < 0)) {
+            printk(KERN_WARNING "Allocating the message queues failed\n");
+            return -1;
+        }
+    }
+
+    //Statistics are optional, the line works without debugfs
+    debugfs_create_file(line->link.name, S_IRUGO, debugfs_dir, line, &gpio_stats_fops);
+#ifdef GPIO_LINK_SOFT_WIRE
+    if(line->wire_group != 0) {
+        printk(KERN_WARNING "%s is on software wire %d, its pin and interrupt are not used\n", line->link.name,
+               line->wire_group);
+        soft_wire_join(line);
+    }
+#endif
+    return 0;
+}
+
+//This function is called to load the driver into the kernel (by insmod)
+static int __init gpio_driver_init(void){
+    int i;
+
+    if((timing_profile < 0) || (timing_profile >= NUM_TIMING_PROFILES)) {
+        printk(KERN_WARNING "Invalid timing profile\n");
+        return -1;
+    }
+    if((tx_queue_depth < 1) || (rx_queue_depth < 1) || (class_queue_depth < 1)) {
+        printk(KERN_WARNING "Invalid queue depth\n");
+        return -1;
+    }
+    if(num_tx_weights != NUM_TX_CLASSES) {
+        printk(KERN_WARNING "tx_weights needs a weight between 1 and 1000 for each of the %d classes\n",
+               NUM_TX_CLASSES);
+        return -1;
+    }
+
+    default_config.frame_mode = frame_mode;
+    default_config.fec_mode = fec_mode;
+    default_config.session_mode = session_mode;
+    default_config.negotiate_speed = negotiate_speed;
+    default_config.turnaround = turnaround;
+    default_config.reply_window_us = reply_window_us;
+    default_config.max_retries = max_retries;
+    default_config.retry_backoff_us = retry_backoff_us;
+    default_config.idle_poll_min_us = idle_poll_min_us;
+    default_config.idle_poll_max_us = idle_poll_max_us;
+    default_config.idle_poll_backoff = idle_poll_backoff;
+    default_config.bus_mode = bus_mode;
+    default_config.rx_full_policy = rx_full_policy;
+    default_config.tx_scheduler = tx_scheduler;
+    for (i = 0; i < NUM_TX_CLASSES; i += 1) {
+        default_config.tx_weights[i] = tx_weights[i];
+    }
+    if(check_link_config(&default_config) < 0) {
+        return -1;
+    }
+    protocol_init();
+
+    //Without gpio_pins the module drives a single line, set up like older versions
+    if(num_gpio_pins == 0) {
+        gpio_pins[0] = gpio_pin_number;
+        comm_roles[0] = comm_role;
+        num_gpio_pins = 1;
+        num_comm_roles = 1;
+    }
+    if(num_comm_roles != num_gpio_pins) {
+        printk(KERN_WARNING "comm_roles needs one entry for every pin in gpio_pins\n");
+        return -1;
+    }
+    for (i = 0; i < num_comm_roles; i += 1) {
+        if((comm_roles[i] != 0) && (comm_roles[i] != 1)) {
+            printk(KERN_WARNING "Invalid comm role\n");
+            return -1;
+        }
+        //Every slave on a bus needs an address
+        if(bus_mode && (comm_roles[i] == 1) &&
+           ((i >= num_bus_addresses) || (bus_addresses[i] < 1) || (bus_addresses[i] >= BUS_ADDRESSES))) {
+            printk(KERN_WARNING "bus_mode needs an address between 1 and 127 for every slave\n");
+            return -1;
+        }
+    }
+#ifdef GPIO_LINK_SOFT_WIRE
+    for (i = 0; i < num_wire_groups; i += 1) {
+        if((wire_groups[i] < 0) || (wire_groups[i] > MAX_LINES)) {
+            printk(KERN_WARNING "wire_groups entries must be between 0 and %d\n", MAX_LINES);
+            return -1;
+        }
+    }
+#endif
 
-    if(data_queue_init(&queue_to_send) < 0){
+    lines = kcalloc(num_gpio_pins, sizeof(struct GpioLine), GFP_KERNEL);
+    if(lines == NULL) {
         printk(KERN_WARNING "kmalloc failed\n");
+        return -1;
+    }
+    num_lines = num_gpio_pins;
+
+    if(alloc_chrdev_region(&dev, 0, num_lines, DEVICE_NAME) < 0) {
+        printk(KERN_WARNING "Error during dev number allocation\n");
         cleanup_func();
         return -1;
     }
-    queue_kmalloc = 1;
+    chrdev_allocated = 1;
+
+    debugfs_dir = debugfs_create_dir(DEVICE_NAME, NULL);
+
+    for (i = 0; i < num_lines; i += 1) {
+        lines[i].link.index = i;
+        lines[i].pin = gpio_pins[i];
+        lines[i].link.role = comm_roles[i];
+        lines[i].cpu = (i < num_thread_cpus) ? thread_cpus[i] : -1;
+#ifdef GPIO_LINK_SOFT_WIRE
+        lines[i].wire_group = (i < num_wire_groups) ? wire_groups[i] : 0;
+#endif
+        lines[i].link.bus_address = (bus_mode && (comm_roles[i] == 1)) ? bus_addresses[i] : 0;
+        if(gpio_line_init(&lines[i]) < 0) {
+            cleanup_func();
+            return -1;
+        }
+    }
 
-    printk("Driver loaded\n");
+    printk("Driver loaded with %d lines\n", num_lines);
     return 0;
 }
 
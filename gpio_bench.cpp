@@ -0,0 +1,774 @@
+//Benchmark of the whole stack: the char devices, the protocol threads and the line. Both ends normally run in this
+//process (with gpio_sim_setup.sh they are two lines of gpio-sim on a software wire inside the module), so one way
+//latency can be measured with a single clock. On two boards run it with --side master on one and --side slave on
+//the other, then only ping-pong latency means something.
+//Every message starts with a marker, its sequence number and the time it was written (microseconds of
+//CLOCK_MONOTONIC), the rest is a pattern the receiver checks. Pongs are written in the reply class (GPIO_SET_TX_CLASS),
+//like the answers of user_level_program.cpp.
+//Built with -DUSER_LINK (make bench-user) it can also run both ends in user space over libgpiod (see user_link.h)
+//instead of the module, to compare the two on the same lines.
+//Build with make bench, ./gpio_bench --help lists the options
+#include <iostream>
+#include <vector>
+#include <string>
+#include <map>
+#include <deque>
+#include <algorithm>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <csignal>
+#ifdef USER_LINK
+#include "user_link.h"
+#endif
+
+#define MAGIC 'k'
+#define USER_APP_REG _IOW(MAGIC, 1, int*)
+#define USER_APP_UNREG _IO(MAGIC, 2)
+#define GPIO_GET_TX_ERRORS _IOR(MAGIC, 10, int*)
+#define GPIO_SET_TX_CLASS _IOW(MAGIC, 11, struct TxClass*)
+#define MASTERNAME "/dev/gpio_master"
+#define SLAVENAME "/dev/gpio_slave"
+#define STATS_DIR "/sys/kernel/debug/gpio_link/"
+#define PARAMS_DIR "/sys/module/gpio_link/parameters/"
+
+#define MAX_MESSAGE_LENGTH 4096
+//Longest message of frame_mode=0
+#define MAX_PAYLOAD_LENGTH 10
+#define MARKER 0x42
+#define MARKER_PONG 0x43
+//Marker, sequence number and time stamp
+#define HEADER_LENGTH 9
+//A ping without a pong for this long is counted as lost and the next one is sent
+#define PING_TIMEOUT_US 1000000
+
+#define WORKLOAD_FLOOD 0
+#define WORKLOAD_BIDIR 1
+#define WORKLOAD_PINGPONG 2
+#define WORKLOAD_MIXED 3
+
+#ifndef USER_LINK
+//Same as protocol.h
+#define TX_CLASS_REPLY 1
+#define TX_CLASS_NORMAL 2
+#endif
+
+struct TxClass {
+    int32_t tx_class;
+    uint32_t deadline_us;
+};
+
+static const char *workload_names[] = {"flood", "bidir", "pingpong", "mixed"};
+//Message lengths of the mixed workload, one after the other (the ones that don't fit frame_mode=0 are skipped)
+static const int mixed_lengths[] = {9, 10, 64, 10, 256, 9, 1024, 10};
+
+struct Options {
+    int workload = WORKLOAD_FLOOD;
+    int message_length = 10;
+    //Messages per second of every sender, 0 keeps the send ring full
+    double rate = 0;
+    double duration_s = 10;
+    //Which devices this process drives: 0 master, 1 slave, 2 both
+    int side = 2;
+    int json = 0;
+    std::string master_dev = MASTERNAME;
+    std::string slave_dev = SLAVENAME;
+#ifdef USER_LINK
+    //User space backend: chip and line offsets of the master and the slave, the rest like the module parameters
+    std::string chip;
+    int offsets[2] = {-1, -1};
+    int cpus[2] = {-1, -1};
+    int priority = 80;
+    int wire = 0;
+    struct LinkConfig config = {};
+    int timing_profile = 0;
+#endif
+};
+
+//One device, and the direction of the messages it sends (0 master to slave, 1 slave to master)
+struct Endpoint {
+    const char *name;
+    int fd = -1;
+    int registered = 0;
+    int direction;
+    int sends = 0;
+    int ping_outstanding = 0;
+    //The slave of pingpong only sends pongs, they go in the reply class
+    int tx_class = TX_CLASS_NORMAL;
+    uint32_t next_seq = 0;
+    uint32_t expected_seq = 0;
+    double next_send_us = 0;
+    //Pongs that didn't fit in the ring yet
+    std::deque<std::vector<uint8_t> > pongs;
+    std::map<std::string, unsigned long long> stats_start;
+    int tx_errors_start = 0;
+#ifdef USER_LINK
+    struct UserLink *user = NULL;
+#endif
+};
+
+//What arrived in one direction
+struct Direction {
+    unsigned long long sent = 0;
+    unsigned long long delivered = 0;
+    unsigned long long bytes = 0;
+    unsigned long long duplicates = 0;
+    unsigned long long gaps = 0;
+    unsigned long long corrupted = 0;
+    unsigned long long write_errors = 0;
+    std::vector<double> latencies;
+};
+
+static volatile sig_atomic_t stop = 0;
+static Direction directions[2];
+static std::vector<double> round_trips;
+static unsigned long long pings_lost = 0;
+static int frame_mode = -1;
+//Both ends on a software wire (wire_groups of the module, --wire of the user space backend) instead of the pins
+static int software_wire = 0;
+
+static void signal_handler(int sig_num) {
+    stop = 1;
+}
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+//--------------------Module info--------------------
+
+//"name value" pairs of the debugfs statistics of a line (needs root and debugfs), empty if they can't be read
+static std::map<std::string, unsigned long long> read_stats(Endpoint &endpoint) {
+    std::map<std::string, unsigned long long> stats;
+    std::string prefix = std::string(endpoint.name).substr(5);
+    DIR *dir;
+    struct dirent *entry;
+#ifdef USER_LINK
+    if(endpoint.user != NULL) {
+        const struct LinkStats *s = user_link_stats(endpoint.user);
+        stats["frames_sent"] = s->frames_sent;
+        stats["retries"] = s->retries;
+        stats["naks_received"] = s->naks_received;
+        stats["ack_timeouts"] = s->ack_timeouts;
+        stats["checksum_errors"] = s->checksum_errors;
+        stats["busy_received"] = s->busy_received;
+        stats["resets"] = s->resets;
+        stats["no_presence"] = s->no_presence;
+        stats["rx_dropped"] = 0;
+        return stats;
+    }
+#endif
+    dir = opendir(STATS_DIR);
+    if(dir == NULL) {
+        return stats;
+    }
+    //The files are named after the line, gpio_master0, gpio_slave1...
+    while((entry = readdir(dir)) != NULL) {
+        if(strncmp(entry->d_name, prefix.c_str(), prefix.length()) != 0) {
+            continue;
+        }
+        FILE *file = fopen((std::string(STATS_DIR) + entry->d_name).c_str(), "r");
+        char key[64];
+        unsigned long long value;
+        if(file == NULL) {
+            break;
+        }
+        while(fscanf(file, "%63s %llu", key, &value) == 2) {
+            stats[key] = value;
+        }
+        fclose(file);
+        break;
+    }
+    closedir(dir);
+    return stats;
+}
+
+//Parameters the module was loaded with, so results can be told apart later
+static std::map<std::string, std::string> read_params() {
+    std::map<std::string, std::string> params;
+    DIR *dir = opendir(PARAMS_DIR);
+    struct dirent *entry;
+    if(dir == NULL) {
+        return params;
+    }
+    while((entry = readdir(dir)) != NULL) {
+        char value[256];
+        if(entry->d_name[0] == '.') {
+            continue;
+        }
+        FILE *file = fopen((std::string(PARAMS_DIR) + entry->d_name).c_str(), "r");
+        if(file == NULL) {
+            continue;
+        }
+        if(fgets(value, sizeof(value), file) != NULL) {
+            value[strcspn(value, "\n")] = 0;
+            params[entry->d_name] = value;
+        }
+        fclose(file);
+    }
+    closedir(dir);
+    return params;
+}
+
+static int tx_errors(Endpoint &endpoint) {
+    int failed = 0;
+#ifdef USER_LINK
+    if(endpoint.user != NULL) {
+        return user_link_tx_errors(endpoint.user);
+    }
+#endif
+    ioctl(endpoint.fd, GPIO_GET_TX_ERRORS, &failed);
+    return failed;
+}
+
+//The device file or the user space link, they take and return the same things
+static ssize_t endpoint_write(Endpoint &endpoint, const void *buff, size_t count) {
+#ifdef USER_LINK
+    if(endpoint.user != NULL) {
+        return user_link_write_class(endpoint.user, buff, count, endpoint.tx_class, 0);
+    }
+#endif
+    return write(endpoint.fd, buff, count);
+}
+
+static ssize_t endpoint_read(Endpoint &endpoint, void *buff, size_t count) {
+#ifdef USER_LINK
+    if(endpoint.user != NULL) {
+        return user_link_read(endpoint.user, buff, count, 1);
+    }
+#endif
+    return read(endpoint.fd, buff, count);
+}
+
+//--------------------Messages--------------------
+
+static int next_length(const Options &options, uint32_t seq) {
+    int n = sizeof(mixed_lengths) / sizeof(mixed_lengths[0]);
+    if(options.workload != WORKLOAD_MIXED) {
+        return options.message_length;
+    }
+    for(int i = 0; i < n; i += 1) {
+        int length = mixed_lengths[(seq + i) % n];
+        if((frame_mode != 0) || (length <= MAX_PAYLOAD_LENGTH)) {
+            return length;
+        }
+    }
+    return HEADER_LENGTH;
+}
+
+static std::vector<uint8_t> build_message(uint8_t marker, uint32_t seq, uint32_t stamp, int length) {
+    std::vector<uint8_t> msg(length);
+    msg[0] = marker;
+    memcpy(&msg[1], &seq, 4);
+    memcpy(&msg[5], &stamp, 4);
+    for(int i = HEADER_LENGTH; i < length; i += 1) {
+        msg[i] = (uint8_t) (seq + i);
+    }
+    return msg;
+}
+
+//Returns 0 if the message was queued, -1 if the ring is full. A message the driver gave up on is reported by
+//the next write (EIO), it is counted and the write is tried again
+static int write_message(Endpoint &endpoint, const std::vector<uint8_t> &msg) {
+    for(int tries = 0; tries < 2; tries += 1) {
+        if(endpoint_write(endpoint, msg.data(), msg.size()) == (ssize_t) msg.size()) {
+            return 0;
+        }
+        if(errno != EIO) {
+            return -1;
+        }
+        directions[endpoint.direction].write_errors += 1;
+    }
+    return -1;
+}
+
+static void handle_message(const Options &options, Endpoint &endpoint, const uint8_t *msg, int len) {
+    Direction &direction = directions[1 - endpoint.direction];
+    uint32_t seq;
+    uint32_t stamp;
+    if((len < HEADER_LENGTH) || ((msg[0] != MARKER) && (msg[0] != MARKER_PONG))) {
+        direction.corrupted += 1;
+        return;
+    }
+    memcpy(&seq, &msg[1], 4);
+    memcpy(&stamp, &msg[5], 4);
+    for(int i = HEADER_LENGTH; i < len; i += 1) {
+        if(msg[i] != (uint8_t) (seq + i)) {
+            direction.corrupted += 1;
+            return;
+        }
+    }
+    //The time stamp only means something if it was taken in this process
+    double latency = ((uint32_t) (uint64_t) now_us() - stamp);
+
+    if(msg[0] == MARKER_PONG) {
+        //Late pongs of pings that timed out are duplicates
+        if(seq + 1 != endpoint.next_seq) {
+            direction.duplicates += 1;
+            return;
+        }
+        direction.delivered += 1;
+        direction.bytes += len;
+        round_trips.push_back(latency);
+        endpoint.ping_outstanding = 0;
+        endpoint.next_send_us = now_us();
+        return;
+    }
+    if(seq < endpoint.expected_seq) {
+        direction.duplicates += 1;
+        return;
+    }
+    direction.gaps += seq - endpoint.expected_seq;
+    endpoint.expected_seq = seq + 1;
+    direction.delivered += 1;
+    direction.bytes += len;
+    if(options.side == 2) {
+        direction.latencies.push_back(latency);
+    }
+    if(options.workload == WORKLOAD_PINGPONG) {
+        endpoint.pongs.push_back(build_message(MARKER_PONG, seq, stamp, len));
+    }
+}
+
+//A read returns as many whole records as fit, every one is the length in two bytes and the message
+static void read_messages(const Options &options, Endpoint &endpoint) {
+    static uint8_t buffer[64 * 1024];
+    while(1) {
+        int total = endpoint_read(endpoint, buffer, sizeof(buffer));
+        int pos = 0;
+        if(total <= 0) {
+            return;
+        }
+        while(pos + 2 <= total) {
+            int len = buffer[pos] | (buffer[pos + 1] << 8);
+            if(pos + 2 + len > total) {
+                break;
+            }
+            handle_message(options, endpoint, &buffer[pos + 2], len);
+            pos += 2 + len;
+        }
+    }
+}
+
+//Fills the send ring (or sends the messages that are due with --rate, or the next ping)
+static void send_messages(const Options &options, Endpoint &endpoint) {
+    while(!endpoint.pongs.empty()) {
+        if(write_message(endpoint, endpoint.pongs.front()) < 0) {
+            return;
+        }
+        endpoint.pongs.pop_front();
+    }
+    if(!endpoint.sends) {
+        return;
+    }
+    double now = now_us();
+    while(now >= endpoint.next_send_us) {
+        uint32_t seq = endpoint.next_seq;
+        std::vector<uint8_t> msg = build_message(MARKER, seq, (uint32_t) (uint64_t) now, next_length(options, seq));
+        if(write_message(endpoint, msg) < 0) {
+            return;
+        }
+        endpoint.next_seq += 1;
+        directions[endpoint.direction].sent += 1;
+        if(options.workload == WORKLOAD_PINGPONG) {
+            //Wait for the pong, handle_message brings this forward
+            endpoint.ping_outstanding = 1;
+            endpoint.next_send_us = now + PING_TIMEOUT_US;
+            return;
+        }
+        if(options.rate > 0) {
+            endpoint.next_send_us += 1e6 / options.rate;
+        }
+    }
+}
+
+//--------------------Output--------------------
+
+static double percentile(std::vector<double> &values, double p) {
+    size_t i;
+    if(values.empty()) {
+        return 0;
+    }
+    i = (size_t) (p * (values.size() - 1));
+    std::nth_element(values.begin(), values.begin() + i, values.end());
+    return values[i];
+}
+
+static unsigned long long stat_delta(std::vector<Endpoint> &endpoints, const std::string &key) {
+    unsigned long long total = 0;
+    for(Endpoint &endpoint : endpoints) {
+        std::map<std::string, unsigned long long> now = read_stats(endpoint);
+        if(now.count(key) && endpoint.stats_start.count(key)) {
+            total += now[key] - endpoint.stats_start[key];
+        }
+    }
+    return total;
+}
+
+static void print_result(const Options &options, std::vector<Endpoint> &endpoints, double elapsed_s) {
+    static const char *keys[] = {"frames_sent", "retries", "naks_received", "ack_timeouts", "checksum_errors",
+                                 "busy_received", "resets", "no_presence", "rx_dropped"};
+    static const char *direction_names[] = {"master_to_slave", "slave_to_master"};
+    std::map<std::string, unsigned long long> counters;
+    std::map<std::string, std::string> params = read_params();
+    unsigned long long tx_failed = 0;
+    unsigned long long delivered = directions[0].delivered + directions[1].delivered;
+    unsigned long long bytes = directions[0].bytes + directions[1].bytes;
+    std::vector<double> all = directions[0].latencies;
+    all.insert(all.end(), directions[1].latencies.begin(), directions[1].latencies.end());
+    if(options.workload == WORKLOAD_PINGPONG) {
+        all = round_trips;
+    }
+    for(const char *key : keys) {
+        counters[key] = stat_delta(endpoints, key);
+    }
+    for(Endpoint &endpoint : endpoints) {
+        tx_failed += tx_errors(endpoint) - endpoint.tx_errors_start;
+    }
+    double retry_rate = counters["frames_sent"] ? (double) counters["retries"] / counters["frames_sent"] : 0;
+
+    if(options.json) {
+        //One object per run, so results of several runs can be appended to one file
+        printf("{\"workload\": \"%s\", \"length\": %d, \"rate\": %g, \"seconds\": %.3f, ",
+               workload_names[options.workload], options.message_length, options.rate, elapsed_s);
+        printf("\"wire\": \"%s\", ", software_wire ? "software" : "gpio");
+        printf("\"msgs_per_s\": %.1f, \"goodput_bytes_per_s\": %.1f, ", delivered / elapsed_s, bytes / elapsed_s);
+        printf("\"latency_us\": {\"kind\": \"%s\", \"count\": %zu, \"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, "
+               "\"max\": %.1f}, ", (options.workload == WORKLOAD_PINGPONG) ? "round_trip" : "one_way", all.size(),
+               percentile(all, 0.5), percentile(all, 0.99), percentile(all, 0.999), percentile(all, 1.0));
+        for(int i = 0; i < 2; i += 1) {
+            Direction &d = directions[i];
+            printf("\"%s\": {\"sent\": %llu, \"delivered\": %llu, \"bytes\": %llu, \"duplicates\": %llu, "
+                   "\"gaps\": %llu, \"corrupted\": %llu, \"write_errors\": %llu}, ", direction_names[i], d.sent,
+                   d.delivered, d.bytes, d.duplicates, d.gaps, d.corrupted, d.write_errors);
+        }
+        printf("\"pings_lost\": %llu, \"tx_failed\": %llu, \"retry_rate\": %.6f, \"counters\": {", pings_lost,
+               tx_failed, retry_rate);
+        for(size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i += 1) {
+            printf("%s\"%s\": %llu", (i > 0) ? ", " : "", keys[i], counters[keys[i]]);
+        }
+        printf("}, \"params\": {");
+        for(auto it = params.begin(); it != params.end(); ++it) {
+            printf("%s\"%s\": \"%s\"", (it != params.begin()) ? ", " : "", it->first.c_str(), it->second.c_str());
+        }
+        printf("}}\n");
+        return;
+    }
+
+    printf("%s, %d byte messages, %.1fs\n", workload_names[options.workload], options.message_length, elapsed_s);
+    if(software_wire) {
+        printf("wire: software, the GPIO pins and their interrupts were not used\n");
+    }
+    printf("%.1f msgs/s, goodput %.0f B/s\n", delivered / elapsed_s, bytes / elapsed_s);
+    printf("%s latency: %zu samples, p50 %.0fus p99 %.0fus p999 %.0fus max %.0fus\n",
+           (options.workload == WORKLOAD_PINGPONG) ? "round trip" : "one way", all.size(), percentile(all, 0.5),
+           percentile(all, 0.99), percentile(all, 0.999), percentile(all, 1.0));
+    for(int i = 0; i < 2; i += 1) {
+        Direction &d = directions[i];
+        printf("%s: sent %llu delivered %llu duplicates %llu gaps %llu corrupted %llu write_errors %llu\n",
+               direction_names[i], d.sent, d.delivered, d.duplicates, d.gaps, d.corrupted, d.write_errors);
+    }
+    printf("pings_lost %llu tx_failed %llu retry_rate %.4f\n", pings_lost, tx_failed, retry_rate);
+    if(counters["frames_sent"] == 0) {
+        printf("(no protocol counters, they need root and debugfs)\n");
+        return;
+    }
+    for(const char *key : keys) {
+        printf("%s %llu\n", key, counters[key]);
+    }
+}
+
+//--------------------Main--------------------
+
+static void usage() {
+    std::cout << "Usage: gpio_bench [options]\n"
+              << "  --workload flood|bidir|pingpong|mixed   (default flood, master to slave, mixed is a flood\n"
+              << "                        of 9 to 1024 byte messages)\n"
+              << "  --length N            message length, 9 to 4096 (default 10, at most 10 with frame_mode=0)\n"
+              << "  --rate N              messages per second of every sender, 0 keeps the send ring full\n"
+              << "  --duration S          seconds to run (default 10)\n"
+              << "  --side master|slave|both   devices this process uses (default both), on two boards the\n"
+              << "                        slave side answers pings and counts what arrives\n"
+              << "  --master DEV --slave DEV   device files (default " MASTERNAME " and " SLAVENAME ")\n"
+              << "  --json                one JSON object with the results and the module parameters\n"
+#ifdef USER_LINK
+              << "User space backend instead of the module (both ends run in this process):\n"
+              << "  --chip CHIP --lines M,S    GPIO chip and the offsets of the master and slave lines\n"
+              << "  --wire                both lines share a software wire, for gpio-sim (like wire_groups)\n"
+              << "  --cpus M,S --priority N    CPUs and SCHED_FIFO priority of the protocol threads\n"
+              << "  --frame-mode N --fec-mode N --session-mode N --turnaround N --timing-profile N\n"
+#endif
+              ;
+}
+
+static int parse_options(int argc, char **argv, Options &options) {
+    for(int i = 1; i < argc; i += 1) {
+        std::string arg = argv[i];
+        if(arg == "--json") {
+            options.json = 1;
+            continue;
+        }
+#ifdef USER_LINK
+        if(arg == "--wire") {
+            options.wire = 1;
+            continue;
+        }
+#endif
+        if((arg == "--help") || (i + 1 >= argc)) {
+            return -1;
+        }
+        std::string value = argv[++i];
+        if(arg == "--workload") {
+            options.workload = -1;
+            for(int w = 0; w < 4; w += 1) {
+                if(value == workload_names[w]) {
+                    options.workload = w;
+                }
+            }
+        }
+        else if(arg == "--length") options.message_length = atoi(value.c_str());
+        else if(arg == "--rate") options.rate = atof(value.c_str());
+        else if(arg == "--duration") options.duration_s = atof(value.c_str());
+        else if(arg == "--side") options.side = (value == "master") ? 0 : (value == "slave") ? 1 : (value == "both") ? 2 : -1;
+        else if(arg == "--master") options.master_dev = value;
+        else if(arg == "--slave") options.slave_dev = value;
+#ifdef USER_LINK
+        else if(arg == "--chip") options.chip = value;
+        else if(arg == "--lines") sscanf(value.c_str(), "%d,%d", &options.offsets[0], &options.offsets[1]);
+        else if(arg == "--cpus") sscanf(value.c_str(), "%d,%d", &options.cpus[0], &options.cpus[1]);
+        else if(arg == "--priority") options.priority = atoi(value.c_str());
+        else if(arg == "--frame-mode") options.config.frame_mode = atoi(value.c_str());
+        else if(arg == "--fec-mode") options.config.fec_mode = atoi(value.c_str());
+        else if(arg == "--session-mode") options.config.session_mode = atoi(value.c_str());
+        else if(arg == "--turnaround") options.config.turnaround = atoi(value.c_str());
+        else if(arg == "--timing-profile") options.timing_profile = atoi(value.c_str());
+#endif
+        else return -1;
+    }
+    if((options.workload < 0) || (options.side < 0) || (options.duration_s <= 0) || (options.rate < 0)) {
+        return -1;
+    }
+    return 0;
+}
+
+static int open_endpoint(const Options &options, Endpoint &endpoint, const std::string &dev) {
+    int pid = 0;
+    if((options.workload == WORKLOAD_PINGPONG) && (endpoint.direction == 1)) {
+        endpoint.tx_class = TX_CLASS_REPLY;
+    }
+#ifdef USER_LINK
+    if(!options.chip.empty()) {
+        struct UserLinkOptions user_options;
+        user_link_default_options(&user_options);
+        user_options.chip = options.chip.c_str();
+        user_options.offset = options.offsets[endpoint.direction];
+        user_options.role = endpoint.direction;
+        user_options.timing_profile = options.timing_profile;
+        user_options.cpu = options.cpus[endpoint.direction];
+        user_options.priority = options.priority;
+        user_options.wire_group = options.wire;
+        //The benchmark is the whole process, so it can lock all of its memory for the real-time threads
+        user_options.lock_memory = (options.priority > 0);
+        endpoint.user = user_link_open(&user_options, &options.config);
+        if(endpoint.user == NULL) {
+            std::cout << "Couldn't open line " << user_options.offset << " of " << options.chip << std::endl;
+            return -1;
+        }
+        endpoint.fd = user_link_fd(endpoint.user);
+        endpoint.stats_start = read_stats(endpoint);
+        endpoint.tx_errors_start = tx_errors(endpoint);
+        return 0;
+    }
+#endif
+    endpoint.fd = open(dev.c_str(), O_RDWR | O_NONBLOCK);
+    if(endpoint.fd < 0) {
+        std::cout << "Couldn't open " << dev << std::endl;
+        return -1;
+    }
+    //pid 0 starts the protocol thread without signals, this program polls
+    if(ioctl(endpoint.fd, USER_APP_REG, &pid) < 0) {
+        std::cout << "Couldn't register with " << dev << " (is another app using it?)" << std::endl;
+        return -1;
+    }
+    endpoint.registered = 1;
+    if(endpoint.tx_class != TX_CLASS_NORMAL) {
+        struct TxClass tx_class = {endpoint.tx_class, 0};
+        if(ioctl(endpoint.fd, GPIO_SET_TX_CLASS, &tx_class) < 0) {
+            std::cout << "Couldn't set the message class of " << dev << std::endl;
+            return -1;
+        }
+    }
+    endpoint.stats_start = read_stats(endpoint);
+    endpoint.tx_errors_start = tx_errors(endpoint);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    std::vector<Endpoint> endpoints;
+    std::map<std::string, std::string> params;
+    int result = 0;
+
+    if(parse_options(argc, argv, options) < 0) {
+        usage();
+        return 1;
+    }
+    params = read_params();
+    software_wire = params.count("wire_groups") && (params["wire_groups"].find_first_of("123456789") != std::string::npos);
+#ifdef USER_LINK
+    if(!options.chip.empty()) {
+        //Same defaults as the module
+        struct LinkConfig &c = options.config;
+        c.max_retries = 2;
+        c.retry_backoff_us = 250;
+        c.idle_poll_min_us = 200;
+        c.idle_poll_max_us = 10000;
+        c.idle_poll_backoff = 2;
+        c.tx_weights[TX_CLASS_URGENT] = 8;
+        c.tx_weights[TX_CLASS_REPLY] = 4;
+        c.tx_weights[TX_CLASS_NORMAL] = 2;
+        c.tx_weights[TX_CLASS_BULK] = 1;
+        if((options.side != 2) || (options.offsets[0] < 0) || (options.offsets[1] < 0)) {
+            std::cout << "The user space backend runs both ends, it needs --lines master,slave" << std::endl;
+            return 1;
+        }
+        if(c.frame_mode == 0) {
+            c.fec_mode = 0;
+            c.session_mode = 0;
+            c.turnaround = 0;
+        }
+        params.clear();
+        params["backend"] = "user";
+        params["chip"] = options.chip;
+        params["wire"] = std::to_string(options.wire);
+        software_wire = options.wire;
+        params["priority"] = std::to_string(options.priority);
+        params["frame_mode"] = std::to_string(c.frame_mode);
+        params["fec_mode"] = std::to_string(c.fec_mode);
+        params["session_mode"] = std::to_string(c.session_mode);
+        params["turnaround"] = std::to_string(c.turnaround);
+        params["timing_profile"] = std::to_string(options.timing_profile);
+    }
+#endif
+    if(params.count("frame_mode")) {
+        frame_mode = atoi(params["frame_mode"].c_str());
+    }
+    if(params.count("bus_mode") && (params["bus_mode"] != "0")) {
+        std::cout << "The benchmark needs a point to point link, the module is loaded with bus_mode" << std::endl;
+        return 1;
+    }
+    if((options.message_length < HEADER_LENGTH) || (options.message_length > MAX_MESSAGE_LENGTH) ||
+       ((frame_mode == 0) && (options.message_length > MAX_PAYLOAD_LENGTH))) {
+        std::cout << "Messages are 9 to 4096 bytes long, with frame_mode=0 at most 10" << std::endl;
+        return 1;
+    }
+
+    if(options.side != 1) {
+        Endpoint master;
+        master.name = MASTERNAME;
+        master.direction = 0;
+        master.sends = 1;
+        endpoints.push_back(master);
+    }
+    if(options.side != 0) {
+        Endpoint slave;
+        slave.name = SLAVENAME;
+        slave.direction = 1;
+        slave.sends = (options.workload == WORKLOAD_BIDIR);
+        endpoints.push_back(slave);
+    }
+    for(Endpoint &endpoint : endpoints) {
+        if(open_endpoint(options, endpoint, (endpoint.direction == 0) ? options.master_dev : options.slave_dev) < 0) {
+            result = 1;
+            break;
+        }
+    }
+    signal(SIGINT, signal_handler);
+
+    double start = now_us();
+    double end = start + options.duration_s * 1e6;
+    for(Endpoint &endpoint : endpoints) {
+        endpoint.next_send_us = start;
+    }
+    while((result == 0) && (!stop) && (now_us() < end)) {
+        std::vector<struct pollfd> fds(endpoints.size());
+        double now = now_us();
+        double wake = end;
+        for(size_t i = 0; i < endpoints.size(); i += 1) {
+            Endpoint &endpoint = endpoints[i];
+            fds[i].fd = endpoint.fd;
+            fds[i].events = POLLIN;
+#ifdef USER_LINK
+            //The eventfd of a user space link is always writable, messages leaving the send ring make it readable
+            if(endpoint.user != NULL) {
+                if((!endpoint.pongs.empty()) || (endpoint.sends && (endpoint.next_send_us <= now))) {
+                    wake = std::min(wake, now + 1000);
+                }
+                else if(endpoint.sends) {
+                    wake = std::min(wake, endpoint.next_send_us);
+                }
+                continue;
+            }
+#endif
+            //Only ask for room in the send ring when there is something to send, it is there most of the time
+            if((!endpoint.pongs.empty()) || (endpoint.sends && (endpoint.next_send_us <= now))) {
+                fds[i].events |= POLLOUT;
+            }
+            else if(endpoint.sends) {
+                wake = std::min(wake, endpoint.next_send_us);
+            }
+        }
+        if(poll(fds.data(), fds.size(), (int) ((wake - now) / 1000) + 1) < 0) {
+            continue;
+        }
+        for(size_t i = 0; i < endpoints.size(); i += 1) {
+            Endpoint &endpoint = endpoints[i];
+            if(fds[i].revents & POLLIN) {
+#ifdef USER_LINK
+                uint64_t count;
+                if((endpoint.user != NULL) && (read(endpoint.fd, &count, sizeof(count)) < 0)) {
+                    continue;
+                }
+#endif
+                read_messages(options, endpoint);
+            }
+            //A ping that timed out was lost somewhere, send_messages sends the next one
+            if(endpoint.ping_outstanding && (now_us() >= endpoint.next_send_us)) {
+                endpoint.ping_outstanding = 0;
+                pings_lost += 1;
+            }
+            send_messages(options, endpoint);
+        }
+    }
+    double elapsed_s = (now_us() - start) / 1e6;
+
+    if(result == 0) {
+        //Messages still on the way count as sent but not delivered
+        print_result(options, endpoints, elapsed_s);
+    }
+    for(Endpoint &endpoint : endpoints) {
+#ifdef USER_LINK
+        if(endpoint.user != NULL) {
+            user_link_close(endpoint.user);
+            continue;
+        }
+#endif
+        if(endpoint.registered) {
+            ioctl(endpoint.fd, USER_APP_UNREG);
+        }
+        if(endpoint.fd >= 0) {
+            close(endpoint.fd);
+        }
+    }
+    return result;
+}
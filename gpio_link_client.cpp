@@ -0,0 +1,664 @@
+//Event loop of the client library, see gpio_link_client.h
+#include "gpio_link_client.h"
+#include <algorithm>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifndef GPIO_LINK_NO_URING
+#include <linux/io_uring.h>
+#endif
+
+//Same as driver.c
+#define MAGIC 'k'
+#define USER_APP_REG _IOW(MAGIC, 1, int*)
+#define USER_APP_UNREG _IO(MAGIC, 2)
+#define GPIO_SET_DEST _IOW(MAGIC, 8, int*)
+#define GPIO_GET_TX_ERRORS _IOR(MAGIC, 10, int*)
+#define GPIO_SET_TX_CLASS _IOW(MAGIC, 11, struct TxClass*)
+
+struct TxClass {
+    int32_t tx_class;
+    uint32_t deadline_us;
+};
+
+//Operations of a link in the ring, the user data of a completion is the address of the link's Operation
+#define OP_POLL_IN 0
+#define OP_READ 1
+#define OP_POLL_OUT 2
+#define OP_WRITE 3
+//User data of the read of the wake eventfd and of cancels, pointers are never this small
+#define WAKE_DATA 1
+#define CANCEL_DATA 2
+
+#define RING_ENTRIES 256
+//A read returns as many whole messages as fit
+#define READ_BUFFER_SIZE (64 * 1024)
+#define EPOLL_EVENTS 64
+
+//--------------------GpioLink--------------------
+
+GpioLink::GpioLink(GpioLinkLoop *loop, const GpioLinkOptions &options, GpioLinkHandler handler)
+    : loop(loop), options(options), handler(handler), dest(options.dest) {
+    op_poll_in = {this, OP_POLL_IN};
+    op_read = {this, OP_READ};
+    op_poll_out = {this, OP_POLL_OUT};
+    op_write = {this, OP_WRITE};
+    read_buffer.resize(READ_BUFFER_SIZE);
+}
+
+GpioLink::~GpioLink() {
+    if(registered) {
+        //Stops the protocol thread, messages the driver didn't send yet are dropped
+        ioctl(file, USER_APP_UNREG);
+    }
+    if(file >= 0) {
+        ::close(file);
+    }
+}
+
+void GpioLink::send(const void *message, size_t length, GpioLinkSendCallback done) {
+    SendRequest request;
+    request.message.assign((const uint8_t *) message, (const uint8_t *) message + length);
+    request.dest = dest.load();
+    request.done = done;
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        if(!closing) {
+            queued.push_back(std::move(request));
+            request.done = nullptr;
+        }
+    }
+    if(request.done) {
+        request.done(-ECANCELED);
+        return;
+    }
+    loop->wake();
+}
+
+std::future<int> GpioLink::send(const void *message, size_t length) {
+    auto promise = std::make_shared<std::promise<int> >();
+    std::future<int> result = promise->get_future();
+    send(message, length, [promise](int sent) { promise->set_value(sent); });
+    return result;
+}
+
+int GpioLink::set_dest(int address) {
+    if((!options.bus_master) || (address < 1) || (address > 127)) {
+        return -1;
+    }
+    dest = address;
+    return 0;
+}
+
+void GpioLink::set_error_handler(GpioLinkErrorHandler handler) {
+    error_handler = handler;
+}
+
+//Every record is the length (two bytes, little endian), on a bus master the address, then the message
+void GpioLink::handle_records(const uint8_t *records, size_t length) {
+    size_t prefix = options.bus_master ? 3 : 2;
+    size_t pos = 0;
+    while((pos + prefix <= length) && (!closing)) {
+        size_t message_length = records[pos] | (records[pos + 1] << 8);
+        int address = options.bus_master ? records[pos + 2] : 0;
+        if(pos + prefix + message_length > length) {
+            break;
+        }
+        if(handler) {
+            handler(*this, address, records + pos + prefix, message_length);
+        }
+        pos += prefix + message_length;
+    }
+}
+
+//Called when a write failed with EIO or poll reported POLLERR, the ioctl also clears the error poll reports
+void GpioLink::report_errors() {
+    int failed = 0;
+    if(ioctl(file, GPIO_GET_TX_ERRORS, &failed) < 0) {
+        return;
+    }
+    if((unsigned int) failed != errors_reported) {
+        unsigned int count = (unsigned int) failed - errors_reported;
+        errors_reported = failed;
+        if(error_handler && (!closing)) {
+            error_handler(*this, count);
+        }
+    }
+}
+
+//The driver accepts the messages of a writev in order until one doesn't fit, accepted is their total length
+void GpioLink::finish_writes(size_t accepted) {
+    while((!writing.empty()) && (writing.front().message.size() <= accepted)) {
+        SendRequest request = std::move(writing.front());
+        writing.pop_front();
+        accepted -= request.message.size();
+        if(request.done) {
+            request.done(request.message.size());
+        }
+    }
+}
+
+void GpioLink::fail_all(int error) {
+    std::deque<SendRequest> failed;
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        failed.swap(queued);
+    }
+    failed.insert(failed.begin(), std::make_move_iterator(writing.begin()), std::make_move_iterator(writing.end()));
+    writing.clear();
+    for(SendRequest &request : failed) {
+        if(request.done) {
+            request.done(error);
+        }
+    }
+}
+
+//--------------------Loop--------------------
+
+GpioLinkLoop::GpioLinkLoop(int backend) {
+    wake_fd = eventfd(0, EFD_CLOEXEC);
+    if(wake_fd < 0) {
+        return;
+    }
+    if((backend != GPIO_LINK_BACKEND_EPOLL) && (uring_setup() == 0)) {
+        used_backend = GPIO_LINK_BACKEND_IO_URING;
+    }
+    else if(backend == GPIO_LINK_BACKEND_IO_URING) {
+        return;
+    }
+    else {
+        struct epoll_event event = {};
+        used_backend = GPIO_LINK_BACKEND_EPOLL;
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        if((epoll_fd < 0) || (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event) < 0)) {
+            return;
+        }
+    }
+    ready = true;
+    thread = std::thread(&GpioLinkLoop::run, this);
+    loop_thread = thread.get_id();
+}
+
+GpioLinkLoop::~GpioLinkLoop() {
+    if(thread.joinable()) {
+        stopping = true;
+        wake();
+        thread.join();
+    }
+    uring_teardown();
+    if(epoll_fd >= 0) {
+        ::close(epoll_fd);
+    }
+    if(wake_fd >= 0) {
+        ::close(wake_fd);
+    }
+}
+
+GpioLink *GpioLinkLoop::open(const GpioLinkOptions &options, GpioLinkHandler handler) {
+    GpioLink *link;
+    int pid = 0;
+    int failed = 0;
+    if(!ready) {
+        return NULL;
+    }
+    link = new GpioLink(this, options, handler);
+    //Non blocking, the loop only reads and writes when poll says it can
+    link->file = ::open(options.device.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if(link->file < 0) {
+        delete link;
+        return NULL;
+    }
+    //pid 0 starts the protocol thread without signals
+    if(options.start_link) {
+        if(ioctl(link->file, USER_APP_REG, &pid) < 0) {
+            delete link;
+            return NULL;
+        }
+        link->registered = 1;
+    }
+    if((options.tx_class != GPIO_LINK_CLASS_NORMAL) || (options.deadline_us > 0)) {
+        struct TxClass tx_class = {options.tx_class, options.deadline_us};
+        if(ioctl(link->file, GPIO_SET_TX_CLASS, &tx_class) < 0) {
+            delete link;
+            return NULL;
+        }
+    }
+    //Errors from before the link was opened aren't reported
+    if(ioctl(link->file, GPIO_GET_TX_ERRORS, &failed) == 0) {
+        link->errors_reported = failed;
+    }
+    {
+        std::lock_guard<std::mutex> lock(links_mutex);
+        added.push_back(link);
+    }
+    wake();
+    return link;
+}
+
+void GpioLinkLoop::close(GpioLink *link) {
+    std::future<void> closed = link->closed.get_future();
+    {
+        std::lock_guard<std::mutex> lock(link->queue_mutex);
+        link->closing = true;
+    }
+    if(std::this_thread::get_id() == loop_thread) {
+        return;
+    }
+    wake();
+    closed.wait();
+}
+
+//Only the first wake after the loop last looked at the queues writes the eventfd, and the loop thread never needs to
+//(it looks at them again before it waits)
+void GpioLinkLoop::wake() {
+    if(std::this_thread::get_id() == loop_thread) {
+        return;
+    }
+    if(!wake_pending.exchange(true)) {
+        uint64_t one = 1;
+        if(write(wake_fd, &one, sizeof(one)) < 0) {
+            wake_pending = false;
+        }
+    }
+}
+
+void GpioLinkLoop::run() {
+    while(1) {
+        run_turn();
+        if(stopping && links.empty()) {
+            std::lock_guard<std::mutex> lock(links_mutex);
+            if(added.empty()) {
+                return;
+            }
+        }
+    }
+}
+
+//Takes what the other threads queued, starts writes and reads, then waits for something to finish
+void GpioLinkLoop::run_turn() {
+    std::vector<GpioLink *> current;
+    {
+        std::lock_guard<std::mutex> lock(links_mutex);
+        links.insert(links.end(), added.begin(), added.end());
+        added.clear();
+    }
+    //Cleared before the queues are looked at, so a send after this point wakes the loop again
+    wake_pending = false;
+    current = links;
+    for(GpioLink *link : current) {
+        if(stopping) {
+            link->closing = true;
+        }
+        if(link->closing) {
+            //Writes in the ring can't be taken back, the link is closed once everything in flight completed
+            if(link->in_flight == 0) {
+                finish_close(link);
+                continue;
+            }
+        }
+        else {
+            std::lock_guard<std::mutex> lock(link->queue_mutex);
+            while(!link->queued.empty()) {
+                link->writing.push_back(std::move(link->queued.front()));
+                link->queued.pop_front();
+            }
+        }
+        //With epoll the writes are done right here, batch after batch until the ring is full
+        while((!link->closing) && (!link->write_busy) && (!link->waiting_for_room) && (!link->writing.empty())) {
+            start_write(link);
+        }
+        if(used_backend == GPIO_LINK_BACKEND_IO_URING) {
+            uring_prepare(link);
+        }
+        else {
+            epoll_update(link);
+        }
+    }
+    if(stopping && links.empty()) {
+        return;
+    }
+    if(used_backend == GPIO_LINK_BACKEND_IO_URING) {
+        uring_turn();
+    }
+    else {
+        epoll_turn();
+    }
+}
+
+//Writes the messages at the front as one writev. Messages to another slave on a bus start a new batch, the driver
+//takes the address from GPIO_SET_DEST
+void GpioLinkLoop::start_write(GpioLink *link) {
+    int dest = link->writing.front().dest;
+    size_t i;
+    if(link->options.bus_master && (dest != link->driver_dest)) {
+        if(ioctl(link->file, GPIO_SET_DEST, &dest) < 0) {
+            GpioLink::SendRequest request = std::move(link->writing.front());
+            link->writing.pop_front();
+            if(request.done) {
+                request.done(-EINVAL);
+            }
+            return;
+        }
+        link->driver_dest = dest;
+    }
+    link->write_iov.clear();
+    for(i = 0; (i < link->writing.size()) && (i < GPIO_LINK_MAX_BATCH) && (link->writing[i].dest == dest); i += 1) {
+        struct iovec iov = {link->writing[i].message.data(), link->writing[i].message.size()};
+        link->write_iov.push_back(iov);
+    }
+#ifndef GPIO_LINK_NO_URING
+    if(used_backend == GPIO_LINK_BACKEND_IO_URING) {
+        uring_push(IORING_OP_WRITEV, link->file, link->write_iov.data(), link->write_iov.size(), 0,
+                   (uintptr_t) &link->op_write, 0);
+        link->write_busy = true;
+        link->in_flight += 1;
+        return;
+    }
+#endif
+    ssize_t result = writev(link->file, link->write_iov.data(), link->write_iov.size());
+    write_done(link, (result < 0) ? -errno : result);
+}
+
+//result is what the writev returned, or -errno
+void GpioLinkLoop::write_done(GpioLink *link, ssize_t result) {
+    size_t requested = 0;
+    for(const struct iovec &iov : link->write_iov) {
+        requested += iov.iov_len;
+    }
+    if(result >= 0) {
+        link->room_reported = false;
+        link->finish_writes(result);
+        //It stopped at a message that didn't fit
+        if((size_t) result < requested) {
+            link->waiting_for_room = true;
+        }
+    }
+    else if(result == -EIO) {
+        //A message was given up, the write didn't take anything and can be tried again
+        link->report_errors();
+    }
+    else if(link->room_reported || ((result != -EPERM) && (result != -EAGAIN))) {
+        //The driver returns -1 (EPERM) for a full ring, but there was room, so the message itself is refused
+        GpioLink::SendRequest request = std::move(link->writing.front());
+        link->writing.pop_front();
+        link->room_reported = false;
+        if(request.done) {
+            request.done(-EINVAL);
+        }
+    }
+    else {
+        link->waiting_for_room = true;
+    }
+}
+
+//Poll said the send ring of the link's class has room (or that a message was given up)
+void GpioLinkLoop::room_available(GpioLink *link, int events) {
+    if(events & POLLERR) {
+        link->report_errors();
+    }
+    if(events & POLLOUT) {
+        link->waiting_for_room = false;
+        link->room_reported = true;
+    }
+}
+
+void GpioLinkLoop::finish_close(GpioLink *link) {
+    links.erase(std::find(links.begin(), links.end(), link));
+    if(used_backend == GPIO_LINK_BACKEND_EPOLL) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, link->file, NULL);
+    }
+    link->fail_all(-ECANCELED);
+    link->closed.set_value();
+    delete link;
+}
+
+//--------------------io_uring--------------------
+
+#ifndef GPIO_LINK_NO_URING
+
+int GpioLinkLoop::uring_setup() {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring_fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+    if(ring_fd < 0) {
+        return -1;
+    }
+    //Reads of the device file are linked to a poll, and the wake eventfd is read instead of polled
+    if(!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_RW_CUR_POS)) {
+        ::close(ring_fd);
+        ring_fd = -1;
+        return -1;
+    }
+    sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    sq_map_size = (cq_map_size > sq_map_size) ? cq_map_size : sq_map_size;
+    sq_map = mmap(NULL, sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = (struct io_uring_sqe *) mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                                        IORING_OFF_SQES);
+    if((sq_map == MAP_FAILED) || (sqes == MAP_FAILED)) {
+        sq_map = (sq_map == MAP_FAILED) ? NULL : sq_map;
+        sqes = (sqes == MAP_FAILED) ? NULL : sqes;
+        uring_teardown();
+        return -1;
+    }
+    //With IORING_FEAT_SINGLE_MMAP both rings are in the same mapping
+    cq_map = sq_map;
+    cq_map_size = 0;
+    sq_head = (unsigned int *) ((char *) sq_map + params.sq_off.head);
+    sq_tail = (unsigned int *) ((char *) sq_map + params.sq_off.tail);
+    sq_mask = (unsigned int *) ((char *) sq_map + params.sq_off.ring_mask);
+    sq_array = (unsigned int *) ((char *) sq_map + params.sq_off.array);
+    cq_head = (unsigned int *) ((char *) cq_map + params.cq_off.head);
+    cq_tail = (unsigned int *) ((char *) cq_map + params.cq_off.tail);
+    cq_mask = (unsigned int *) ((char *) cq_map + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *) ((char *) cq_map + params.cq_off.cqes);
+    sq_entries = params.sq_entries;
+    return 0;
+}
+
+void GpioLinkLoop::uring_teardown() {
+    if(sqes != NULL) {
+        munmap(sqes, sqes_size);
+        sqes = NULL;
+    }
+    if(sq_map != NULL) {
+        munmap(sq_map, sq_map_size);
+        sq_map = NULL;
+    }
+    if(ring_fd >= 0) {
+        ::close(ring_fd);
+        ring_fd = -1;
+    }
+}
+
+//Adds an entry to the submission ring, it is submitted with the next io_uring_enter (right away if the ring is full)
+void GpioLinkLoop::uring_push(uint8_t opcode, int fd, const void *addr, unsigned int length, unsigned int events,
+                              uint64_t user_data, uint8_t flags) {
+    unsigned int tail = *sq_tail;
+    unsigned int index;
+    struct io_uring_sqe *sqe;
+    while(tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+        int submitted = syscall(__NR_io_uring_enter, ring_fd, to_submit, 0, 0, NULL, 0);
+        if(submitted > 0) {
+            to_submit -= submitted;
+        }
+    }
+    index = tail & *sq_mask;
+    sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->flags = flags;
+    sqe->fd = fd;
+    //Reads and writes at the file position (-1), which the driver doesn't use. Polls and cancels need 0
+    if((opcode == IORING_OP_READ) || (opcode == IORING_OP_WRITEV)) {
+        sqe->off = (uint64_t) -1;
+    }
+    sqe->addr = (uintptr_t) addr;
+    sqe->len = length;
+    sqe->poll32_events = events;
+    sqe->user_data = user_data;
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    to_submit += 1;
+}
+
+//Keeps a read waiting on every link (a poll linked to the read, so the read only runs once there is something),
+//asks for room when a write was refused, and takes back what is still waiting of a link that is closed
+void GpioLinkLoop::uring_prepare(GpioLink *link) {
+    if(link->closing) {
+        if(!link->cancel_sent) {
+            uring_push(IORING_OP_ASYNC_CANCEL, -1, &link->op_poll_in, 0, 0, CANCEL_DATA, 0);
+            uring_push(IORING_OP_ASYNC_CANCEL, -1, &link->op_read, 0, 0, CANCEL_DATA, 0);
+            uring_push(IORING_OP_ASYNC_CANCEL, -1, &link->op_poll_out, 0, 0, CANCEL_DATA, 0);
+            link->cancel_sent = true;
+        }
+        return;
+    }
+    if(!link->reading) {
+        uring_push(IORING_OP_POLL_ADD, link->file, NULL, 0, POLLIN, (uintptr_t) &link->op_poll_in, IOSQE_IO_LINK);
+        uring_push(IORING_OP_READ, link->file, link->read_buffer.data(), link->read_buffer.size(), 0,
+                   (uintptr_t) &link->op_read, 0);
+        link->reading = true;
+        link->in_flight += 2;
+    }
+    if(link->waiting_for_room && (!link->room_poll_armed)) {
+        uring_push(IORING_OP_POLL_ADD, link->file, NULL, 0, POLLOUT, (uintptr_t) &link->op_poll_out, 0);
+        link->room_poll_armed = true;
+        link->in_flight += 1;
+    }
+}
+
+void GpioLinkLoop::uring_completion(GpioLink::Operation *operation, int result) {
+    GpioLink *link = operation->link;
+    link->in_flight -= 1;
+    if(operation->type == OP_POLL_IN) {
+        //POLLERR without POLLIN still runs the read, it just finds nothing
+        if((result > 0) && (result & POLLERR)) {
+            link->report_errors();
+        }
+    }
+    else if(operation->type == OP_READ) {
+        link->reading = false;
+        if(result > 0) {
+            link->handle_records(link->read_buffer.data(), result);
+        }
+    }
+    else if(operation->type == OP_POLL_OUT) {
+        link->room_poll_armed = false;
+        if(result > 0) {
+            room_available(link, result);
+        }
+        else {
+            link->waiting_for_room = false;
+        }
+    }
+    else {
+        link->write_busy = false;
+        if(link->closing) {
+            link->finish_writes((result > 0) ? result : 0);
+        }
+        else {
+            write_done(link, result);
+        }
+    }
+}
+
+//Submits everything prepared in this turn and waits for at least one completion, with a single system call
+void GpioLinkLoop::uring_turn() {
+    unsigned int head;
+    int result;
+    if(!wake_armed) {
+        uring_push(IORING_OP_READ, wake_fd, &wake_value, sizeof(wake_value), 0, WAKE_DATA, 0);
+        wake_armed = true;
+    }
+    result = syscall(__NR_io_uring_enter, ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    if(result > 0) {
+        to_submit -= ((unsigned int) result < to_submit) ? result : to_submit;
+    }
+    head = *cq_head;
+    while(head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+        uint64_t user_data = cqe->user_data;
+        int res = cqe->res;
+        head += 1;
+        //Released before the completion is handled, it can submit (and wait for room in the rings)
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        if(user_data == WAKE_DATA) {
+            wake_armed = false;
+        }
+        else if(user_data != CANCEL_DATA) {
+            uring_completion((GpioLink::Operation *) (uintptr_t) user_data, res);
+        }
+    }
+}
+
+#else
+
+int GpioLinkLoop::uring_setup() {
+    return -1;
+}
+
+void GpioLinkLoop::uring_teardown() {
+}
+
+void GpioLinkLoop::uring_prepare(GpioLink *link) {
+}
+
+void GpioLinkLoop::uring_turn() {
+}
+
+#endif
+
+//--------------------epoll--------------------
+
+//Readable is always watched, writable only while a write waits for room
+void GpioLinkLoop::epoll_update(GpioLink *link) {
+    unsigned int events = EPOLLIN | (link->waiting_for_room ? EPOLLOUT : 0);
+    struct epoll_event event = {};
+    if((link->closing) || (events == link->epoll_events)) {
+        return;
+    }
+    event.events = events;
+    event.data.ptr = link;
+    epoll_ctl(epoll_fd, (link->epoll_events == 0) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, link->file, &event);
+    link->epoll_events = events;
+}
+
+void GpioLinkLoop::epoll_turn() {
+    struct epoll_event events[EPOLL_EVENTS];
+    int count = epoll_wait(epoll_fd, events, EPOLL_EVENTS, -1);
+    for(int i = 0; i < count; i += 1) {
+        GpioLink *link = (GpioLink *) events[i].data.ptr;
+        if(link == NULL) {
+            //Nothing to do with it, the next turn looks at the queues anyway
+            if(read(wake_fd, &wake_value, sizeof(wake_value)) < 0) {
+                wake_value = 0;
+            }
+            continue;
+        }
+        if(link->closing) {
+            continue;
+        }
+        //Level triggered, the driver keeps reporting POLLERR until the error is read
+        if(events[i].events & (EPOLLERR | EPOLLOUT)) {
+            room_available(link, events[i].events);
+        }
+        if(events[i].events & EPOLLIN) {
+            ssize_t length;
+            while((!link->closing) && ((length = read(link->file, link->read_buffer.data(),
+                                                      link->read_buffer.size())) > 0)) {
+                link->handle_records(link->read_buffer.data(), length);
+            }
+        }
+    }
+}
@@ -0,0 +1,216 @@
+//Client library for the device files of the module: every link keeps one open file, and one event loop thread
+//drives any number of them. Writes and reads are submitted through io_uring (one system call per turn of the loop
+//for all links together, messages waiting on a link go out as one writev batch), or through epoll where io_uring
+//isn't there. Received messages are handed to a handler on the loop thread, sends complete with a callback or a
+//future once the driver took the message.
+//
+//  GpioLinkLoop loop;
+//  GpioLinkOptions options;
+//  options.device = "/dev/gpio_master";
+//  GpioLink *link = loop.open(options, [](GpioLink &link, int address, const uint8_t *message, size_t length) {...});
+//  std::future<int> sent = link->send("hello", 5);
+//
+//Build it with the app: g++ -pthread app.cpp gpio_link_client.cpp (-DGPIO_LINK_NO_URING builds only epoll)
+#ifndef GPIO_LINK_CLIENT_H
+#define GPIO_LINK_CLIENT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define GPIO_LINK_BACKEND_AUTO 0
+#define GPIO_LINK_BACKEND_IO_URING 1
+#define GPIO_LINK_BACKEND_EPOLL 2
+
+//Message classes of the driver (see protocol.h and GPIO_SET_TX_CLASS)
+#define GPIO_LINK_CLASS_URGENT 0
+#define GPIO_LINK_CLASS_REPLY 1
+#define GPIO_LINK_CLASS_NORMAL 2
+#define GPIO_LINK_CLASS_BULK 3
+
+//Longest message the driver takes, and how many of them go to the driver in one writev
+#define GPIO_LINK_MAX_MESSAGE 4096
+#define GPIO_LINK_MAX_BATCH 64
+
+class GpioLink;
+class GpioLinkLoop;
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+struct GpioLinkOptions {
+    //Device file of the line, like /dev/gpio_master or /dev/gpio_slave (see loader.sh)
+    std::string device;
+    //Registers as the app of the line (USER_APP_REG), which starts its protocol thread and is undone by closing the
+    //link. Turn it off for a second link to the same device, for example one that sends in another class
+    bool start_link = true;
+    //Class and deadline (microseconds, 0 == none) of everything sent on this link
+    int tx_class = GPIO_LINK_CLASS_NORMAL;
+    unsigned int deadline_us = 0;
+    //Master of a multi-drop bus (bus_mode=1): received messages carry the address of the slave, and dest (1-127) is
+    //the one sent to until set_dest() changes it
+    bool bus_master = false;
+    int dest = 0;
+};
+
+//Received message, address is the slave it came from on a bus master and 0 otherwise
+typedef std::function<void(GpioLink &link, int address, const uint8_t *message, size_t length)> GpioLinkHandler;
+//Result of a send: the length of the message once the driver queued it, or -errno (EINVAL if the driver refused
+//it, ECANCELED if the link was closed first)
+typedef std::function<void(int result)> GpioLinkSendCallback;
+//Messages sent earlier on the line were given up (max_retries or their deadline), failed is how many since the last
+//call. The driver doesn't say which ones, and every link to the same device can notice them
+typedef std::function<void(GpioLink &link, unsigned int failed)> GpioLinkErrorHandler;
+
+class GpioLink {
+public:
+    //Queues a copy of the message and wakes the loop if it sleeps, can be called from any thread. The callback
+    //runs on the loop thread
+    void send(const void *message, size_t length, GpioLinkSendCallback done);
+    std::future<int> send(const void *message, size_t length);
+    //Slave address of the messages sent from now on (bus master only), returns -1 if it isn't one. Messages that
+    //are already queued still go to the old one
+    int set_dest(int address);
+    //Runs on the loop thread, set it before sending
+    void set_error_handler(GpioLinkErrorHandler handler);
+    const std::string &device() const { return options.device; }
+    //Open file of the device, for the other ioctls
+    int fd() const { return file; }
+
+private:
+    friend class GpioLinkLoop;
+    struct SendRequest {
+        std::vector<uint8_t> message;
+        int dest;
+        GpioLinkSendCallback done;
+    };
+    //Every operation in flight in the ring points back to one of these
+    struct Operation {
+        GpioLink *link;
+        int type;
+    };
+
+    GpioLink(GpioLinkLoop *loop, const GpioLinkOptions &options, GpioLinkHandler handler);
+    ~GpioLink();
+    void handle_records(const uint8_t *records, size_t length);
+    void report_errors();
+    void finish_writes(size_t accepted);
+    void fail_all(int error);
+
+    GpioLinkLoop *loop;
+    GpioLinkOptions options;
+    GpioLinkHandler handler;
+    GpioLinkErrorHandler error_handler;
+    int file = -1;
+    int registered = 0;
+    std::atomic<int> dest;
+    //Loop thread: the address the driver sends to now, and GPIO_GET_TX_ERRORS when errors were last reported
+    int driver_dest = 0;
+    unsigned int errors_reported = 0;
+
+    //Sends of other threads wait here until the loop takes them. Once closing is set nothing is added any more
+    std::mutex queue_mutex;
+    std::deque<SendRequest> queued;
+    std::atomic<bool> closing{false};
+    //Only touched by the loop thread: the messages of the writev in flight (or waiting for room) and its buffers
+    std::deque<SendRequest> writing;
+    std::vector<struct iovec> write_iov;
+    std::vector<uint8_t> read_buffer;
+    //The driver refuses a write (-1) when the ring is full and when the message is invalid. After poll said there is
+    //room a refused write means the first message is invalid
+    bool room_reported = false;
+    std::promise<void> closed;
+
+    Operation op_poll_in;
+    Operation op_read;
+    Operation op_poll_out;
+    Operation op_write;
+    bool reading = false;
+    bool write_busy = false;
+    bool waiting_for_room = false;
+    bool room_poll_armed = false;
+    bool cancel_sent = false;
+    int in_flight = 0;
+    unsigned int epoll_events = 0;
+};
+
+class GpioLinkLoop {
+public:
+    //Starts the loop thread, backend is one of GPIO_LINK_BACKEND_*. AUTO takes io_uring if the kernel has it
+    explicit GpioLinkLoop(int backend = GPIO_LINK_BACKEND_AUTO);
+    //Closes every link that is still open and stops the thread
+    ~GpioLinkLoop();
+    //Opens the device and adds it to the loop, returns NULL if it can't be opened or set up
+    GpioLink *open(const GpioLinkOptions &options, GpioLinkHandler handler);
+    //Sends that didn't reach the driver yet fail with ECANCELED, the handler isn't called any more once this
+    //returns (from the loop thread, for example in a handler, the link is closed after the handler returns)
+    void close(GpioLink *link);
+    //GPIO_LINK_BACKEND_IO_URING or GPIO_LINK_BACKEND_EPOLL
+    int backend() const { return used_backend; }
+    //Returns -1 if the loop couldn't be set up (no eventfd, or the backend that was asked for isn't there)
+    int status() const { return ready ? 0 : -1; }
+
+private:
+    friend class GpioLink;
+    void wake();
+    void run();
+    void run_turn();
+    void start_write(GpioLink *link);
+    void write_done(GpioLink *link, ssize_t result);
+    void room_available(GpioLink *link, int events);
+    void finish_close(GpioLink *link);
+    int uring_setup();
+    void uring_teardown();
+    void uring_push(uint8_t opcode, int fd, const void *addr, unsigned int length, unsigned int events,
+                    uint64_t user_data, uint8_t flags);
+    void uring_prepare(GpioLink *link);
+    void uring_completion(GpioLink::Operation *operation, int result);
+    void uring_turn();
+    void epoll_update(GpioLink *link);
+    void epoll_turn();
+
+    int used_backend = GPIO_LINK_BACKEND_EPOLL;
+    bool ready = false;
+    std::atomic<bool> stopping{false};
+    std::thread thread;
+    std::thread::id loop_thread;
+    //Sends and closes of other threads write it, but only while the loop isn't already going to look
+    int wake_fd = -1;
+    std::atomic<bool> wake_pending{false};
+
+    std::mutex links_mutex;
+    std::vector<GpioLink *> links;
+    std::vector<GpioLink *> added;
+
+    //io_uring, set up with the raw system calls so there is nothing to link against
+    int ring_fd = -1;
+    void *sq_map = NULL;
+    void *cq_map = NULL;
+    size_t sq_map_size = 0;
+    size_t cq_map_size = 0;
+    struct io_uring_sqe *sqes = NULL;
+    size_t sqes_size = 0;
+    unsigned int *sq_head = NULL;
+    unsigned int *sq_tail = NULL;
+    unsigned int *sq_mask = NULL;
+    unsigned int *sq_array = NULL;
+    unsigned int *cq_head = NULL;
+    unsigned int *cq_tail = NULL;
+    unsigned int *cq_mask = NULL;
+    struct io_uring_cqe *cqes = NULL;
+    unsigned int sq_entries = 0;
+    unsigned int to_submit = 0;
+    uint64_t wake_value = 0;
+    bool wake_armed = false;
+
+    int epoll_fd = -1;
+};
+
+#endif
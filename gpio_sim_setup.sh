@@ -0,0 +1,61 @@
+#!/bin/sh
+#Loads the module on two virtual lines, so it can be tried (and benchmarked with gpio_bench) on any Linux box.
+#gpio-sim (or gpio-mockup on older kernels) gives the pins, they can't be wired to each other, so both lines
+#share a software wire inside the module (see wire_groups in driver.c). That only exists in a debug build of the
+#module (make SOFT_WIRE=1), and it stands in for the pins and their interrupts, so results measure the protocol
+#threads and device files but not the GPIO code.
+#Other module parameters can be added: ./gpio_sim_setup.sh frame_mode=2 timing_profile=2
+#./gpio_sim_setup.sh chip only makes the gpio-sim chip and prints its name, for the user space backend (user_link.c)
+#./gpio_sim_setup.sh remove unloads everything again
+sim_dir=/sys/kernel/config/gpio-sim/gpio_link
+label="gpio_link"
+
+if [ "$1" = "remove" ]; then
+    lsmod | grep -q "^gpio_link " && ./remover.sh
+    if [ -d ${sim_dir} ]; then
+        echo 0 > ${sim_dir}/live
+        rmdir ${sim_dir}/bank0
+        rmdir ${sim_dir}
+    fi
+    rmmod gpio-mockup 2> /dev/null
+    exit 0
+fi
+
+#gpio-sim chips are made through configfs, gpio-mockup ones with a module parameter (-1 picks the base)
+modprobe gpio-sim 2> /dev/null
+mount | grep -q configfs || mount -t configfs none /sys/kernel/config 2> /dev/null
+if [ -d /sys/kernel/config/gpio-sim ]; then
+    mkdir -p ${sim_dir}/bank0
+    echo 2 > ${sim_dir}/bank0/num_lines
+    echo ${label} > ${sim_dir}/bank0/label
+    echo 1 > ${sim_dir}/live || exit 1
+    if [ "$1" = "chip" ]; then
+        echo "/dev/`cat ${sim_dir}/bank0/chip_name`"
+        exit 0
+    fi
+elif [ "$1" = "chip" ]; then
+    echo "The user space backend needs gpio-sim"
+    exit 1
+else
+    modprobe gpio-mockup gpio_mockup_ranges=-1,2 || exit 1
+    label="gpio-mockup-A"
+fi
+
+#The module uses global GPIO numbers, find the base of the new chip (in sysfs, or in debugfs without the sysfs
+#interface, where its line reads "gpiochipN: GPIOs 512-513, parent: ..., gpio_link:")
+base=""
+for chip in /sys/class/gpio/gpiochip*; do
+    if [ -f ${chip}/label ] && [ "`cat ${chip}/label`" = "${label}" ]; then
+        base=`cat ${chip}/base`
+    fi
+done
+if [ -z "${base}" ] && [ -f /sys/kernel/debug/gpio ]; then
+    base=`grep "${label}" /sys/kernel/debug/gpio | sed -n 's/.*GPIOs \([0-9]*\)-.*/\1/p' | head -n 1`
+fi
+if [ -z "${base}" ]; then
+    echo "Couldn't find the GPIO base of ${label}"
+    exit 1
+fi
+echo "${label}: lines ${base} and $((base + 1))"
+
+./loader.sh gpio_pins=${base},$((base + 1)) comm_roles=0,1 wire_groups=1,1 "$@"
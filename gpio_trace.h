@@ -0,0 +1,108 @@
+//Tracepoints of the protocol, they cost next to nothing while disabled. Enable them with
+//echo 1 > /sys/kernel/tracing/events/gpio_link/enable, or use them from perf and bpftrace.
+//Every event has the line index, its role (master == 0, slave == 1) and the ktime (ns) the step was timed for
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM gpio_link
+
+#if !defined(_GPIO_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _GPIO_TRACE_H
+
+#include <linux/tracepoint.h>
+
+//The master pulled the line low, or the slave saw it go low
+TRACE_EVENT(gpio_reset_start,
+    TP_PROTO(int line, int role, u64 ts),
+    TP_ARGS(line, role, ts),
+    TP_STRUCT__entry(
+        __field(int, line)
+        __field(int, role)
+        __field(u64, ts)
+    ),
+    TP_fast_assign(
+        __entry->line = line;
+        __entry->role = role;
+        __entry->ts = ts;
+    ),
+    TP_printk("line=%d role=%d ts=%llu", __entry->line, __entry->role, __entry->ts)
+);
+
+//Result of the samples taken during a reset. On the master: is the slave there and does it have a message,
+//on the slave: present is always 1 and message tells if the master has one
+TRACE_EVENT(gpio_reset_sample,
+    TP_PROTO(int line, int role, int present, int message, u64 ts),
+    TP_ARGS(line, role, present, message, ts),
+    TP_STRUCT__entry(
+        __field(int, line)
+        __field(int, role)
+        __field(int, present)
+        __field(int, message)
+        __field(u64, ts)
+    ),
+    TP_fast_assign(
+        __entry->line = line;
+        __entry->role = role;
+        __entry->present = present;
+        __entry->message = message;
+        __entry->ts = ts;
+    ),
+    TP_printk("line=%d role=%d present=%d message=%d ts=%llu", __entry->line, __entry->role, __entry->present,
+              __entry->message, __entry->ts)
+);
+
+DECLARE_EVENT_CLASS(gpio_byte,
+    TP_PROTO(int line, int role, uint8_t byte, u64 ts),
+    TP_ARGS(line, role, byte, ts),
+    TP_STRUCT__entry(
+        __field(int, line)
+        __field(int, role)
+        __field(uint8_t, byte)
+        __field(u64, ts)
+    ),
+    TP_fast_assign(
+        __entry->line = line;
+        __entry->role = role;
+        __entry->byte = byte;
+        __entry->ts = ts;
+    ),
+    TP_printk("line=%d role=%d byte=0x%02x ts=%llu", __entry->line, __entry->role, __entry->byte, __entry->ts)
+);
+
+//A byte goes out, ts is where its first bit starts
+DEFINE_EVENT(gpio_byte, gpio_byte_sent,
+    TP_PROTO(int line, int role, uint8_t byte, u64 ts),
+    TP_ARGS(line, role, byte, ts)
+);
+
+//A byte was read, ts is where its first bit started (the event itself comes after the last bit)
+DEFINE_EVENT(gpio_byte, gpio_byte_read,
+    TP_PROTO(int line, int role, uint8_t byte, u64 ts),
+    TP_ARGS(line, role, byte, ts)
+);
+
+//The answer to a frame we sent arrived (ts is its first edge), or ack is -1 if it didn't come in time
+TRACE_EVENT(gpio_ack,
+    TP_PROTO(int line, int role, int ack, u64 ts),
+    TP_ARGS(line, role, ack, ts),
+    TP_STRUCT__entry(
+        __field(int, line)
+        __field(int, role)
+        __field(int, ack)
+        __field(u64, ts)
+    ),
+    TP_fast_assign(
+        __entry->line = line;
+        __entry->role = role;
+        __entry->ack = ack;
+        __entry->ts = ts;
+    ),
+    TP_printk("line=%d role=%d ack=%d ts=%llu", __entry->line, __entry->role, __entry->ack, __entry->ts)
+);
+
+#endif
+
+//The header is not in the kernel include path, the Makefile adds this directory
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE gpio_trace
+#include <trace/define_trace.h>
@@ -1,21 +1,23 @@
 #!/bin/sh
-module="driver"
-module2="driver2"
+module="gpio_link"
 device="gpio_master"
 device2="gpio_slave"
 
-#Loads 2 separate modules to simulate 2 different devices
-/sbin/insmod ${module}.ko gpio_pin_number=22 comm_role=0 || exit 1
-/sbin/insmod ${module2}.ko gpio_pin_number=17 comm_role=1 || exit 1
+#A single module drives both lines to simulate 2 different devices,
+#line 0 (pin 22) is the master and line 1 (pin 17) is the slave.
+#Module parameters given to the script replace these (see gpio_sim_setup.sh)
+if [ $# -eq 0 ]; then
+    set -- gpio_pins=22,17 comm_roles=0,1
+fi
+/sbin/insmod ${module}.ko "$@" || exit 1
 
 rm -f /dev/${device}
 rm -f /dev/${device2}
 
-major=`cat /proc/devices | awk "{if(\\$2==\"$device\")print \\$1}"`
-major2=`cat /proc/devices | awk "{if(\\$2==\"$device2\")print \\$1}"`
+major=`cat /proc/devices | awk "{if(\\$2==\"gpio_link\")print \\$1}"`
 
 mknod /dev/${device} c $major 0
-mknod /dev/${device2} c $major2 0
+mknod /dev/${device2} c $major 1
 
 chmod 666 /dev/${device}
-chmod 666 /dev/${device2}
\ No newline at end of file
+chmod 666 /dev/${device2}
@@ -0,0 +1,1438 @@
+//Protocol of the link: resets, frames, acknowledgements, sessions and the bus scheduler. It only talks to the line
+//through the HAL (see protocol.h), so the kernel module and the simulator run the same code
+#include "protocol.h"
+#ifdef __KERNEL__
+//The tracepoints are created in this file (see gpio_trace.h)
+#define CREATE_TRACE_POINTS
+#include "gpio_trace.h"
+#else
+static inline void trace_gpio_reset_start(int line, int role, u64 ts) {}
+static inline void trace_gpio_reset_sample(int line, int role, int present, int message, u64 ts) {}
+static inline void trace_gpio_byte_sent(int line, int role, uint8_t byte, u64 ts) {}
+static inline void trace_gpio_byte_read(int line, int role, uint8_t byte, u64 ts) {}
+static inline void trace_gpio_ack(int line, int role, int ack, u64 ts) {}
+#endif
+
+//Timing profile that is used for data on the line right now (needs a link in scope)
+#define PROFILE (&timing_profiles[link->active_profile])
+
+const struct TimingProfile timing_profiles[NUM_TIMING_PROFILES] = {
+    {"standard", 100000, 15000, 65000, 40000, 750000},
+    {"fast", 50000, 8000, 33000, 20000, 375000},
+    {"overdrive", 20000, 3000, 13000, 8000, 150000},
+};
+
+const char *phase_names[NUM_PHASES] = {"reset", "negotiate", "send", "read"};
+
+unsigned int link_tx_pending(struct Link *link) {
+    unsigned int pending = 0;
+    int i;
+    for(i = 0; i < NUM_TX_CLASSES; i += 1) {
+        pending += data_ring_count(&link->tx_rings[i]);
+    }
+    return pending;
+}
+
+int link_is_bus_master(struct Link *link) {
+    return link->config->bus_mode && (link->role == 0);
+}
+
+void link_init(struct Link *link, const struct LinkConfig *config) {
+    link->config = config;
+    link->allowed_profile = link->timing_profile;
+    link->active_profile = config->negotiate_speed ? 0 : link->timing_profile;
+    link->consecutive_errors = 0;
+    link->message_to_send = NULL;
+    link->sending_slot = NULL;
+    link->next_fragment_to_send = 0;
+    link->reassembly_next_fragment = 0;
+    link->reply_requested = 0;
+    link->reply_coming = 0;
+    link->in_reply = 0;
+    link->frame_attempts = 0;
+    link->poll_interval = 0;
+    link->exchange_failed = 0;
+    link->tx_turn = 0;
+    memset(link->tx_deficit, 0, sizeof(link->tx_deficit));
+}
+
+//Moves timer forward and waits until then, every step of the protocol is timed from the previous one
+static void timer_wait(struct Link *link, u64 ns) {
+    int bucket;
+    link->timer += ns;
+    bucket = fls64(hal_wait_until(link, link->timer) / NSEC_PER_USEC);
+    if(bucket >= LATENESS_BUCKETS) {
+        bucket = LATENESS_BUCKETS - 1;
+    }
+    link->stats.lateness[bucket] += 1;
+}
+
+//Adds the time since start to a protocol phase
+static void stats_phase(struct Link *link, int phase, u64 start) {
+    link->stats.phase_ns[phase] += hal_now(link) - start;
+}
+
+//Counts a reset, start is when the line was pulled low
+static void stats_reset(struct Link *link, u64 start, int status) {
+    link->stats.resets += 1;
+    if(status < 0) {
+        link->stats.no_presence += 1;
+    }
+    stats_phase(link, PHASE_RESET, start);
+}
+
+//Waits between protocol steps that don't need to be exact
+static void sleep_for(struct Link *link, u64 ns) {
+    hal_wait_until(link, hal_now(link) + ns);
+}
+
+//Lookup tables for the CRC and the Hamming code, filled in once by protocol_init()
+static uint8_t crc8_table[256];
+static uint8_t hamming_encode_table[16];
+//Decoded nibble in the low 4 bits, HAMMING_CORRECTED if a bit was flipped back, HAMMING_ERROR if it can't be fixed
+static uint8_t hamming_decode_table[256];
+#define HAMMING_CORRECTED 0x10
+#define HAMMING_ERROR 0x80
+
+void protocol_init(void) {
+    int i;
+    int j;
+    uint8_t crc;
+    uint8_t d[4];
+    uint8_t code;
+
+    for (i = 0; i < 256; i += 1) {
+        crc = (uint8_t) i;
+        for (j = 0; j < 8; j += 1) {
+            crc = (crc & 0x01) ? ((crc >> 1) ^ CRC8_POLYNOMIAL) : (crc >> 1);
+        }
+        crc8_table[i] = crc;
+    }
+
+    //Data bits 0-3, parity bits 4-6, overall parity in bit 7 (so any 2 bit error is detected)
+    for (i = 0; i < 16; i += 1) {
+        for (j = 0; j < 4; j += 1) {
+            d[j] = (i >> j) & 0x01;
+        }
+        code = (uint8_t) i;
+        code |= (d[0] ^ d[1] ^ d[3]) << 4;
+        code |= (d[0] ^ d[2] ^ d[3]) << 5;
+        code |= (d[1] ^ d[2] ^ d[3]) << 6;
+        code |= (hweight8(code) & 0x01) << 7;
+        hamming_encode_table[i] = code;
+    }
+
+    //Every code word is at least 4 bits away from the others, so at most one is within 1 bit of a received byte
+    for (i = 0; i < 256; i += 1) {
+        hamming_decode_table[i] = HAMMING_ERROR;
+        for (j = 0; j < 16; j += 1) {
+            if (hweight8(i ^ hamming_encode_table[j]) == 0) {
+                hamming_decode_table[i] = (uint8_t) j;
+            }
+            else if (hweight8(i ^ hamming_encode_table[j]) == 1) {
+                hamming_decode_table[i] = ((uint8_t) j) | HAMMING_CORRECTED;
+            }
+        }
+    }
+}
+
+static char crc8(char *data, int length) {
+    uint8_t crc = 0;
+    int i;
+    for (i = 0; i < length; i += 1) {
+        crc = crc8_table[crc ^ (uint8_t) data[i]];
+    }
+    return (char) crc;
+}
+
+//Fixed frames keep the XOR checksum so old drivers can still read them
+static char xor_checksum(char *data, int length) {
+    char checksum = 0;
+    int i;
+    for (i = 0; i < length; i += 1) {
+        checksum = checksum ^ data[i];
+    }
+    return checksum;
+}
+
+//Functions that implement our communication protocol
+//(more info on the report)
+static int reset(struct Link *link);
+static void send_bit(struct Link *link, int bit, const struct TimingProfile *p);
+static int read_bit(struct Link *link, const struct TimingProfile *p);
+static char read_bits_at(struct Link *link, u64 start);
+static char read_byte_at(struct Link *link, u64 start);
+static char read_byte(struct Link *link);
+static int read_frame(struct Link *link);
+static void read_message(struct Link *link);
+static int send_frame(struct Link *link, char header, char *payload, int length);
+static void send_message(struct Link *link);
+static struct Data *peek_next_message(struct Link *link);
+static void send_byte(struct Link *link, char byte);
+static int wait_for_reply(struct Link *link);
+
+//Keeps track of frames failing in a row, too many of them and the link falls back to a slower profile
+static void frame_result(struct Link *link, int ok) {
+    if(ok) {
+        link->consecutive_errors = 0;
+        link->exchange_failed = 0;
+        return;
+    }
+    link->consecutive_errors += 1;
+    link->exchange_failed = 1;
+    if(link->config->negotiate_speed && (link->consecutive_errors >= PROFILE_FALLBACK_ERRORS) && (link->allowed_profile > 0)) {
+        link->allowed_profile -= 1;
+        link->consecutive_errors = 0;
+        LINK_WARN("Too many errors, falling back to %s timing\n", timing_profiles[link->allowed_profile].name);
+    }
+}
+
+//Right after a reset both sides agree on the fastest timing profile they both support. The master sends the
+//fastest one it allows as 2 bits, the slave answers with the one that is going to be used. This part always
+//uses standard timing and continues from the timer value at the end of the reset
+static void negotiate_profile(struct Link *link) {
+    const struct TimingProfile *standard = &timing_profiles[0];
+    int offer;
+    int agreed;
+    int low_bit;
+    int high_bit;
+    int limit = (link->allowed_profile < link->timing_profile) ? link->allowed_profile : link->timing_profile;
+    u64 start = hal_now(link);
+
+    if(link->role == 0) {
+        offer = limit;
+        send_bit(link, offer & 0x01, standard);
+        send_bit(link, (offer >> 1) & 0x01, standard);
+        timer_wait(link, NEGOTIATION_GAP_NS);
+        low_bit = read_bit(link, standard);
+        high_bit = read_bit(link, standard);
+        agreed = low_bit | (high_bit << 1);
+        //An idle line reads as 3, anything above our offer means the answer got lost
+        if(agreed > offer) {
+            agreed = 0;
+        }
+    }
+    else {
+        low_bit = read_bit(link, standard);
+        high_bit = read_bit(link, standard);
+        offer = low_bit | (high_bit << 1);
+        agreed = (offer < limit) ? offer : limit;
+        timer_wait(link, NEGOTIATION_GAP_NS);
+        send_bit(link, agreed & 0x01, standard);
+        send_bit(link, (agreed >> 1) & 0x01, standard);
+    }
+    link->active_profile = agreed;
+    stats_phase(link, PHASE_NEGOTIATE, start);
+}
+
+static int reset(struct Link *link) {
+    //reset returns -1 if no presence, 0 if no msg from slave, 1 if 
+    // there is a message from the slave, 2 if slave has no msg but master has
+    int slave_present;
+    int slave_message;
+    int master_message;
+    //Also drops what expired, so a message is only announced if there is one to send
+    master_message = (peek_next_message(link) != NULL);
+    hal_line_low(link);
+    link->timer = hal_now(link);
+    trace_gpio_reset_start(link->index, link->role, link->timer);
+    if(master_message) {
+        timer_wait(link, 300000);
+        hal_line_release(link);
+        timer_wait(link, 200000);
+    }
+    else{
+        timer_wait(link, 500000);
+        hal_line_release(link);
+    }
+    timer_wait(link, 100000);
+    slave_present = (hal_line_read(link) == 0);
+    timer_wait(link, 150000);
+    slave_message = (hal_line_read(link) == 0);
+    trace_gpio_reset_sample(link->index, link->role, slave_present, slave_message, link->timer);
+    timer_wait(link, 150000);
+    if(!slave_present){
+        return -1;
+    }
+    else if(slave_message) {
+        return 1;
+    }
+    else if (master_message){
+        return 2;
+    }
+    else{
+        return 0;
+    }
+}
+
+//Addressed reset of a multi-drop bus, returns the same as reset(). The master message flag travels in the address
+//byte, the presence and slave message pulses come after it with the same timing as in a normal reset
+static int bus_reset(struct Link *link, int address, int master_message) {
+    const struct TimingProfile *standard = &timing_profiles[0];
+    uint8_t address_byte = (uint8_t) ((address & 0x7F) | (master_message ? 0x80 : 0x00));
+    int slave_present;
+    int slave_message;
+    int i;
+    hal_line_low(link);
+    link->timer = hal_now(link);
+    trace_gpio_reset_start(link->index, link->role, link->timer);
+    timer_wait(link, BUS_RESET_NS);
+    hal_line_release(link);
+    timer_wait(link, 100000);
+    for(i = 0; i < 8; i += 1) {
+        send_bit(link, (address_byte >> i) & 0x01, standard);
+    }
+    timer_wait(link, 100000);
+    slave_present = (hal_line_read(link) == 0);
+    timer_wait(link, 150000);
+    slave_message = (hal_line_read(link) == 0);
+    trace_gpio_reset_sample(link->index, link->role, slave_present, slave_message, link->timer);
+    timer_wait(link, 150000);
+    if(!slave_present){
+        return -1;
+    }
+    else if(slave_message) {
+        return 1;
+    }
+    else if (master_message){
+        return 2;
+    }
+    return 0;
+}
+
+//Slave side of a bus reset: waits for a falling edge and checks that the line stays low long enough to be a reset.
+//Returns the address byte that follows it, or -1 if the edge was part of some other transaction. edge is set to
+//when the reset started
+static int wait_for_bus_reset(struct Link *link, u64 *edge) {
+    const struct TimingProfile *standard = &timing_profiles[0];
+    uint8_t address_byte = 0;
+    int i;
+    if(hal_wait_for_edge(link, 0) < 0) {
+        return -1;
+    }
+    *edge = link->timer;
+    for(i = 0; i < BUS_RESET_SAMPLES; i += 1) {
+        hal_wait_until(link, *edge + BUS_RESET_SAMPLE_NS + i * 100000);
+        if(hal_line_read(link) != 0) {
+            return -1;
+        }
+    }
+    //The address starts 100us after the master releases the line
+    link->timer = *edge + BUS_RESET_NS + 100000;
+    for(i = 0; i < 8; i += 1) {
+        address_byte |= read_bit(link, standard) << i;
+    }
+    return address_byte;
+}
+
+//Sends a single bit starting at timer, every bit starts with the line pulled low
+static void send_bit(struct Link *link, int bit, const struct TimingProfile *p) {
+    u64 low_time = bit ? p->one_low : p->zero_low;
+    hal_line_low(link);
+    timer_wait(link, low_time);
+    hal_line_release(link);
+    timer_wait(link, p->bit_slot - low_time);
+}
+
+//Reads a single bit starting at timer, a 1 has already been released at the sample point, a 0 not yet
+static int read_bit(struct Link *link, const struct TimingProfile *p) {
+    int bit;
+    timer_wait(link, p->sample_point);
+    bit = hal_line_read(link);
+    timer_wait(link, p->bit_slot - p->sample_point);
+    return bit;
+}
+
+//Reads 8 bits starting at the given time, without the gap after them
+static char read_bits_at(struct Link *link, u64 start){
+    char byte = 0x00;
+    int b[8];
+    int i;
+    link->timer = start;
+    for(i = 0; i < 8; i += 1){
+        b[i] = read_bit(link, PROFILE);
+    }
+
+    for(i = 0; i < 8; i += 1){
+        byte = byte | (b[i] << i);
+    }
+    trace_gpio_byte_read(link->index, link->role, (uint8_t) byte, start);
+    return byte;
+}
+
+//Reads a byte whose first bit starts at the given time
+static char read_byte_at(struct Link *link, u64 start){
+    char byte = read_bits_at(link, start);
+    timer_wait(link, PROFILE->byte_gap);
+    return byte;
+}
+
+//Reads one bit of a streamed frame. timer is where the bit should start, the line is watched from a bit before
+//that and the sample is taken relative to the edge that was actually seen, so the timing doesn't drift over a long
+//frame. Watching starts halfway between the end of a zero and the start of the bit, so a zero that is released a
+//little late isn't taken for the next edge (with overdrive timing that leaves 3.5us on both sides).
+//Returns -1 if the edge doesn't come
+static int read_tracked_bit(struct Link *link, const struct TimingProfile *p) {
+    u64 deadline = link->timer + p->bit_slot / 2;
+    int bit;
+    hal_wait_until(link, link->timer - (p->bit_slot - p->zero_low) / 2);
+    while(hal_line_read(link) == 1) {
+        if(hal_now(link) > deadline) {
+            return -1;
+        }
+    }
+    link->timer = hal_now(link);
+    timer_wait(link, p->sample_point);
+    bit = hal_line_read(link);
+    //Next bit starts one slot after this edge, no need to wait for it here
+    link->timer += p->bit_slot - p->sample_point;
+    return bit;
+}
+
+//Reads a byte of a streamed frame, returns -1 if we lost track of the stream
+static int read_tracked_byte(struct Link *link, char *byte) {
+    int i;
+    int bit;
+    u64 start = link->timer;
+    *byte = 0x00;
+    for(i = 0; i < 8; i += 1){
+        bit = read_tracked_bit(link, PROFILE);
+        if(bit < 0) {
+            return -1;
+        }
+        *byte = *byte | (bit << i);
+    }
+    trace_gpio_byte_read(link->index, link->role, (uint8_t) *byte, start);
+    return 0;
+}
+
+//After losing track of a frame, waits until the sender is done before answering so we don't talk over it.
+//Returns -1 if the line is still busy after the longest frame could have been sent (noise or a stuck peer), then
+//nothing is answered and the reset detector picks the line up again
+static int wait_for_quiet_line(struct Link *link) {
+    u64 deadline = hal_now(link) + (MAX_FRAME_LENGTH * (8 * PROFILE->bit_slot + PROFILE->byte_gap))
+                   + 16 * PROFILE->bit_slot;
+
+    while(hal_wait_for_edge(link, 16 * PROFILE->bit_slot) == 0) {
+        if(hal_now(link) >= deadline) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//Reads the next byte of a frame, timer is where it starts (one byte gap after the previous one). Timing every byte
+//from the start of the frame instead of from whenever the last wait ended keeps lateness from adding up over a long
+//frame, the sender does the same
+static char read_byte(struct Link *link){
+    return read_byte_at(link, link->timer);
+}
+
+//Adds a fragment to the message being reassembled, returns 1 if the message is complete,
+//0 if more fragments are needed and -1 if the fragment doesn't fit (it gets NAKed)
+static int add_fragment(struct Link *link, char *payload, int length) {
+    uint8_t id = (uint8_t) payload[0];
+    int index = (uint8_t) payload[1];
+    int count = (uint8_t) payload[2];
+    int data_length = length - FRAGMENT_HEADER_LENGTH;
+    int i;
+
+    if((count == 0) || (index >= count)) {
+        return -1;
+    }
+    //First fragment always starts a new message
+    if(index == 0) {
+        link->reassembly.id = id;
+        link->reassembly.length = 0;
+        link->reassembly_next_fragment = 0;
+        link->reassembly_fragment_count = count;
+    }
+    if((id != link->reassembly.id) || (count != link->reassembly_fragment_count)) {
+        return -1;
+    }
+    //Our ACK got lost and the sender repeated a fragment we already have
+    if(index < link->reassembly_next_fragment) {
+        return 0;
+    }
+    if((index > link->reassembly_next_fragment) || (link->reassembly.length + data_length > MAX_MESSAGE_LENGTH)) {
+        return -1;
+    }
+    for (i = 0; i < data_length; i += 1) {
+        link->reassembly.buffer[link->reassembly.length + i] = payload[FRAGMENT_HEADER_LENGTH + i];
+    }
+    link->reassembly.length += data_length;
+    link->reassembly_next_fragment += 1;
+    return (link->reassembly_next_fragment == link->reassembly_fragment_count);
+}
+
+//Checks if a frame is a whole message or the last fragment of one
+static int frame_completes_message(uint8_t header, char *payload) {
+    if(header != FRAME_HEADER_FRAGMENT) {
+        return 1;
+    }
+    return ((uint8_t) payload[1] + 1 == (uint8_t) payload[2]);
+}
+
+//Makes sure there is a free slot for a message that is about to complete, returns 0 if there is one and -1 if not.
+//Dropping the oldest message moves the tail, which belongs to the readers, so it is only done if no reader is busy
+static int rx_ring_make_room(struct Link *link) {
+    if(data_ring_claim(&link->rx_ring) != NULL) {
+        return 0;
+    }
+    if(link->config->rx_full_policy != 1) {
+        return -1;
+    }
+    return hal_rx_drop_oldest(link);
+}
+
+//Checks if the receive ring has no free slot left (the thread is the only producer, so this stays true until
+//somebody reads)
+static int rx_ring_full(struct Link *link) {
+    return (data_ring_claim(&link->rx_ring) == NULL);
+}
+
+//Reads the next byte of a frame after the header (two code bytes with FEC).
+//Returns 0 if it is fine, 1 if it has an error FEC can't correct and -1 if we lost track of the stream
+static int read_frame_byte(struct Link *link, int streamed, int fec, char *byte) {
+    char code[2];
+    uint8_t low;
+    uint8_t high;
+    int i;
+
+    for (i = 0; i < (fec ? 2 : 1); i += 1) {
+        if(streamed) {
+            if(read_tracked_byte(link, &(code[i])) < 0) {
+                return -1;
+            }
+        }
+        else {
+            code[i] = read_byte(link);
+        }
+    }
+    if(!fec) {
+        *byte = code[0];
+        return 0;
+    }
+    low = hamming_decode_table[(uint8_t) code[0]];
+    high = hamming_decode_table[(uint8_t) code[1]];
+    *byte = (char) ((low & 0x0F) | ((high & 0x0F) << 4));
+    if((low | high) & HAMMING_ERROR) {
+        return 1;
+    }
+    return 0;
+}
+
+//Waits before the answer to a frame, as soon as the sender is ready for it
+static void ack_delay(struct Link *link, int legacy) {
+    if(legacy) {
+        sleep_for(link, LEGACY_ACK_DELAY_NS);
+    }
+    else {
+        sleep_for(link, ACK_GAP_SLOTS * PROFILE->bit_slot);
+    }
+}
+
+//Reads one frame and acknowledges it, returns 1 if the sender is going to send another frame right after
+//and 2 if the frame was broken and the sender tries it again right away (fixed frames are only tried again after
+//the next reset, so those return 0)
+static int read_frame(struct Link *link){
+    char frame[MAX_FRAME_LENGTH];
+    int i;
+    uint8_t header;
+    int msg_length;
+    int max_length;
+    int frame_length;
+    int is_corrupted = 0;
+    int lost_track = 0;
+    int message_complete = 0;
+    int more_frames = 0;
+    int streamed = 0;
+    int fec = 0;
+    int legacy;
+    int result;
+    struct Data *slot;
+    u64 start = link->timer;
+
+    //timer is where the frame starts, either the end of the reset or the first edge of the frame
+    frame[0] = read_bits_at(link, link->timer);
+    header = (uint8_t) frame[0];
+    //Fixed frames may come from an older driver, which needs the slow ACK. Only the header tells, our own frame_mode
+    //is about sending: a sender of variable length frames waits for the fast ACK and retries right away
+    legacy = (header == FRAME_HEADER);
+    //Fixed frames don't have flags (and 0xAA would look like one). A broken header isn't stripped, so the flags of
+    //whatever came in don't change how the rest is read and the frame is NAKed as corrupted
+    if((header != FRAME_HEADER) && (((header & ~FRAME_FLAGS) == FRAME_HEADER_VARLEN) ||
+                                    ((header & ~FRAME_FLAGS) == FRAME_HEADER_FRAGMENT))) {
+        more_frames = (header & FRAME_FLAG_MORE) != 0;
+        streamed = (header & FRAME_FLAG_STREAM) != 0;
+        fec = (header & FRAME_FLAG_FEC) != 0;
+        header = header & ~FRAME_FLAGS;
+    }
+
+    //The stream starts one bit slot after the header, otherwise there is the usual gap after the header
+    if(streamed) {
+        link->timer += PROFILE->bit_slot;
+    }
+    else {
+        timer_wait(link, PROFILE->byte_gap);
+    }
+    result = read_frame_byte(link, streamed, fec, &(frame[1]));
+    if(result < 0) {
+        lost_track = 1;
+    }
+    //A length we can't trust is treated as too long
+    msg_length = (result == 0) ? (int) (uint8_t) frame[1] : 0xFF;
+
+    if(header == FRAME_HEADER_FRAGMENT) {
+        max_length = FRAGMENT_HEADER_LENGTH + FRAGMENT_DATA_LENGTH;
+    }
+    else {
+        max_length = MAX_PAYLOAD_LENGTH;
+    }
+
+    //Variable length frames end right after the CRC, so the length byte tells us when to stop.
+    //If the length is broken we can't trust it, so read a full fixed frame to stay in sync with the sender
+    //(a stream can't be followed without the length, we wait until the sender is done)
+    if((header != FRAME_HEADER) && (msg_length <= max_length)) {
+        frame_length = msg_length + 3;
+    }
+    else {
+        frame_length = FIXED_FRAME_LENGTH;
+        if(streamed) {
+            lost_track = 1;
+        }
+    }
+    for (i = 2; (i < frame_length) && (!lost_track); i += 1){
+        result = read_frame_byte(link, streamed, fec, &(frame[i]));
+        if(result < 0) {
+            lost_track = 1;
+        }
+        else if(result > 0) {
+            is_corrupted = 1;
+        }
+    }
+    if(lost_track) {
+        if(wait_for_quiet_line(link) < 0) {
+            frame_result(link, 0);
+            link->stats.checksum_errors += 1;
+            stats_phase(link, PHASE_READ, start);
+            return 0;
+        }
+        is_corrupted = 1;
+    }
+
+    //A frame that was already found broken while reading may not have all its bytes, it isn't checked any further
+    if(!is_corrupted) {
+        if((header != FRAME_HEADER) && (header != FRAME_HEADER_VARLEN) && (header != FRAME_HEADER_FRAGMENT)) {
+            is_corrupted = 1;
+        }
+        else if((msg_length > max_length) ||
+                ((header == FRAME_HEADER_FRAGMENT) && (msg_length <= FRAGMENT_HEADER_LENGTH))) {
+            is_corrupted = 1;
+        }
+        else if(header == FRAME_HEADER) {
+            if(xor_checksum(frame, msg_length + 2) != frame[2 + msg_length]) {
+                is_corrupted = 1;
+            }
+        }
+        else if(crc8(frame, msg_length + 2) != frame[2 + msg_length]) {
+            is_corrupted = 1;
+        }
+    }
+
+    //A frame that completes a message needs a free slot in the receive ring,
+    //otherwise the sender keeps the frame and tries again after the next reset
+    if((!is_corrupted) && frame_completes_message(header, &(frame[2])) && (rx_ring_make_room(link) < 0)) {
+        ack_delay(link, legacy);
+        send_byte(link, (char) ACK_BUSY);
+        link->stats.busy_sent += 1;
+        stats_phase(link, PHASE_READ, start);
+        return 0;
+    }
+
+    if(!is_corrupted) {
+        if(header == FRAME_HEADER_FRAGMENT) {
+            message_complete = add_fragment(link, &(frame[2]), msg_length);
+            if(message_complete < 0) {
+                is_corrupted = 1;
+            }
+            else if(message_complete == 0) {
+                more_frames = 1;
+            }
+        }
+        else {
+            link->reassembly.length = msg_length;
+            for (i = 0; i < msg_length; i += 1) {
+                link->reassembly.buffer[i] = frame[2 + i];
+            }
+            message_complete = 1;
+        }
+    }
+
+    frame_result(link, !is_corrupted);
+    if(is_corrupted) {
+        link->stats.checksum_errors += 1;
+        link->stats.naks_sent += 1;
+        ack_delay(link, legacy);
+        send_byte(link, NAK);
+        stats_phase(link, PHASE_READ, start);
+        //Senders of variable length frames try again right away, if nothing comes we just time out. Senders of
+        //fixed frames (older drivers, and this one with frame_mode=0) go back to resets, waiting for a frame would
+        //read the next reset as one
+        return legacy ? 0 : 2;
+    }
+
+    if(message_complete) {
+        //rx_ring_make_room() made sure this doesn't fail
+        slot = data_ring_claim(&link->rx_ring);
+        slot->address = (uint8_t) link->bus_peer;
+        slot->length = link->reassembly.length;
+        memcpy(slot->buffer, link->reassembly.buffer, link->reassembly.length);
+        data_ring_publish(&link->rx_ring);
+    }
+    //With turnaround the app hears about the message before the ACK, so an answer can make it into this session
+    if(message_complete && link->config->turnaround) {
+        hal_message_received(link);
+        if((!more_frames) && (header != FRAME_HEADER)) {
+            link->reply_requested = wait_for_reply(link);
+        }
+    }
+    ack_delay(link, legacy);
+    send_byte(link, link->reply_requested ? (char) ACK_REPLY : (char) ACK);
+
+    if(message_complete && (!link->config->turnaround)) {
+        hal_message_received(link);
+    }
+    link->stats.frames_received += 1;
+    link->stats.bytes_received += msg_length + 3;
+    stats_phase(link, PHASE_READ, start);
+    return more_frames;
+}
+
+//Reads frames until the sender is done (a long message or a whole session comes as several frames back to back)
+//then sends our own message if the last frame was answered with ACK_REPLY.
+//The sender gives a frame up after max_retries NAKs and goes back to resets, which look like frames from here,
+//so the session also ends after that many NAKs in a row (otherwise every reset would get a NAK)
+static void read_message(struct Link *link){
+    int result;
+    int naks = 0;
+    while((result = read_frame(link)) != 0) {
+        naks = (result == 2) ? naks + 1 : 0;
+        if(naks > link->config->max_retries) {
+            break;
+        }
+        if(hal_wait_for_edge(link, NEXT_FRAME_TIMEOUT_NS) < 0) {
+            break;
+        }
+    }
+    if(link->reply_requested) {
+        link->reply_requested = 0;
+        link->in_reply = 1;
+        send_message(link);
+        link->in_reply = 0;
+    }
+}
+
+//Sends 8 bits back to back starting at timer, least significant bit first
+static void send_bits(struct Link *link, char byte) {
+    int i;
+    int b[8];
+    trace_gpio_byte_sent(link->index, link->role, (uint8_t) byte, link->timer);
+    for(i = 0; i < 8; i += 1) {
+        b[i] = (int) ((byte >> i) & (0x01));
+    }
+    for(i = 0; i < 8; i += 1) {
+        send_bit(link, b[i], PROFILE);
+    }
+}
+
+//Sends a byte that starts right now (a header or an answer)
+static void send_byte(struct Link *link, char byte) {
+    link->timer = hal_now(link);
+    send_bits(link, byte);
+    timer_wait(link, PROFILE->byte_gap);
+}
+
+//Sends the next byte of a frame, at timer (one byte gap after the previous one)
+static void send_next_byte(struct Link *link, char byte) {
+    send_bits(link, byte);
+    timer_wait(link, PROFILE->byte_gap);
+}
+
+//Sends a byte of a frame after the header, as two code bytes with FEC
+static void send_frame_byte(struct Link *link, char byte, int streamed, int fec) {
+    char code[2];
+    int i;
+    int count = 1;
+
+    code[0] = byte;
+    if(fec) {
+        code[0] = (char) hamming_encode_table[((uint8_t) byte) & 0x0F];
+        code[1] = (char) hamming_encode_table[((uint8_t) byte) >> 4];
+        count = 2;
+    }
+    for (i = 0; i < count; i += 1) {
+        if(streamed) {
+            send_bits(link, code[i]);
+        }
+        else {
+            send_next_byte(link, code[i]);
+        }
+    }
+}
+
+//Builds the header of a frame we send, the flags depend on how this side is configured
+static char make_header(struct Link *link, uint8_t type, int more) {
+    uint8_t header = type;
+    if(type == FRAME_HEADER) {
+        return (char) header;
+    }
+    if(link->config->frame_mode == 2) {
+        header |= FRAME_FLAG_STREAM;
+    }
+    if(link->config->fec_mode) {
+        header |= FRAME_FLAG_FEC;
+    }
+    if(more) {
+        header |= FRAME_FLAG_MORE;
+    }
+    return (char) header;
+}
+
+//Latest time (from the end of a frame) the ACK can start. The reader answers ACK_GAP_SLOTS after the frame, or
+//16 bit slots after the line went quiet if it lost track of a stream, or after reply_window_us with turnaround
+static u64 ack_timeout(struct Link *link, char header) {
+    u64 timeout;
+    if((header == (char) FRAME_HEADER) || (link->config->frame_mode == 0)) {
+        timeout = LEGACY_ACK_DELAY_NS;
+    }
+    else {
+        timeout = (16 + ACK_GAP_SLOTS) * PROFILE->bit_slot;
+        if(link->config->turnaround) {
+            timeout += (u64) link->config->reply_window_us * NSEC_PER_USEC;
+        }
+    }
+    return timeout + ACK_MARGIN_NS;
+}
+
+//Puts one frame on the line and waits for the acknowledgement,
+//returns 0 if it was ACKed, 1 if the reader is busy and -1 if it was NAKed
+static int send_frame(struct Link *link, char header, char *payload, int length) {
+    char frame[MAX_FRAME_LENGTH];
+    int i;
+    char ack;
+    int rest = 0;
+    int streamed = 0;
+    int fec = 0;
+    int result = -1;
+    u64 start = hal_now(link);
+    u64 trace_edge;
+
+    frame[0] = header;
+    frame[1] = (char) length;
+    for (i = 0; i < length; i += 1) {
+        frame[2 + i] = payload[i];
+    }
+    //Only fixed frames get padded up to 13 bytes
+    if(header == (char) FRAME_HEADER) {
+        rest = MAX_PAYLOAD_LENGTH - length;
+        frame[2 + length] = xor_checksum(frame, length + 2);
+    }
+    else {
+        streamed = (((uint8_t) header) & FRAME_FLAG_STREAM) != 0;
+        fec = (((uint8_t) header) & FRAME_FLAG_FEC) != 0;
+        frame[2 + length] = crc8(frame, length + 2);
+    }
+
+    if(streamed) {
+        //Header with normal timing, one bit slot of guard so the reader is ready, then the rest without gaps
+        link->timer = hal_now(link);
+        send_bits(link, header);
+        timer_wait(link, PROFILE->bit_slot);
+    }
+    else {
+        send_byte(link, header);
+    }
+    for (i = 1; i < length + 3; i += 1) {
+        send_frame_byte(link, frame[i], streamed, fec);
+    }
+    for (i = 0; i < rest; i += 1) {
+        send_next_byte(link, (char) 0xFF);
+    }
+    link->stats.frames_sent += 1;
+    link->stats.bytes_sent += length + 3 + rest;
+    //A reader that went away doesn't keep us waiting, a missing ACK counts like a NAK
+    if(hal_wait_for_edge(link, ack_timeout(link, header)) < 0) {
+        link->stats.ack_timeouts += 1;
+        trace_gpio_ack(link->index, link->role, -1, hal_now(link));
+        frame_result(link, 0);
+        stats_phase(link, PHASE_SEND, start);
+        return -1;
+    }
+    trace_edge = link->timer;
+    ack = read_byte_at(link, link->timer);
+    trace_gpio_ack(link->index, link->role, (uint8_t) ack, trace_edge);
+    if((ack == ACK) || (ack == (char) ACK_REPLY)) {
+        link->reply_coming = (ack == (char) ACK_REPLY);
+        result = 0;
+    }
+    else if(ack == (char) ACK_BUSY) {
+        link->stats.busy_received += 1;
+        result = 1;
+    }
+    else {
+        link->stats.naks_received += 1;
+    }
+    frame_result(link, result >= 0);
+    stats_phase(link, PHASE_SEND, start);
+    return result;
+}
+
+//Sends a frame, retrying after a NAK or a missing ACK if the other side supports it. Returns what send_frame() does,
+//or -2 if the frame failed max_retries + 1 times in a row and its message has to be given up
+static int send_frame_with_retries(struct Link *link, char header, char *payload, int length) {
+    int result;
+    u64 backoff = (u64) link->config->retry_backoff_us * NSEC_PER_USEC;
+    while(1) {
+        result = send_frame(link, header, payload, length);
+        if(result >= 0) {
+            link->frame_attempts = 0;
+            return result;
+        }
+        link->frame_attempts += 1;
+        if(link->frame_attempts > link->config->max_retries) {
+            return -2;
+        }
+        //Older readers don't wait for the frame again, the next try comes after the next reset
+        if((link->config->frame_mode == 0) || hal_should_stop(link)) {
+            return -1;
+        }
+        link->stats.retries += 1;
+        sleep_for(link, backoff);
+        backoff *= 2;
+        if(backoff > MAX_RETRY_BACKOFF_NS) {
+            backoff = MAX_RETRY_BACKOFF_NS;
+        }
+    }
+}
+
+//Checks if another message is queued behind the one being sent, so the session can go on
+static int session_continues(struct Link *link) {
+    int more;
+    //On a bus the next message may be for another slave, that one needs its own reset
+    if((!link->config->session_mode) || link_is_bus_master(link)) {
+        return 0;
+    }
+    more = (link_tx_pending(link) > 1);
+    return more;
+}
+
+//Frees the slot of the message that was just sent. The weighted scheduler charges its class for the bytes (and the
+//frame around them), once the class has used up its share of the round the next one gets its turn
+static void message_sent(struct Link *link) {
+    int class = link->message_class;
+    link->tx_deficit[class] -= READ_ONCE(link->message_to_send->length) + 3;
+    if(link->tx_deficit[class] <= 0) {
+        link->tx_turn = (class + 1) % NUM_TX_CLASSES;
+    }
+    data_ring_commit(link->message_ring);
+    link->message_to_send = NULL;
+    link->frame_attempts = 0;
+    hal_message_sent(link);
+}
+
+//Drops the message being sent after its retries are used up and lets user space know
+static void message_failed(struct Link *link) {
+    LINK_WARN("%s: no ACK after %d retries, message dropped\n", link->name, link->config->max_retries);
+    link->tx_failed += 1;
+    hal_message_failed(link);
+    link->sending_slot = NULL;
+    link->next_fragment_to_send = 0;
+    message_sent(link);
+}
+
+//Drops the messages on top of a send ring whose deadline has passed, they count as given up
+static void expire_messages(struct Link *link, struct DataRing *ring, u64 now) {
+    struct Data *message;
+    u64 deadline;
+    while((message = data_ring_peek(ring)) != NULL) {
+        deadline = READ_ONCE(message->deadline);
+        if((deadline == 0) || (deadline > now)) {
+            return;
+        }
+        if(message == link->sending_slot) {
+            link->sending_slot = NULL;
+            link->next_fragment_to_send = 0;
+        }
+        data_ring_commit(ring);
+        link->stats.tx_expired += 1;
+        link->tx_failed += 1;
+        hal_message_failed(link);
+        hal_message_sent(link);
+    }
+}
+
+//Deficit round robin: every class that has messages gets weight * TX_QUANTUM bytes per round and is served until
+//they are used up. Classes that run empty lose what they had left, so they can't save up for a burst
+static int pick_weighted_class(struct Link *link) {
+    int waiting;
+    int class;
+    int i;
+    while(1) {
+        waiting = 0;
+        for(i = 0; i < NUM_TX_CLASSES; i += 1) {
+            class = (link->tx_turn + i) % NUM_TX_CLASSES;
+            if(data_ring_peek(&link->tx_rings[class]) == NULL) {
+                link->tx_deficit[class] = 0;
+                continue;
+            }
+            waiting = 1;
+            if(link->tx_deficit[class] > 0) {
+                link->tx_turn = class;
+                return class;
+            }
+        }
+        if(!waiting) {
+            return -1;
+        }
+        //Everybody used up their share, next round
+        for(i = 0; i < NUM_TX_CLASSES; i += 1) {
+            if(data_ring_peek(&link->tx_rings[i]) != NULL) {
+                link->tx_deficit[i] += link->config->tx_weights[i] * TX_QUANTUM;
+            }
+        }
+    }
+}
+
+//Finds the message that is sent next and the ring it is in, NULL if nothing is waiting. Messages past their
+//deadline are dropped first, then the scheduler picks the class: the first one that has a message, or by weight
+static struct Data *peek_next_message(struct Link *link) {
+    u64 now = hal_now(link);
+    int class = -1;
+    int i;
+    for(i = 0; i < NUM_TX_CLASSES; i += 1) {
+        expire_messages(link, &link->tx_rings[i], now);
+    }
+    if(link->config->tx_scheduler == TX_SCHEDULER_WEIGHTED) {
+        class = pick_weighted_class(link);
+    }
+    else {
+        for(i = 0; (i < NUM_TX_CLASSES) && (class < 0); i += 1) {
+            if(data_ring_peek(&link->tx_rings[i]) != NULL) {
+                class = i;
+            }
+        }
+    }
+    if(class < 0) {
+        link->message_to_send = NULL;
+        return NULL;
+    }
+    link->message_class = class;
+    link->message_ring = &link->tx_rings[class];
+    link->message_to_send = data_ring_peek(link->message_ring);
+    return link->message_to_send;
+}
+
+//Checks if the session can turn around: we have a message and it goes to the side we are talking to
+static int reply_ready(struct Link *link) {
+    struct Data *message = peek_next_message(link);
+    if(message == NULL) {
+        return 0;
+    }
+    return (!link_is_bus_master(link)) || ((READ_ONCE(message->address) & 0x7F) == link->bus_peer);
+}
+
+//Decides if the last frame of a session gets ACK_REPLY, waiting up to reply_window_us for the app to queue an answer
+static int wait_for_reply(struct Link *link) {
+    if(link->in_reply) {
+        return 0;
+    }
+    if((!reply_ready(link)) && (link->config->reply_window_us > 0)) {
+        hal_wait_for_tx(link, (u64) link->config->reply_window_us * NSEC_PER_USEC);
+    }
+    return reply_ready(link);
+}
+
+//Sends the message on top of the queue, returns 1 if the reader was told another message follows,
+//0 if this was the last one and -1 if the reader didn't take it (it stays in the queue)
+static int send_one_message(struct Link *link) {
+    char payload[FRAGMENT_HEADER_LENGTH + FRAGMENT_DATA_LENGTH];
+    char header;
+    int fragment_count;
+    int offset;
+    int data_length;
+    int length;
+    int more = 0;
+    int result;
+    int i;
+
+    //This doesn't fail unless every ring is empty or expired (we always check before calling send_message())
+    if(peek_next_message(link) == NULL) {
+        return 0;
+    }
+
+    //A slot posted through the mapped ring was filled by user space, so its length is read once and checked here
+    length = READ_ONCE(link->message_to_send->length);
+    if((length > MAX_MESSAGE_LENGTH) || ((length > MAX_PAYLOAD_LENGTH) && (link->config->frame_mode == 0))) {
+        LINK_WARN("Dropping a message with invalid length %d\n", length);
+        link->sending_slot = NULL;
+        message_sent(link);
+        return 0;
+    }
+
+    if(length <= MAX_PAYLOAD_LENGTH) {
+        more = session_continues(link);
+        header = make_header(link, (link->config->frame_mode != 0) ? FRAME_HEADER_VARLEN : FRAME_HEADER, more);
+        result = send_frame_with_retries(link, header, link->message_to_send->buffer, length);
+        if(result == -2) {
+            message_failed(link);
+        }
+        if(result != 0) {
+            return -1;
+        }
+        message_sent(link);
+        return more;
+    }
+
+    //Every message gets a new id when we start sending it. If a message of another class got in front of a partially
+    //sent one, that message starts over (with another id) when it is on top again
+    if(link->message_to_send != link->sending_slot) {
+        link->sending_slot = link->message_to_send;
+        link->message_to_send->id = link->next_message_id;
+        link->next_message_id += 1;
+        link->next_fragment_to_send = 0;
+    }
+
+    //Fragments go back to back, only the one that fails is sent again
+    fragment_count = (length + FRAGMENT_DATA_LENGTH - 1) / FRAGMENT_DATA_LENGTH;
+    while(link->next_fragment_to_send < fragment_count) {
+        offset = link->next_fragment_to_send * FRAGMENT_DATA_LENGTH;
+        data_length = length - offset;
+        if(data_length > FRAGMENT_DATA_LENGTH) {
+            data_length = FRAGMENT_DATA_LENGTH;
+        }
+        payload[0] = (char) link->message_to_send->id;
+        payload[1] = (char) link->next_fragment_to_send;
+        payload[2] = (char) fragment_count;
+        for (i = 0; i < data_length; i += 1) {
+            payload[FRAGMENT_HEADER_LENGTH + i] = link->message_to_send->buffer[offset + i];
+        }
+        more = (link->next_fragment_to_send + 1 < fragment_count) || session_continues(link);
+        header = make_header(link, FRAME_HEADER_FRAGMENT, more);
+        result = send_frame_with_retries(link, header, payload, FRAGMENT_HEADER_LENGTH + data_length);
+        if(result == -2) {
+            message_failed(link);
+        }
+        if(result != 0) {
+            //Keep the progress, the rest is sent after the next reset
+            return -1;
+        }
+        link->next_fragment_to_send += 1;
+    }
+
+    link->next_fragment_to_send = 0;
+    link->sending_slot = NULL;
+    message_sent(link);
+    return more;
+}
+
+//Sends the message on top of the queue, in session mode keeps going until the queue is empty.
+//If the reader answered the last frame with ACK_REPLY, its message is read right after
+static void send_message(struct Link *link) {
+    while(send_one_message(link) == 1) {
+        if(hal_should_stop(link)) {
+            break;
+        }
+    }
+    if(link->reply_coming) {
+        link->reply_coming = 0;
+        link->in_reply = 1;
+        if(hal_wait_for_edge(link, REPLY_TIMEOUT_NS) == 0) {
+            read_message(link);
+        }
+        link->in_reply = 0;
+    }
+}
+
+//One transaction with a slave on the bus, then its next poll is scheduled. Slaves that had something to say are
+//polled again soon, idle ones less and less often, so the bus time goes to the slaves that are talking
+static void bus_poll(struct Link *link, int address, int master_message) {
+    struct BusSlave *slave = &link->bus_slaves[address];
+    int status;
+    int busy = 0;
+    u64 start = hal_now(link);
+
+    status = bus_reset(link, address, master_message);
+    stats_reset(link, start, status);
+    if(status == -1) {
+        if(slave->present) {
+            slave->misses += 1;
+            if(slave->misses >= BUS_MAX_MISSES) {
+                slave->present = 0;
+                LINK_WARN("%s: slave %d is gone\n", link->name, address);
+            }
+            slave->next_poll = hal_now(link) + slave->interval;
+        }
+        return;
+    }
+    if(!slave->present) {
+        LINK_INFO("%s: found slave %d\n", link->name, address);
+        slave->present = 1;
+        slave->interval = BUS_POLL_MIN_NS;
+    }
+    slave->misses = 0;
+    link->bus_peer = address;
+    if(status == 1) {
+        if(link->config->negotiate_speed) {
+            negotiate_profile(link);
+        }
+        read_message(link);
+        busy = 1;
+    }
+    else if(status == 2) {
+        if(link->config->negotiate_speed) {
+            negotiate_profile(link);
+        }
+        send_message(link);
+        busy = 1;
+    }
+    link->bus_peer = 0;
+
+    if(busy) {
+        slave->interval = BUS_POLL_MIN_NS;
+    }
+    else if(slave->interval < BUS_POLL_MAX_NS) {
+        slave->interval *= 2;
+    }
+    slave->next_poll = hal_now(link) + slave->interval;
+}
+
+//Probes every address once, done when the master starts
+static void bus_scan(struct Link *link) {
+    int address;
+    for(address = 1; (address < BUS_ADDRESSES) && (!hal_should_stop(link)); address += 1) {
+        bus_poll(link, address, 0);
+        sleep_for(link, BUS_GAP_NS);
+    }
+    link->bus_probe_next = 1;
+    link->bus_next_probe = hal_now(link) + BUS_PROBE_INTERVAL_NS;
+}
+
+//Present slave whose poll is due first, -1 if there are none. *next_poll is set to its poll time
+static int bus_next_slave(struct Link *link, u64 *next_poll) {
+    int address;
+    int best = -1;
+    for(address = 1; address < BUS_ADDRESSES; address += 1) {
+        if(link->bus_slaves[address].present &&
+           ((best < 0) || (link->bus_slaves[address].next_poll < link->bus_slaves[best].next_poll))) {
+            best = address;
+        }
+    }
+    if(best >= 0) {
+        *next_poll = link->bus_slaves[best].next_poll;
+    }
+    return best;
+}
+
+//Picks what the master does next on a bus: deliver the queued message, poll the slave that is due, probe an address
+//that wasn't there so far, or sleep until one of those is needed
+static void bus_master_cycle(struct Link *link) {
+    struct Data *message = peek_next_message(link);
+    u64 now = hal_now(link);
+    u64 max_wait = (u64) link->config->idle_poll_max_us * NSEC_PER_USEC;
+    u64 next_poll = now + max_wait;
+    int address;
+
+    if(message != NULL) {
+        address = READ_ONCE(message->address) & 0x7F;
+        if(!link->bus_slaves[address].present) {
+            //Given up like one that ran out of retries, so write() and poll() report it
+            LINK_WARN("%s: dropping a message for slave %d, it is not on the bus\n", link->name, address);
+            link->tx_failed += 1;
+            hal_message_failed(link);
+            link->sending_slot = NULL;
+            link->next_fragment_to_send = 0;
+            message_sent(link);
+            return;
+        }
+        bus_poll(link, address, 1);
+    }
+    else if(((address = bus_next_slave(link, &next_poll)) >= 0) && (next_poll <= now)) {
+        bus_poll(link, address, 0);
+    }
+    else if(now >= link->bus_next_probe) {
+        //Addresses that were never seen are probed one by one, so a slave that comes later is found too
+        address = link->bus_probe_next;
+        link->bus_probe_next = (address % (BUS_ADDRESSES - 1)) + 1;
+        link->bus_next_probe = now + BUS_PROBE_INTERVAL_NS;
+        if(!link->bus_slaves[address].present) {
+            bus_poll(link, address, 0);
+        }
+    }
+    else {
+        //Messages written meanwhile end the wait, the mapped send ring is checked at least every idle_poll_max_us
+        if(next_poll > now + max_wait) {
+            next_poll = now + max_wait;
+        }
+        if(next_poll > link->bus_next_probe) {
+            next_poll = link->bus_next_probe;
+        }
+        hal_wait_for_tx(link, next_poll - now);
+        return;
+    }
+    sleep_for(link, BUS_GAP_NS);
+}
+
+//Waits before the next reset. busy tells if the last one had a message in either direction
+static void master_poll_wait(struct Link *link, int busy) {
+    u64 min_interval = (u64) link->config->idle_poll_min_us * NSEC_PER_USEC;
+    u64 max_interval = (u64) link->config->idle_poll_max_us * NSEC_PER_USEC;
+    u64 min_gap = min_interval;
+    u64 recovery;
+
+    //After a broken frame the slave may still be waiting for the retry or for the line to go quiet, a reset in
+    //that time would be read as a frame and break the next exchange too
+    if(link->exchange_failed) {
+        recovery = 16 * PROFILE->bit_slot;
+        if((link->config->frame_mode != 0) && (recovery < NEXT_FRAME_TIMEOUT_NS)) {
+            recovery = NEXT_FRAME_TIMEOUT_NS;
+        }
+        if(min_gap < recovery) {
+            min_gap = recovery;
+        }
+        link->exchange_failed = 0;
+    }
+
+    if(busy) {
+        link->poll_interval = min_interval;
+    }
+    else {
+        link->poll_interval *= link->config->idle_poll_backoff;
+    }
+    if(link->poll_interval < min_interval) {
+        link->poll_interval = min_interval;
+    }
+    if(link->poll_interval > max_interval) {
+        link->poll_interval = max_interval;
+    }
+    //The slave needs the minimum gap to get ready for the next reset, only the rest of the wait can be cut short
+    sleep_for(link, min_gap);
+    if(link->poll_interval > min_gap) {
+        hal_wait_for_tx(link, link->poll_interval - min_gap);
+    }
+}
+
+void link_master_loop(struct Link *link) {
+    if(link_is_bus_master(link)) {
+        bus_scan(link);
+    }
+
+    while(!hal_should_stop(link)) {
+        int status;
+        u64 start;
+
+        //Nothing can be received while the receive ring is full, so unless there is something to send
+        //the master sleeps until user space reads (checking every 10ms for new messages to send)
+        if(rx_ring_full(link) && (link_tx_pending(link) == 0)) {
+            hal_wait_for_rx_space(link, 10 * NSEC_PER_MSEC);
+            continue;
+        }
+
+        if(link_is_bus_master(link)) {
+            bus_master_cycle(link);
+            continue;
+        }
+
+        start = hal_now(link);
+        status = reset(link);
+        stats_reset(link, start, status);
+        //-1: no slave, 0: nobody has a message, 1: the slave has one, 2: the master has one
+        if(status > 0) {
+            if(link->config->negotiate_speed) {
+                negotiate_profile(link);
+            }
+            if(status == 1) {
+                read_message(link);
+            }
+            else {
+                send_message(link);
+            }
+        }
+        master_poll_wait(link, status > 0);
+    }
+}
+
+//Slave side of a reset from the presence pulse on (timer is where it starts), then the message in either direction.
+//reset_start is when the master pulled the line low
+static void answer_reset(struct Link *link, int read_mode, int send_mode, u64 reset_start) {
+    hal_line_low(link);
+    timer_wait(link, 100000);
+    hal_line_release(link);
+    if(send_mode) {
+        timer_wait(link, 50000);
+        hal_line_low(link);
+        timer_wait(link, 100000);
+        hal_line_release(link);
+        timer_wait(link, 100000);
+        stats_reset(link, reset_start, 0);
+        if(link->config->negotiate_speed) {
+            negotiate_profile(link);
+        }
+        send_message(link);
+    }
+    else if(read_mode){
+        timer_wait(link, 250000);
+        stats_reset(link, reset_start, 0);
+        if(link->config->negotiate_speed) {
+            negotiate_profile(link);
+        }
+        read_message(link);
+    }
+    else {
+        timer_wait(link, 250000);
+        stats_reset(link, reset_start, 0);
+    }
+}
+
+void link_slave_loop(struct Link *link) {
+    int address_byte;
+    u64 reset_start;
+
+    while(!hal_should_stop(link)) {
+        int send_mode;
+        int read_mode = 0;
+
+        //The slave keeps answering resets while the receive ring is full (it may still have something to send),
+        //frames that would complete a message are answered with busy until there is room again
+        if(link->bus_address > 0) {
+            //On a bus only resets with our address are answered, everything else is somebody else's transaction
+            address_byte = wait_for_bus_reset(link, &reset_start);
+            if((address_byte < 0) || ((address_byte & 0x7F) != link->bus_address)) {
+                continue;
+            }
+            send_mode = (peek_next_message(link) != NULL);
+            read_mode = (address_byte & 0x80) != 0;
+            trace_gpio_reset_start(link->index, link->role, reset_start);
+            trace_gpio_reset_sample(link->index, link->role, 1, read_mode, link->timer);
+            timer_wait(link, 50000);
+            answer_reset(link, read_mode, send_mode, reset_start);
+            continue;
+        }
+
+        //Reset timing starts from the moment the master pulled the line low
+        if(hal_wait_for_edge(link, 0) < 0) {
+            continue;
+        }
+        reset_start = link->timer;
+        trace_gpio_reset_start(link->index, link->role, reset_start);
+
+        //Checked after the edge, so messages written while waiting are announced in this reset
+        send_mode = (peek_next_message(link) != NULL);
+        timer_wait(link, 350000);
+        read_mode = (hal_line_read(link) == 1);
+        trace_gpio_reset_sample(link->index, link->role, 1, read_mode, link->timer);
+        timer_wait(link, 200000);
+        answer_reset(link, read_mode, send_mode, reset_start);
+    }
+}
+
@@ -0,0 +1,391 @@
+//Protocol side of the link, shared by the kernel module and the user space programs that run the same protocol
+//(the simulator). Everything that touches the line, the clock or the processes goes through the hal_ functions at the
+//bottom, each user of this file implements them
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/bitops.h>
+#include <asm/barrier.h>
+#define LINK_WARN(...) printk(KERN_WARNING __VA_ARGS__)
+#define LINK_INFO(...) printk(KERN_INFO __VA_ARGS__)
+#else
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+typedef uint64_t u64;
+#define READ_ONCE(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define smp_load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define NSEC_PER_USEC 1000ULL
+#define NSEC_PER_MSEC 1000000ULL
+#define fls64(x) ((x) == 0 ? 0 : 64 - __builtin_clzll(x))
+#define hweight8(x) __builtin_popcount((uint8_t) (x))
+#define LINK_WARN(...) fprintf(stderr, __VA_ARGS__)
+#define LINK_INFO(...) fprintf(stderr, __VA_ARGS__)
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//Frame layout: header, length, payload (up to 10 bytes), checksum
+#define FRAME_HEADER 0xAA
+#define FRAME_HEADER_VARLEN 0xA1
+#define MAX_PAYLOAD_LENGTH 10
+#define FIXED_FRAME_LENGTH 13
+#define ACK 0x0F
+#define NAK 0x00
+//Frame was fine but the reader has no room for another message, the sender keeps it and ends the session
+#define ACK_BUSY 0xF0
+//Frame was fine and the reader has a message of its own, the session goes on in the other direction right after this
+//(4 bits away from every other answer, like they are from each other)
+#define ACK_REPLY 0x3C
+//How long the sender waits for the first edge of the reply after ACK_REPLY
+#define REPLY_TIMEOUT_NS 2000000
+
+//Messages longer than 10 bytes are split into fragments, fragment frames are variable length frames
+//with bit 1 of the header set. Their payload is message id, fragment index, fragment count and data
+#define FRAME_HEADER_FRAGMENT 0xA3
+#define FRAGMENT_HEADER_LENGTH 3
+#define FRAGMENT_DATA_LENGTH 32
+#define MAX_FRAME_LENGTH (3 + FRAGMENT_HEADER_LENGTH + FRAGMENT_DATA_LENGTH)
+#define MAX_MESSAGE_LENGTH 4096
+//Bit 4 of a variable length header means another frame follows right after this one is acknowledged
+#define FRAME_FLAG_MORE 0x10
+//Bit 2 of a variable length header means the rest of the frame is a continuous bit stream, with no gap between
+//bytes. The header itself is sent with normal timing and works as the sync preamble for the stream
+#define FRAME_FLAG_STREAM 0x04
+//Bit 3 of a variable length header means every byte after the header is sent as two Hamming SECDED code bytes
+//(one per nibble), the reader corrects single bit errors in each of them
+#define FRAME_FLAG_FEC 0x08
+#define FRAME_FLAGS (FRAME_FLAG_MORE | FRAME_FLAG_STREAM | FRAME_FLAG_FEC)
+//Variable length frames end with a CRC-8 (Dallas/Maxim polynomial) instead of the XOR checksum of fixed frames
+#define CRC8_POLYNOMIAL 0x8C
+//Longest wait between two tries of a frame (see retry_backoff_us)
+#define MAX_RETRY_BACKOFF_NS 4000000
+//How long the reader waits for the next frame of the same message (or the next try of a frame it NAKed)
+#define NEXT_FRAME_TIMEOUT_NS (2000000 + MAX_RETRY_BACKOFF_NS)
+//Fixed frames are acknowledged 15ms after they end, older drivers only start listening for the ACK 10ms after sending
+#define LEGACY_ACK_DELAY_NS 15000000
+//Variable length frames are acknowledged this many bit slots after they end, so the sender is listening by then
+#define ACK_GAP_SLOTS 2
+//Extra time the sender gives the ACK for the reader's thread to wake up
+#define ACK_MARGIN_NS 2000000
+
+//Gap between the two halves of the timing profile negotiation after a reset
+#define NEGOTIATION_GAP_NS 50000
+//Frames that fail in a row before the link falls back to a slower timing profile
+#define PROFILE_FALLBACK_ERRORS 3
+
+//Multi-drop bus: slaves have addresses 1-127, 0 is the master. A bus reset holds the line low for 500us, then the
+//master sends the address byte with standard timing (bit 7 set if it has a message for that slave), only the slave
+//with that address answers
+#define BUS_ADDRESSES 128
+#define BUS_RESET_NS 500000
+//Slaves sample a falling edge 95, 195, 295 and 395us after it, a reset is low at all of them. Data bits of every
+//profile are already released at those points, so a frame addressed to another slave never looks like a reset
+#define BUS_RESET_SAMPLE_NS 95000
+#define BUS_RESET_SAMPLES 4
+//Quiet time between two bus transactions, so every slave is waiting for the next edge again
+#define BUS_GAP_NS 1000000
+//A slave that had traffic is polled again after BUS_POLL_MIN_NS, every idle poll doubles that up to BUS_POLL_MAX_NS
+#define BUS_POLL_MIN_NS 2000000
+#define BUS_POLL_MAX_NS 512000000
+//Missed presence pulses in a row before a slave is considered gone
+#define BUS_MAX_MISSES 3
+//After the startup scan, one address that didn't answer is probed again this often
+#define BUS_PROBE_INTERVAL_NS 100000000
+
+
+//Classes of messages that are sent, every one has its own send ring. 0 goes first with tx_scheduler=0, with
+//tx_scheduler=1 they share the line by their weights (see tx_weights)
+#define TX_CLASS_URGENT 0
+#define TX_CLASS_REPLY 1
+#define TX_CLASS_NORMAL 2
+#define TX_CLASS_BULK 3
+#define NUM_TX_CLASSES 4
+#define TX_SCHEDULER_STRICT 0
+#define TX_SCHEDULER_WEIGHTED 1
+//Bytes a class may send per round of the weighted scheduler for every unit of its weight
+#define TX_QUANTUM 64
+
+//Slots of the send and receive rings can be mapped into user space, so this layout is shared with it
+//(id at offset 0, bus address at offset 1, length at offset 2, message at offset 4, deadline at offset 4104,
+//4112 bytes in total). On a bus master the address is where a message goes (send ring) or where it came from
+//(receive ring). The deadline is in nanoseconds of CLOCK_MONOTONIC, a message that isn't sent by then is dropped
+//instead (0 means it never expires)
+struct Data {
+    uint8_t id;
+    uint8_t address;
+    uint16_t length;
+    char buffer[MAX_MESSAGE_LENGTH];
+    uint64_t deadline;
+};
+
+//This part implements a lock-free single producer, single consumer ring of messages.
+//For sending, writers fill the slot at head and publish it (they are serialized among themselves by mtx2, so the ring
+//only ever sees one producer), the protocol thread peeks the slot at tail, sends straight from it and commits it.
+//Received messages go the other way, the protocol thread publishes them and readers (serialized by mtx1) commit them.
+//head and tail are free running, depth is a power of two so wrapping around doesn't skip slots.
+//The indices are pointers, because the send and receive rings keep them in the mapped RingControl page.
+//When user space is one side of a ring it can write anything there, slots are always picked with the mask so
+//that can't make us touch memory outside of the ring
+struct DataRing {
+    uint32_t *head;
+    uint32_t *tail;
+    uint32_t mask;
+    struct Data *slots;
+    uint32_t own_head;
+    uint32_t own_tail;
+};
+
+//Sets up a ring over memory that was allocated by the caller, depth is already a power of two
+static inline void data_ring_init_shared(struct DataRing *ring, unsigned int depth, uint32_t *head, uint32_t *tail,
+                                  struct Data *slots){
+    ring->head = head;
+    ring->tail = tail;
+    ring->mask = depth - 1;
+    ring->slots = slots;
+}
+
+//Producer side: returns the n-th free slot (0 is the one at head), or NULL if there aren't that many.
+//Nothing is visible to the consumer until it is published
+static inline struct Data *data_ring_claim_nth(struct DataRing *ring, unsigned int n) {
+    uint32_t head = READ_ONCE(*ring->head) + n;
+    if(head - smp_load_acquire(ring->tail) > ring->mask) {
+        return NULL;
+    }
+    return &ring->slots[head & ring->mask];
+}
+
+static inline struct Data *data_ring_claim(struct DataRing *ring) {
+    return data_ring_claim_nth(ring, 0);
+}
+
+//Publishes the first n claimed slots at once
+static inline void data_ring_publish_n(struct DataRing *ring, unsigned int n) {
+    //Release makes the slot contents visible before the new head
+    smp_store_release(ring->head, READ_ONCE(*ring->head) + n);
+}
+
+static inline void data_ring_publish(struct DataRing *ring) {
+    data_ring_publish_n(ring, 1);
+}
+
+//Consumer side: returns the oldest message without removing it, or NULL if the ring is empty
+static inline struct Data *data_ring_peek(struct DataRing *ring) {
+    uint32_t tail = READ_ONCE(*ring->tail);
+    if(smp_load_acquire(ring->head) == tail) {
+        return NULL;
+    }
+    return &ring->slots[tail & ring->mask];
+}
+
+//Frees the slot returned by data_ring_peek(), the producer may reuse it right after this
+static inline void data_ring_commit(struct DataRing *ring) {
+    smp_store_release(ring->tail, READ_ONCE(*ring->tail) + 1);
+}
+
+//Drops everything in the ring, only the consumer may do this
+static inline void data_ring_clear(struct DataRing *ring) {
+    smp_store_release(ring->tail, smp_load_acquire(ring->head));
+}
+
+static inline unsigned int data_ring_count(struct DataRing *ring) {
+    return smp_load_acquire(ring->head) - READ_ONCE(*ring->tail);
+}
+
+//Timing of a single bit and the gap after each byte, all in nanoseconds.
+//Resets are always done with the standard timing, the faster ones are only used for the data that follows
+struct TimingProfile {
+    const char *name;
+    u64 bit_slot;
+    u64 one_low;
+    u64 zero_low;
+    u64 sample_point;
+    u64 byte_gap;
+};
+
+#define NUM_TIMING_PROFILES 3
+extern const struct TimingProfile timing_profiles[NUM_TIMING_PROFILES];
+
+//Scheduler state of one address on a multi-drop bus (only used by the master)
+struct BusSlave {
+    int present;
+    int misses;
+    u64 interval;
+    u64 next_poll;
+};
+
+//Parts of a transaction the time on the line is split into
+#define PHASE_RESET 0
+#define PHASE_NEGOTIATE 1
+#define PHASE_SEND 2
+#define PHASE_READ 3
+#define NUM_PHASES 4
+extern const char *phase_names[NUM_PHASES];
+
+//How late timed edges were, bucket 0 is under 1us, bucket n (n > 0) from 2^(n-1) up to 2^n us, the last one
+//everything above
+#define LATENESS_BUCKETS 12
+
+//Counters of a link. Only the protocol thread writes them (writers only count a full queue), a reader can see them
+//a little out of date but never has to stop the traffic
+struct LinkStats {
+    u64 frames_sent;
+    u64 bytes_sent;
+    u64 frames_received;
+    u64 bytes_received;
+    u64 checksum_errors;
+    u64 naks_sent;
+    u64 naks_received;
+    u64 ack_timeouts;
+    u64 retries;
+    u64 busy_sent;
+    u64 busy_received;
+    u64 tx_queue_full;
+    u64 tx_expired;
+    u64 resets;
+    u64 no_presence;
+    u64 phase_ns[NUM_PHASES];
+    u64 lateness[LATENESS_BUCKETS];
+};
+
+//Protocol options of a link, the kernel module fills them in from its parameters (see driver.c for what each one does)
+struct LinkConfig {
+    int frame_mode;
+    int fec_mode;
+    int session_mode;
+    int negotiate_speed;
+    int turnaround;
+    int reply_window_us;
+    int max_retries;
+    int retry_backoff_us;
+    int idle_poll_min_us;
+    int idle_poll_max_us;
+    int idle_poll_backoff;
+    int bus_mode;
+    int rx_full_policy;
+    int tx_scheduler;
+    int tx_weights[NUM_TX_CLASSES];
+};
+
+//Protocol state of one end of a link. Only the thread running link_master_loop() or link_slave_loop() writes it,
+//except for the producer side of the tx_rings and the consumer side of rx_ring
+struct Link {
+    int index;
+    //master == 0, slave == 1;
+    int role;
+    char name[16];
+    const struct LinkConfig *config;
+    //Whatever the HAL needs to find its own state of the line
+    void *hal_data;
+
+    //Rings of messages that are going to get sent, one for every class (see TX_CLASS_NORMAL)
+    struct DataRing tx_rings[NUM_TX_CLASSES];
+    //Weighted scheduler: the class whose turn it is and how many bytes every class may still send in this round
+    int tx_turn;
+    int tx_deficit[NUM_TX_CLASSES];
+    //Received messages wait here until they are read
+    struct DataRing rx_ring;
+
+    //Current gap between resets of the master, see idle_poll_min_us. exchange_failed is set when a frame went
+    //wrong, the next gap is then long enough for the slave to give up on it
+    u64 poll_interval;
+    int exchange_failed;
+
+    //Message that is currently being sent (a slot in one of the rings), and the next fragment of it that needs an ACK
+    struct Data *message_to_send;
+    struct DataRing *message_ring;
+    int message_class;
+    struct Data *sending_slot;
+    int next_fragment_to_send;
+
+    //Fragments of a long message are collected here until the last one arrives
+    struct Data reassembly;
+    int reassembly_next_fragment;
+    int reassembly_fragment_count;
+
+    //Turnaround state: reply_requested means we answered with ACK_REPLY and send next, reply_coming that the other
+    //side did and we read next, in_reply that the session already changed direction once (it only does that once)
+    int reply_requested;
+    int reply_coming;
+    int in_reply;
+
+    //Tries of the current frame that got a NAK or no answer. Messages that are given up are counted in tx_failed,
+    //after max_retries or because their deadline passed (those are also in stats.tx_expired)
+    int frame_attempts;
+    unsigned int tx_failed;
+
+    struct LinkStats stats;
+
+    //Each message gets an id when it starts being sent, so fragments of different messages are not mixed
+    uint8_t next_message_id;
+
+    //Time every step of the protocol is measured from
+    u64 timer;
+
+    //Fastest profile this side supports, the profile used for data right now, and the fastest one we still allow
+    //after falling back because of errors
+    int timing_profile;
+    int active_profile;
+    int allowed_profile;
+    int consecutive_errors;
+
+    //Multi-drop bus. bus_address is the address of a slave (0 on point to point links) and bus_peer is the address
+    //the current transaction is with
+    int bus_address;
+    int bus_peer;
+    struct BusSlave bus_slaves[BUS_ADDRESSES];
+    int bus_probe_next;
+    u64 bus_next_probe;
+};
+
+//Fills in the lookup tables of the codecs, call once before any link is started
+void protocol_init(void);
+//Resets the protocol state, the rings, index, role, name, bus_address and timing_profile are set up by the caller
+void link_init(struct Link *link, const struct LinkConfig *config);
+//Protocol threads, they return when hal_should_stop() says so
+void link_master_loop(struct Link *link);
+void link_slave_loop(struct Link *link);
+//Number of messages waiting to be sent, safe from any thread
+unsigned int link_tx_pending(struct Link *link);
+//Masters of a multi-drop bus address every transaction and tag messages with the slave address
+int link_is_bus_master(struct Link *link);
+
+//--------------------HAL--------------------
+//Implemented by the user of the protocol. Times are in nanoseconds of a monotonic clock
+
+//Pulls the line low, lets it go back up (open drain) and samples it
+void hal_line_low(struct Link *link);
+void hal_line_release(struct Link *link);
+int hal_line_read(struct Link *link);
+u64 hal_now(struct Link *link);
+//Waits until deadline as exactly as possible, returns how late it is when the wait ends
+u64 hal_wait_until(struct Link *link, u64 deadline);
+//Waits until the other side pulls the line low and sets link->timer to the time of the edge.
+//Returns -1 if that doesn't happen before the timeout (0 means no timeout) or the link is stopped
+int hal_wait_for_edge(struct Link *link, u64 timeout_ns);
+//Sleeps for up to ns, returns early when a message is queued to be sent
+void hal_wait_for_tx(struct Link *link, u64 ns);
+//Sleeps for up to ns, returns early when a message is taken out of rx_ring
+void hal_wait_for_rx_space(struct Link *link, u64 ns);
+int hal_should_stop(struct Link *link);
+//Drops the oldest message of rx_ring to make room (rx_full_policy=1), returns -1 if that isn't possible right now
+int hal_rx_drop_oldest(struct Link *link);
+//A message was published to rx_ring
+void hal_message_received(struct Link *link);
+//A message was sent and its slot committed, or given up after max_retries or its deadline
+void hal_message_sent(struct Link *link);
+void hal_message_failed(struct Link *link);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
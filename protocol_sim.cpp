@@ -0,0 +1,1074 @@
+//Simulator of the link protocol. protocol.c runs unchanged on top of a virtual wire and a virtual clock, so timing
+//and protocol changes can be tried without two boards and jumper wires. Every side of the link (and the app on top
+//of it) is a fiber, the scheduler always runs the one that is due first, so a run with the same seed always gives
+//the same result no matter how fast the machine is.
+//The wire is open drain: it is low while anybody pulls it low, after the last one lets go it reads low for the rise
+//time of the pull-up. Reads can be flipped (noise), timed edges and edge interrupts come late by a random amount
+//(jitter) and now and then by a lot more (a hiccup, like the thread getting preempted).
+//Build with make sim, ./protocol_sim --help lists the options
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "protocol.h"
+#if !defined(__x86_64__) && !defined(__aarch64__)
+#include <ucontext.h>
+#endif
+
+#define NEVER UINT64_MAX
+#define FIBER_STACK_SIZE (256 * 1024)
+
+//Things a fiber can wait for besides its deadline
+#define EV_EDGE 0x01
+#define EV_TX 0x02
+#define EV_RX_SPACE 0x04
+#define EV_RX_DATA 0x08
+#define EV_TX_SPACE 0x10
+
+//Workloads, what the apps on both sides do
+#define WORKLOAD_FLOOD 0
+#define WORKLOAD_BIDIR 1
+#define WORKLOAD_PINGPONG 2
+
+struct Options {
+    struct LinkConfig config;
+    int timing_profile = 0;
+    int workload = WORKLOAD_FLOOD;
+    int message_length = 10;
+    //Messages per second each sending app queues, 0 keeps the send ring full
+    double rate = 0;
+    int slaves = 1;
+    double duration_s = 10;
+    uint64_t seed = 1;
+    int tx_queue_depth = 256;
+    int rx_queue_depth = 64;
+    //Wire and timing model, all times in nanoseconds
+    u64 rise_ns = 1000;
+    double noise = 0;
+    double jitter_ns = 250;
+    u64 irq_latency_ns = 1000;
+    double hiccup_rate = 0;
+    u64 hiccup_ns = 100000;
+    u64 read_cost_ns = 100;
+    int sweep = 0;
+    int ber_sweep = 0;
+    int check = 0;
+};
+
+struct Endpoint;
+
+//Saved state of a fiber that isn't running. On x86-64 and arm64 a switch only saves the callee saved registers on
+//the stack of the fiber and changes the stack pointer (see context_switch), elsewhere it falls back to ucontext,
+//which is a lot slower because it saves the signal mask with a system call on every switch
+struct Context {
+#if defined(__x86_64__) || defined(__aarch64__)
+    void *sp;
+#else
+    ucontext_t context;
+#endif
+};
+
+struct Fiber {
+    struct Context context;
+    std::vector<char> stack;
+    u64 wake_time;
+    int events;
+    int woken_by;
+    bool done;
+    Endpoint *endpoint;
+    void (*body)(Endpoint *);
+};
+
+//One side of the link with its app
+struct Endpoint {
+    struct Link link;
+    std::vector<struct Data> tx_slots;
+    //The app only sends normal messages, the rings of the other classes stay empty
+    std::vector<struct Data> class_slots[NUM_TX_CLASSES];
+    std::vector<struct Data> rx_slots;
+    bool driving_low;
+    u64 edge_timestamp;
+    Fiber *protocol;
+    Fiber *app;
+
+    //App state. Every message carries a sequence number, sent_time and received are indexed by it
+    uint32_t next_seq;
+    std::vector<u64> sent_time;
+    std::vector<bool> received;
+    int next_dest;
+    int waiting_for_answer;
+    u64 next_send;
+
+    //What the app saw coming in
+    u64 delivered;
+    u64 delivered_bytes;
+    u64 duplicates;
+    u64 corrupted;
+    u64 queue_full;
+    u64 rx_dropped;
+    std::vector<u64> latencies;
+};
+
+//Everything about one run, the HAL functions find it through this
+struct Sim {
+    Options options;
+    u64 now;
+    u64 end_time;
+    std::vector<Endpoint *> endpoints;
+    std::vector<Fiber *> fibers;
+    Fiber *current;
+    //Earliest wake time of every fiber but the running one, it can go on without a switch until then
+    u64 others_wake_time;
+    struct Context scheduler;
+    //Wire: how many sides pull it low, and when the last one let go
+    int low_count;
+    u64 release_time;
+    uint64_t rng;
+    u64 edges;
+    u64 switches;
+};
+
+static Sim *sim;
+
+//--------------------Random numbers--------------------
+//splitmix64, so runs give the same numbers with every compiler and C++ library
+
+static uint64_t random_next() {
+    uint64_t z = (sim->rng += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static double random_uniform() {
+    return (random_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+//How late a timed edge or an interrupt is
+static u64 random_lateness() {
+    u64 late = 0;
+    if(sim->options.jitter_ns > 0) {
+        late = (u64) (-sim->options.jitter_ns * log(1.0 - random_uniform()));
+    }
+    if((sim->options.hiccup_rate > 0) && (random_uniform() < sim->options.hiccup_rate)) {
+        late += sim->options.hiccup_ns;
+    }
+    return late;
+}
+
+//--------------------Fibers--------------------
+
+#if defined(__x86_64__)
+//context_switch(from, to): pushes the callee saved registers, stores the stack pointer in *from, switches to the
+//stack in to and pops the registers of that fiber. The return goes to wherever that fiber left off
+extern "C" void context_switch(void **from, void *to);
+asm(".text\n"
+    ".globl context_switch\n"
+    ".type context_switch, @function\n"
+    "context_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n");
+#define CONTEXT_SAVED_WORDS 6
+#elif defined(__aarch64__)
+extern "C" void context_switch(void **from, void *to);
+asm(".text\n"
+    ".globl context_switch\n"
+    ".type context_switch, %function\n"
+    "context_switch:\n"
+    "    sub sp, sp, #160\n"
+    "    stp d8, d9, [sp, #0]\n"
+    "    stp d10, d11, [sp, #16]\n"
+    "    stp d12, d13, [sp, #32]\n"
+    "    stp d14, d15, [sp, #48]\n"
+    "    stp x19, x20, [sp, #64]\n"
+    "    stp x21, x22, [sp, #80]\n"
+    "    stp x23, x24, [sp, #96]\n"
+    "    stp x25, x26, [sp, #112]\n"
+    "    stp x27, x28, [sp, #128]\n"
+    "    stp x29, x30, [sp, #144]\n"
+    "    mov x2, sp\n"
+    "    str x2, [x0]\n"
+    "    mov sp, x1\n"
+    "    ldp d8, d9, [sp, #0]\n"
+    "    ldp d10, d11, [sp, #16]\n"
+    "    ldp d12, d13, [sp, #32]\n"
+    "    ldp d14, d15, [sp, #48]\n"
+    "    ldp x19, x20, [sp, #64]\n"
+    "    ldp x21, x22, [sp, #80]\n"
+    "    ldp x23, x24, [sp, #96]\n"
+    "    ldp x25, x26, [sp, #112]\n"
+    "    ldp x27, x28, [sp, #128]\n"
+    "    ldp x29, x30, [sp, #144]\n"
+    "    add sp, sp, #160\n"
+    "    ret\n");
+#define CONTEXT_SAVED_WORDS 20
+#endif
+
+static void fiber_switch(struct Context *from, struct Context *to) {
+#if defined(__x86_64__) || defined(__aarch64__)
+    context_switch(&from->sp, to->sp);
+#else
+    swapcontext(&from->context, &to->context);
+#endif
+}
+
+//First thing a new fiber runs. Its body returning means the fiber is done, it never runs again
+static void fiber_entry() {
+    Fiber *fiber = sim->current;
+    fiber->body(fiber->endpoint);
+    fiber->done = true;
+    fiber_switch(&fiber->context, &sim->scheduler);
+}
+
+static Fiber *fiber_create(Endpoint *endpoint, void (*body)(Endpoint *)) {
+    Fiber *fiber = new Fiber();
+    fiber->stack.resize(FIBER_STACK_SIZE);
+#if defined(__x86_64__) || defined(__aarch64__)
+    //The first switch to the fiber finds zeroed registers and "returns" to fiber_entry, with the stack aligned the
+    //way a function call leaves it
+    uintptr_t top = ((uintptr_t) (fiber->stack.data() + fiber->stack.size())) & ~((uintptr_t) 15);
+    void **sp = (void **) top;
+#if defined(__x86_64__)
+    *(--sp) = NULL;
+    *(--sp) = (void *) fiber_entry;
+    sp -= CONTEXT_SAVED_WORDS;
+    memset(sp, 0, CONTEXT_SAVED_WORDS * sizeof(void *));
+#else
+    sp -= CONTEXT_SAVED_WORDS;
+    memset(sp, 0, CONTEXT_SAVED_WORDS * sizeof(void *));
+    //x30, the link register
+    sp[19] = (void *) fiber_entry;
+#endif
+    fiber->context.sp = sp;
+#else
+    getcontext(&fiber->context.context);
+    fiber->context.context.uc_stack.ss_sp = fiber->stack.data();
+    fiber->context.context.uc_stack.ss_size = fiber->stack.size();
+    fiber->context.context.uc_link = NULL;
+    makecontext(&fiber->context.context, fiber_entry, 0);
+#endif
+    fiber->wake_time = 0;
+    fiber->events = 0;
+    fiber->woken_by = 0;
+    fiber->done = false;
+    fiber->endpoint = endpoint;
+    fiber->body = body;
+    sim->fibers.push_back(fiber);
+    return fiber;
+}
+
+//Blocks the running fiber until deadline or one of events. Returns the event that woke it, 0 for the deadline.
+//When nobody else is due before the deadline the clock just moves forward, without a context switch
+static int fiber_block(u64 deadline, int events) {
+    Fiber *fiber = sim->current;
+    if((events == 0) && (deadline < sim->others_wake_time)) {
+        if(deadline > sim->now) {
+            sim->now = deadline;
+        }
+        return 0;
+    }
+    fiber->wake_time = deadline;
+    fiber->events = events;
+    fiber->woken_by = 0;
+    sim->switches += 1;
+    fiber_switch(&fiber->context, &sim->scheduler);
+    fiber->events = 0;
+    return fiber->woken_by;
+}
+
+//Wakes the fiber at time at if it waits for the event
+static void fiber_signal(Fiber *fiber, int event, u64 at) {
+    if((fiber == NULL) || fiber->done || (!(fiber->events & event))) {
+        return;
+    }
+    fiber->events = 0;
+    fiber->woken_by = event;
+    if(at < fiber->wake_time) {
+        fiber->wake_time = at;
+    }
+    if(at < sim->others_wake_time) {
+        sim->others_wake_time = at;
+    }
+}
+
+//Runs the fibers in order of their wake times until all of them are done. Once the run is over, fibers that wait
+//without a deadline are woken up, so they see hal_should_stop() and return
+static void scheduler_run() {
+    for(;;) {
+        Fiber *next = NULL;
+        for(Fiber *fiber : sim->fibers) {
+            if((!fiber->done) && ((next == NULL) || (fiber->wake_time < next->wake_time))) {
+                next = fiber;
+            }
+        }
+        if(next == NULL) {
+            return;
+        }
+        if(next->wake_time == NEVER) {
+            if(sim->now < sim->end_time) {
+                sim->now = sim->end_time;
+            }
+            for(Fiber *fiber : sim->fibers) {
+                if(!fiber->done) {
+                    fiber->events = 0;
+                    fiber->wake_time = sim->now;
+                }
+            }
+            continue;
+        }
+        if(next->wake_time > sim->now) {
+            sim->now = next->wake_time;
+        }
+        next->wake_time = NEVER;
+        sim->others_wake_time = NEVER;
+        for(Fiber *fiber : sim->fibers) {
+            if((fiber != next) && (!fiber->done) && (fiber->wake_time < sim->others_wake_time)) {
+                sim->others_wake_time = fiber->wake_time;
+            }
+        }
+        sim->current = next;
+        fiber_switch(&sim->scheduler, &next->context);
+    }
+}
+
+//--------------------Wire--------------------
+
+static int wire_level() {
+    if(sim->low_count > 0) {
+        return 0;
+    }
+    return (sim->now < sim->release_time + sim->options.rise_ns) ? 0 : 1;
+}
+
+static Endpoint *link_endpoint(struct Link *link) {
+    return (Endpoint *) link->hal_data;
+}
+
+//--------------------HAL--------------------
+
+void hal_line_low(struct Link *link) {
+    Endpoint *endpoint = link_endpoint(link);
+    int level = wire_level();
+    if(endpoint->driving_low) {
+        return;
+    }
+    endpoint->driving_low = true;
+    sim->low_count += 1;
+    if(level == 0) {
+        return;
+    }
+    //Falling edge, every other side waiting for one gets its interrupt (a little late)
+    sim->edges += 1;
+    for(Endpoint *other : sim->endpoints) {
+        if((other != endpoint) && (other->protocol->events & EV_EDGE)) {
+            other->edge_timestamp = sim->now + sim->options.irq_latency_ns + random_lateness();
+            fiber_signal(other->protocol, EV_EDGE, other->edge_timestamp);
+        }
+    }
+}
+
+void hal_line_release(struct Link *link) {
+    Endpoint *endpoint = link_endpoint(link);
+    if(!endpoint->driving_low) {
+        return;
+    }
+    endpoint->driving_low = false;
+    sim->low_count -= 1;
+    if(sim->low_count == 0) {
+        sim->release_time = sim->now;
+    }
+}
+
+//Reading the pin takes a little time, so busy loops on it move the clock forward
+int hal_line_read(struct Link *link) {
+    int level;
+    fiber_block(sim->now + sim->options.read_cost_ns, 0);
+    level = wire_level();
+    if((sim->options.noise > 0) && (random_uniform() < sim->options.noise)) {
+        level = !level;
+    }
+    return level;
+}
+
+u64 hal_now(struct Link *link) {
+    return sim->now;
+}
+
+u64 hal_wait_until(struct Link *link, u64 deadline) {
+    u64 wakeup;
+    if(deadline <= sim->now) {
+        return sim->now - deadline;
+    }
+    wakeup = deadline + random_lateness();
+    fiber_block(wakeup, 0);
+    return wakeup - deadline;
+}
+
+int hal_wait_for_edge(struct Link *link, u64 timeout_ns) {
+    Endpoint *endpoint = link_endpoint(link);
+    if(wire_level() == 0) {
+        fiber_block(sim->now + sim->options.read_cost_ns, 0);
+        link->timer = sim->now;
+        return 0;
+    }
+    //Waits with a deadline still run to the end once the run is over, so the exchange in progress (the ACK of the
+    //last frame) completes instead of counting as an error
+    if((timeout_ns == 0) && hal_should_stop(link)) {
+        return -1;
+    }
+    if(fiber_block((timeout_ns == 0) ? NEVER : sim->now + timeout_ns, EV_EDGE) != EV_EDGE) {
+        return -1;
+    }
+    link->timer = endpoint->edge_timestamp;
+    return 0;
+}
+
+void hal_wait_for_tx(struct Link *link, u64 ns) {
+    if(link_tx_pending(link) == 0) {
+        fiber_block(sim->now + ns, EV_TX);
+    }
+}
+
+void hal_wait_for_rx_space(struct Link *link, u64 ns) {
+    fiber_block(sim->now + ns, EV_RX_SPACE);
+}
+
+int hal_should_stop(struct Link *link) {
+    return sim->now >= sim->end_time;
+}
+
+int hal_rx_drop_oldest(struct Link *link) {
+    if(data_ring_peek(&link->rx_ring) != NULL) {
+        data_ring_commit(&link->rx_ring);
+        link_endpoint(link)->rx_dropped += 1;
+    }
+    return 0;
+}
+
+void hal_message_received(struct Link *link) {
+    fiber_signal(link_endpoint(link)->app, EV_RX_DATA, sim->now);
+}
+
+void hal_message_sent(struct Link *link) {
+    fiber_signal(link_endpoint(link)->app, EV_TX_SPACE, sim->now);
+}
+
+void hal_message_failed(struct Link *link) {
+}
+
+//--------------------Apps--------------------
+
+//Message contents: sequence number (4 bytes), index of the sender, then a pattern both sides can check
+static uint8_t pattern_byte(uint32_t seq, int sender, int i) {
+    return (uint8_t) (seq * 31 + sender * 7 + i * 13);
+}
+
+//Queues the next message to dest (only used on a bus master), returns -1 if the send ring is full
+static int app_send(Endpoint *endpoint, int dest) {
+    struct Link *link = &endpoint->link;
+    struct Data *slot = data_ring_claim(&link->tx_rings[TX_CLASS_NORMAL]);
+    uint32_t seq = endpoint->next_seq;
+    int length = sim->options.message_length;
+    int i;
+    if(slot == NULL) {
+        endpoint->queue_full += 1;
+        return -1;
+    }
+    memcpy(slot->buffer, &seq, 4);
+    slot->buffer[4] = (char) link->index;
+    for(i = 5; i < length; i += 1) {
+        slot->buffer[i] = (char) pattern_byte(seq, link->index, i);
+    }
+    slot->length = length;
+    slot->address = (uint8_t) dest;
+    endpoint->next_seq += 1;
+    endpoint->sent_time.push_back(sim->now);
+    endpoint->received.push_back(false);
+    data_ring_publish(&link->tx_rings[TX_CLASS_NORMAL]);
+    fiber_signal(endpoint->protocol, EV_TX, sim->now);
+    return 0;
+}
+
+//Checks a received message and records its latency, returns the index of the sender or -1 if it is corrupted
+static int app_receive(Endpoint *endpoint, struct Data *slot) {
+    uint32_t seq;
+    int sender;
+    int i;
+    Endpoint *from;
+    if(slot->length != sim->options.message_length) {
+        endpoint->corrupted += 1;
+        return -1;
+    }
+    memcpy(&seq, slot->buffer, 4);
+    sender = (uint8_t) slot->buffer[4];
+    if((sender >= (int) sim->endpoints.size()) || (seq >= sim->endpoints[sender]->next_seq)) {
+        endpoint->corrupted += 1;
+        return -1;
+    }
+    for(i = 5; i < slot->length; i += 1) {
+        if((uint8_t) slot->buffer[i] != pattern_byte(seq, sender, i)) {
+            endpoint->corrupted += 1;
+            return -1;
+        }
+    }
+    from = sim->endpoints[sender];
+    if(from->received[seq]) {
+        //The ACK got lost and the sender tried again
+        endpoint->duplicates += 1;
+        return sender;
+    }
+    from->received[seq] = true;
+    endpoint->delivered += 1;
+    endpoint->delivered_bytes += slot->length;
+    endpoint->latencies.push_back(sim->now - from->sent_time[seq]);
+    return sender;
+}
+
+//Where the next message of this side goes, a bus master takes turns with its slaves
+static int app_dest(Endpoint *endpoint) {
+    int dest = 0;
+    if(link_is_bus_master(&endpoint->link)) {
+        dest = endpoint->next_dest;
+        endpoint->next_dest = (dest % sim->options.slaves) + 1;
+    }
+    return dest;
+}
+
+static bool app_sends(Endpoint *endpoint) {
+    if(sim->options.workload == WORKLOAD_BIDIR) {
+        return true;
+    }
+    return endpoint->link.role == 0;
+}
+
+static void app_loop(Endpoint *endpoint) {
+    struct Link *link = &endpoint->link;
+    struct Data *slot;
+    u64 interval = (sim->options.rate > 0) ? (u64) (1e9 / sim->options.rate) : 0;
+
+    endpoint->next_send = 0;
+    while(sim->now < sim->end_time) {
+        u64 deadline = NEVER;
+
+        //Reads everything that came in, the responder of a ping-pong answers every message right away
+        while((slot = data_ring_peek(&link->rx_ring)) != NULL) {
+            int sender = app_receive(endpoint, slot);
+            data_ring_commit(&link->rx_ring);
+            if(sim->options.workload == WORKLOAD_PINGPONG) {
+                if(link->role == 1) {
+                    app_send(endpoint, 0);
+                }
+                else if(sender >= 0) {
+                    endpoint->waiting_for_answer = 0;
+                }
+            }
+        }
+        fiber_signal(endpoint->protocol, EV_RX_SPACE, sim->now);
+
+        if(sim->options.workload == WORKLOAD_PINGPONG) {
+            if((link->role == 0) && (!endpoint->waiting_for_answer) && (app_send(endpoint, app_dest(endpoint)) == 0)) {
+                endpoint->waiting_for_answer = 1;
+            }
+        }
+        else if(app_sends(endpoint)) {
+            if(interval == 0) {
+                while(data_ring_claim(&link->tx_rings[TX_CLASS_NORMAL]) != NULL) {
+                    app_send(endpoint, app_dest(endpoint));
+                }
+            }
+            else {
+                while(endpoint->next_send <= sim->now) {
+                    app_send(endpoint, app_dest(endpoint));
+                    endpoint->next_send += interval;
+                }
+                deadline = endpoint->next_send;
+            }
+        }
+        fiber_block(deadline, EV_RX_DATA | EV_TX_SPACE);
+    }
+}
+
+static void protocol_loop(Endpoint *endpoint) {
+    if(endpoint->link.role == 0) {
+        link_master_loop(&endpoint->link);
+    }
+    else {
+        link_slave_loop(&endpoint->link);
+    }
+}
+
+//--------------------Runs--------------------
+
+struct Result {
+    u64 delivered[2];
+    u64 bytes[2];
+    u64 duplicates;
+    u64 corrupted;
+    u64 tx_failed;
+    u64 queue_full;
+    u64 rx_dropped;
+    std::vector<u64> latencies[2];
+    struct LinkStats stats;
+    u64 edges;
+    u64 switches;
+    double wall_s;
+};
+
+static void ring_setup(struct DataRing *ring, std::vector<struct Data> &slots, int depth) {
+    unsigned int size = 1;
+    while(size < (unsigned int) depth) {
+        size *= 2;
+    }
+    slots.assign(size, Data());
+    ring->own_head = 0;
+    ring->own_tail = 0;
+    data_ring_init_shared(ring, size, &ring->own_head, &ring->own_tail, slots.data());
+}
+
+static Endpoint *endpoint_create(int index, int role, int bus_address) {
+    Endpoint *endpoint = new Endpoint();
+    struct Link *link = &endpoint->link;
+    int i;
+    memset(link, 0, sizeof(*link));
+    link->index = index;
+    link->role = role;
+    snprintf(link->name, sizeof(link->name), "%s%d", (role == 0) ? "master" : "slave", index & 0xFF);
+    link->hal_data = endpoint;
+    link->bus_address = bus_address;
+    link->timing_profile = sim->options.timing_profile;
+    for(i = 0; i < NUM_TX_CLASSES; i += 1) {
+        if(i == TX_CLASS_NORMAL) {
+            ring_setup(&link->tx_rings[i], endpoint->tx_slots, sim->options.tx_queue_depth);
+        }
+        else {
+            ring_setup(&link->tx_rings[i], endpoint->class_slots[i], 1);
+        }
+    }
+    ring_setup(&link->rx_ring, endpoint->rx_slots, sim->options.rx_queue_depth);
+    link_init(link, &sim->options.config);
+    endpoint->next_dest = 1;
+    endpoint->protocol = fiber_create(endpoint, protocol_loop);
+    endpoint->app = fiber_create(endpoint, app_loop);
+    sim->endpoints.push_back(endpoint);
+    return endpoint;
+}
+
+static void stats_add(struct LinkStats *total, const struct LinkStats *stats) {
+    const u64 *from = (const u64 *) stats;
+    u64 *to = (u64 *) total;
+    size_t i;
+    for(i = 0; i < sizeof(*stats) / sizeof(u64); i += 1) {
+        to[i] += from[i];
+    }
+}
+
+static Result run(const Options &options) {
+    Result result = Result();
+    Sim state = Sim();
+    int i;
+    auto wall_start = std::chrono::steady_clock::now();
+
+    sim = &state;
+    sim->options = options;
+    sim->now = 0;
+    sim->end_time = (u64) (options.duration_s * 1e9);
+    sim->rng = options.seed;
+    sim->release_time = 0;
+    endpoint_create(0, 0, 0);
+    for(i = 1; i <= options.slaves; i += 1) {
+        endpoint_create(i, 1, options.config.bus_mode ? i : 0);
+    }
+    scheduler_run();
+
+    for(Endpoint *endpoint : sim->endpoints) {
+        //Direction 0 is slave to master, 1 is master to slave
+        int direction = (endpoint->link.role == 0) ? 0 : 1;
+        result.delivered[direction] += endpoint->delivered;
+        result.bytes[direction] += endpoint->delivered_bytes;
+        result.duplicates += endpoint->duplicates;
+        result.corrupted += endpoint->corrupted;
+        result.tx_failed += endpoint->link.tx_failed;
+        result.queue_full += endpoint->queue_full;
+        result.rx_dropped += endpoint->rx_dropped;
+        result.latencies[direction].insert(result.latencies[direction].end(), endpoint->latencies.begin(),
+                                           endpoint->latencies.end());
+        stats_add(&result.stats, &endpoint->link.stats);
+    }
+    result.edges = sim->edges;
+    result.switches = sim->switches;
+    result.wall_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+
+    for(Fiber *fiber : sim->fibers) {
+        delete fiber;
+    }
+    for(Endpoint *endpoint : sim->endpoints) {
+        delete endpoint;
+    }
+    sim = NULL;
+    return result;
+}
+
+//--------------------Output--------------------
+
+static double percentile_us(std::vector<u64> &values, double p) {
+    size_t i;
+    if(values.empty()) {
+        return 0;
+    }
+    i = (size_t) (p * (values.size() - 1));
+    std::nth_element(values.begin(), values.begin() + i, values.end());
+    return values[i] / 1000.0;
+}
+
+static void print_header() {
+    printf("%-34s %9s %10s %9s %9s %9s %8s %8s %8s %8s %8s %9s\n", "variant", "msgs/s", "goodput", "p50_us",
+           "p99_us", "max_us", "retries", "naks", "ack_to", "fail", "corrupt", "frames/s");
+}
+
+//One line per run: throughput and latency of both directions together, error counters, and how fast the simulator
+//went (frames per second of wall clock time)
+static void print_result(const std::string &name, const Options &options, Result &result) {
+    std::vector<u64> all = result.latencies[0];
+    u64 delivered = result.delivered[0] + result.delivered[1];
+    u64 bytes = result.bytes[0] + result.bytes[1];
+    all.insert(all.end(), result.latencies[1].begin(), result.latencies[1].end());
+    printf("%-34s %9.1f %8.0fB/s %9.0f %9.0f %9.0f %8llu %8llu %8llu %8llu %8llu %9.0f\n", name.c_str(),
+           delivered / options.duration_s, bytes / options.duration_s, percentile_us(all, 0.5),
+           percentile_us(all, 0.99), percentile_us(all, 1.0), (unsigned long long) result.stats.retries,
+           (unsigned long long) result.stats.naks_received, (unsigned long long) result.stats.ack_timeouts,
+           (unsigned long long) result.tx_failed, (unsigned long long) result.corrupted,
+           result.stats.frames_sent / result.wall_s);
+}
+
+static void print_details(const Options &options, Result &result) {
+    int i;
+    printf("\nmaster -> slave: %llu messages, %.1f msgs/s, latency p50 %.0fus p99 %.0fus p999 %.0fus\n",
+           (unsigned long long) result.delivered[1],
+           result.delivered[1] / options.duration_s, percentile_us(result.latencies[1], 0.5),
+           percentile_us(result.latencies[1], 0.99), percentile_us(result.latencies[1], 0.999));
+    printf("slave -> master: %llu messages, %.1f msgs/s, latency p50 %.0fus p99 %.0fus p999 %.0fus\n",
+           (unsigned long long) result.delivered[0], result.delivered[0] / options.duration_s,
+           percentile_us(result.latencies[0], 0.5), percentile_us(result.latencies[0], 0.99),
+           percentile_us(result.latencies[0], 0.999));
+    printf("frames_sent %llu frames_received %llu checksum_errors %llu naks_received %llu ack_timeouts %llu\n",
+           (unsigned long long) result.stats.frames_sent, (unsigned long long) result.stats.frames_received,
+           (unsigned long long) result.stats.checksum_errors, (unsigned long long) result.stats.naks_received,
+           (unsigned long long) result.stats.ack_timeouts);
+    printf("retries %llu busy_received %llu resets %llu no_presence %llu tx_failed %llu duplicates %llu corrupted %llu\n",
+           (unsigned long long) result.stats.retries, (unsigned long long) result.stats.busy_received,
+           (unsigned long long) result.stats.resets, (unsigned long long) result.stats.no_presence,
+           (unsigned long long) result.tx_failed, (unsigned long long) result.duplicates,
+           (unsigned long long) result.corrupted);
+    printf("queue_full %llu rx_dropped %llu\n", (unsigned long long) result.queue_full,
+           (unsigned long long) result.rx_dropped);
+    for(i = 0; i < NUM_PHASES; i += 1) {
+        printf("phase_%s %.1f%% (summed over every side)\n", phase_names[i],
+               100.0 * result.stats.phase_ns[i] / (options.duration_s * 1e9));
+    }
+    printf("simulated %.1fs in %.2fs: %llu edges, %llu context switches, %.0f frames/s\n", options.duration_s,
+           result.wall_s, (unsigned long long) result.edges, (unsigned long long) result.switches,
+           result.stats.frames_sent / result.wall_s);
+}
+
+//--------------------Main--------------------
+
+static void usage() {
+    std::cout << "Usage: protocol_sim [options]\n"
+              << "Protocol (same meaning as the module parameters):\n"
+              << "  --frame-mode N --fec-mode N --session-mode N --turnaround N --reply-window-us N\n"
+              << "  --negotiate-speed N --timing-profile N --max-retries N --retry-backoff-us N\n"
+              << "  --idle-poll-min-us N --idle-poll-max-us N --idle-poll-backoff N --rx-full-policy N\n"
+              << "  --tx-queue-depth N --rx-queue-depth N\n"
+              << "  --bus-mode N --slaves N       slaves on the line (more than one needs --bus-mode 1)\n"
+              << "Workload:\n"
+              << "  --workload flood|bidir|pingpong   (default flood, master to slave)\n"
+              << "  --length N                  message length, 5 to 4096 (default 10)\n"
+              << "  --rate N                    messages per second of every sender, 0 keeps its queue full\n"
+              << "  --duration S                virtual seconds to run (default 10)\n"
+              << "  --seed N\n"
+              << "Wire and timing:\n"
+              << "  --rise-ns N                 pull-up rise time (default 1000)\n"
+              << "  --noise P                   probability that a read of the line is flipped\n"
+              << "  --jitter-ns N               mean lateness of timed edges and interrupts (default 250)\n"
+              << "  --irq-latency-ns N          fixed delay of the edge interrupt (default 1000)\n"
+              << "  --hiccup-rate P --hiccup-ns N   now and then an edge is this much later (preemption)\n"
+              << "  --read-cost-ns N            time a read of the pin takes (default 100)\n"
+              << "Runs:\n"
+              << "  --sweep                     runs every protocol variant with the workload above\n"
+              << "  --ber-sweep                 runs the options above with more and more noise\n"
+              << "  --check                     runs every variant clean and with --noise (default 1e-05) and fails\n"
+              << "                              if the clean run (no noise, jitter or hiccups) has any error or the\n"
+              << "                              noisy run doesn't get at least 80% of the clean throughput\n";
+}
+
+static int parse_workload(const char *name) {
+    if(strcmp(name, "flood") == 0) {
+        return WORKLOAD_FLOOD;
+    }
+    if(strcmp(name, "bidir") == 0) {
+        return WORKLOAD_BIDIR;
+    }
+    if(strcmp(name, "pingpong") == 0) {
+        return WORKLOAD_PINGPONG;
+    }
+    return -1;
+}
+
+static int parse_options(int argc, char **argv, Options &options) {
+    struct LinkConfig &c = options.config;
+    int i;
+    memset(&c, 0, sizeof(c));
+    c.max_retries = 2;
+    c.retry_backoff_us = 250;
+    c.idle_poll_min_us = 200;
+    c.idle_poll_max_us = 10000;
+    c.idle_poll_backoff = 2;
+    c.tx_weights[TX_CLASS_URGENT] = 8;
+    c.tx_weights[TX_CLASS_REPLY] = 4;
+    c.tx_weights[TX_CLASS_NORMAL] = 2;
+    c.tx_weights[TX_CLASS_BULK] = 1;
+
+    for(i = 1; i < argc; i += 1) {
+        std::string arg = argv[i];
+        if(arg == "--sweep") {
+            options.sweep = 1;
+            continue;
+        }
+        if(arg == "--ber-sweep") {
+            options.ber_sweep = 1;
+            continue;
+        }
+        if(arg == "--check") {
+            options.check = 1;
+            continue;
+        }
+        if((arg == "--help") || (i + 1 >= argc)) {
+            return -1;
+        }
+        const char *value = argv[++i];
+        if(arg == "--frame-mode") c.frame_mode = atoi(value);
+        else if(arg == "--fec-mode") c.fec_mode = atoi(value);
+        else if(arg == "--session-mode") c.session_mode = atoi(value);
+        else if(arg == "--turnaround") c.turnaround = atoi(value);
+        else if(arg == "--reply-window-us") c.reply_window_us = atoi(value);
+        else if(arg == "--negotiate-speed") c.negotiate_speed = atoi(value);
+        else if(arg == "--max-retries") c.max_retries = atoi(value);
+        else if(arg == "--retry-backoff-us") c.retry_backoff_us = atoi(value);
+        else if(arg == "--idle-poll-min-us") c.idle_poll_min_us = atoi(value);
+        else if(arg == "--idle-poll-max-us") c.idle_poll_max_us = atoi(value);
+        else if(arg == "--idle-poll-backoff") c.idle_poll_backoff = atoi(value);
+        else if(arg == "--rx-full-policy") c.rx_full_policy = atoi(value);
+        else if(arg == "--bus-mode") c.bus_mode = atoi(value);
+        else if(arg == "--timing-profile") options.timing_profile = atoi(value);
+        else if(arg == "--tx-queue-depth") options.tx_queue_depth = atoi(value);
+        else if(arg == "--rx-queue-depth") options.rx_queue_depth = atoi(value);
+        else if(arg == "--slaves") options.slaves = atoi(value);
+        else if(arg == "--workload") options.workload = parse_workload(value);
+        else if(arg == "--length") options.message_length = atoi(value);
+        else if(arg == "--rate") options.rate = atof(value);
+        else if(arg == "--duration") options.duration_s = atof(value);
+        else if(arg == "--seed") options.seed = strtoull(value, NULL, 0);
+        else if(arg == "--rise-ns") options.rise_ns = strtoull(value, NULL, 0);
+        else if(arg == "--noise") options.noise = atof(value);
+        else if(arg == "--jitter-ns") options.jitter_ns = atof(value);
+        else if(arg == "--irq-latency-ns") options.irq_latency_ns = strtoull(value, NULL, 0);
+        else if(arg == "--hiccup-rate") options.hiccup_rate = atof(value);
+        else if(arg == "--hiccup-ns") options.hiccup_ns = strtoull(value, NULL, 0);
+        else if(arg == "--read-cost-ns") options.read_cost_ns = strtoull(value, NULL, 0);
+        else return -1;
+    }
+    return 0;
+}
+
+//Same checks the module does when it is loaded
+static int check_options(Options &options) {
+    struct LinkConfig &c = options.config;
+    if((options.workload < 0) || (options.timing_profile < 0) || (options.timing_profile >= NUM_TIMING_PROFILES)) {
+        std::cout << "Invalid workload or timing profile" << std::endl;
+        return -1;
+    }
+    if((options.message_length < 5) || (options.message_length > MAX_MESSAGE_LENGTH) ||
+       ((c.frame_mode == 0) && (options.message_length > MAX_PAYLOAD_LENGTH))) {
+        std::cout << "Messages are 5 to 4096 bytes long, with frame_mode 0 at most 10" << std::endl;
+        return -1;
+    }
+    if((options.slaves < 1) || (options.slaves >= BUS_ADDRESSES) || ((options.slaves > 1) && (!c.bus_mode))) {
+        std::cout << "More than one slave needs --bus-mode 1" << std::endl;
+        return -1;
+    }
+    if((c.idle_poll_min_us < 1) || (c.idle_poll_max_us < c.idle_poll_min_us) || (c.idle_poll_backoff < 1) ||
+       (c.max_retries < 0) || (c.retry_backoff_us < 0) || (options.tx_queue_depth < 1) ||
+       (options.rx_queue_depth < 1) || (options.duration_s <= 0)) {
+        std::cout << "Invalid parameters" << std::endl;
+        return -1;
+    }
+    if(c.frame_mode == 0) {
+        c.fec_mode = 0;
+        c.turnaround = 0;
+        c.session_mode = 0;
+    }
+    if(c.reply_window_us < 0) {
+        c.reply_window_us = 0;
+    }
+    return 0;
+}
+
+//Protocol variants of --sweep, on top of whatever else was given
+struct Variant {
+    const char *name;
+    int frame_mode;
+    int fec_mode;
+    int session_mode;
+    int turnaround;
+    int timing_profile;
+};
+
+static const Variant variants[] = {
+    {"fixed standard", 0, 0, 0, 0, 0},
+    {"fixed overdrive", 0, 0, 0, 0, 2},
+    {"varlen standard", 1, 0, 0, 0, 0},
+    {"varlen fast", 1, 0, 0, 0, 1},
+    {"varlen overdrive", 1, 0, 0, 0, 2},
+    {"stream overdrive", 2, 0, 0, 0, 2},
+    {"stream overdrive session", 2, 0, 1, 0, 2},
+    {"stream overdrive fec", 2, 1, 1, 0, 2},
+    {"stream overdrive turnaround", 2, 0, 1, 1, 2},
+};
+
+//Options of one variant on top of the given ones, returns -1 if the variant doesn't fit them
+static int variant_options(const Variant &variant, const Options &options, Options &o) {
+    o = options;
+    o.config.frame_mode = variant.frame_mode;
+    o.config.fec_mode = variant.fec_mode;
+    o.config.session_mode = variant.session_mode;
+    o.config.turnaround = variant.turnaround;
+    o.timing_profile = variant.timing_profile;
+    if((variant.frame_mode == 0) && (o.message_length > MAX_PAYLOAD_LENGTH)) {
+        return -1;
+    }
+    return 0;
+}
+
+//Everything that goes wrong in a run, a clean one has none of them
+static u64 result_errors(const Result &result) {
+    return result.stats.checksum_errors + result.stats.naks_received + result.stats.ack_timeouts +
+           result.stats.retries + result.tx_failed + result.corrupted + result.duplicates;
+}
+
+//Regression check: a bit of noise costs a few retries, but the link has to get back in step after every broken
+//frame instead of tripping over the recovery of the other side
+
+static int run_check(const Options &options) {
+    double noise = (options.noise > 0) ? options.noise : 1e-5;
+    int failed = 0;
+
+    print_header();
+    for(const Variant &variant : variants) {
+        Options clean;
+        Options noisy;
+        Result clean_result;
+        Result noisy_result;
+        double clean_rate;
+        double noisy_rate;
+        if(variant_options(variant, options, clean) < 0) {
+            continue;
+        }
+        if(check_options(clean) < 0) {
+            return 1;
+        }
+        noisy = clean;
+        noisy.noise = noise;
+        //The clean run gets an ideal wire, even the tail of the jitter now and then moves an edge past a sample point
+        clean.noise = 0;
+        clean.jitter_ns = 0;
+        clean.hiccup_rate = 0;
+        clean_result = run(clean);
+        noisy_result = run(noisy);
+        print_result(std::string(variant.name) + " clean", clean, clean_result);
+        print_result(std::string(variant.name) + " noisy", noisy, noisy_result);
+        clean_rate = (clean_result.delivered[0] + clean_result.delivered[1]) / clean.duration_s;
+        noisy_rate = (noisy_result.delivered[0] + noisy_result.delivered[1]) / noisy.duration_s;
+        if(result_errors(clean_result) > 0) {
+            printf("FAIL %s: %llu errors without noise\n", variant.name,
+                   (unsigned long long) result_errors(clean_result));
+            failed = 1;
+        }
+        if((clean_rate <= 0) || (noisy_rate < 0.8 * clean_rate)) {
+            printf("FAIL %s: %.1f msgs/s with noise %g, %.1f without\n", variant.name, noisy_rate, noise, clean_rate);
+            failed = 1;
+        }
+    }
+    printf(failed ? "check failed\n" : "check passed\n");
+    return failed;
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    Result result;
+
+    if(parse_options(argc, argv, options) < 0) {
+        usage();
+        return 1;
+    }
+    protocol_init();
+
+    if(options.check) {
+        return run_check(options);
+    }
+    if(options.sweep) {
+        print_header();
+        for(const Variant &variant : variants) {
+            Options o;
+            if(variant_options(variant, options, o) < 0) {
+                continue;
+            }
+            if(check_options(o) < 0) {
+                return 1;
+            }
+            result = run(o);
+            print_result(variant.name, o, result);
+        }
+        return 0;
+    }
+
+    if(check_options(options) < 0) {
+        return 1;
+    }
+    if(options.ber_sweep) {
+        static const double levels[] = {0, 1e-5, 1e-4, 1e-3, 3e-3, 1e-2, 3e-2};
+        print_header();
+        for(double noise : levels) {
+            Options o = options;
+            char name[32];
+            o.noise = noise;
+            snprintf(name, sizeof(name), "noise %g", noise);
+            result = run(o);
+            print_result(name, o, result);
+        }
+        return 0;
+    }
+
+    result = run(options);
+    print_header();
+    print_result("run", options, result);
+    print_details(options, result);
+    return 0;
+}
@@ -1,4 +1,3 @@
 #!/bin/sh
 #A simple but necessary improvement for my efficiency
-rmmod driver
-rmmod driver2
\ No newline at end of file
+rmmod gpio_link
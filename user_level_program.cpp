@@ -1,101 +1,79 @@
 #include <iostream>
-#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <csignal>
+#include "gpio_link_client.h"
 
 #define MAGIC 'k'
-#define USER_APP_REG _IOW(MAGIC, 1, int*)
 #define USER_APP_UNREG _IO(MAGIC, 2)
-//Signal number that the driver sends when a message is received
-#define SIGDATARECV 47 
-#define MAX_NUM_BYTES_IN_A_MESSAGE 10
+//Messages longer than 10 bytes are fragmented by the driver (needs frame_mode=1 on both sides)
+#define MAX_NUM_BYTES_IN_A_MESSAGE 4096
 #define MASTERNAME "/dev/gpio_master"
 #define SLAVENAME "/dev/gpio_slave"
 
 static const char* dev_file;
+//The dev file stays open for the whole run (see gpio_link_client.h), received messages come on the loop thread
+static GpioLinkLoop *loop = NULL;
+static GpioLink *dev_link = NULL;
+//Replies go through a second open file of the same device that is set to the reply class
+static GpioLink *reply_link = NULL;
 
 //prototype
 int send_message(std::string *msg, int is_command);
 
-void signal_handler(int sig_num) {
-    //std::cout << "Signal received: " << sig_num << std:: endl;
-    int file = open(dev_file, O_RDWR);
-    if (file < 0) {
-        std::cout << "Could't open file" << std::endl;
-        return;
-    }
-    if (sig_num == SIGINT) {
-        std::cout << "Signaling kernel and terminating app"<< std::endl;
-        ioctl(file, USER_APP_UNREG);
-        exit(EXIT_SUCCESS);
-    }
-    else if (sig_num == SIGDATARECV) {
-        //std::cout << "Data received" << std::endl;
-        char str[11];
-         //The first character read is the message length (check gpio_read in driver)
-        read(file, &str, 11);
-        u_int8_t l = (u_int8_t) str[0];
-        int len = (int) l;
-        str[len + 1] = '\0';
-        if (str[1] == 0xBB) {
-            std::cout << "The other side commands: " << &(str[2]) << std::endl;
-            //Prepare and send response
-            std::string msg;
-            msg.push_back(0xBC);
-            for (int i = 0; i < len - 1; i += 1) {
-                msg.push_back(str[i+2] + 2);
-            }
-            if(send_message(&msg, 0) < 0) {
+//Prints a received message, and answers it if it is a command
+void handle_message(std::string msg_in) {
+    const char *msg_start = msg_in.c_str();
+    int len = msg_in.length();
+    if (msg_start[0] == (char) 0xBB) {
+        std::cout << "The other side commands: " << &(msg_start[1]) << std::endl;
+        //Prepare and send response
+        std::string msg;
+        msg.push_back(0xBC);
+        for (int i = 0; i < len - 1; i += 1) {
+            msg.push_back(msg_start[i+1] + 2);
+        }
+        //This runs on the loop thread, so it can't wait for the reply to be queued
+        reply_link->send(msg.data(), msg.length(), [](int result) {
+            if(result < 0) {
                 std::cout << "Error responding to command (queue might be full)" << std::endl;
             }
             else {
-                std::cout << "Replied to command, length = " << msg.length() << std::endl;
+                std::cout << "Replied to command, length = " << result << std::endl;
             }
-        }
-        else if (str[1] == 0xBC) {
-            std::cout << "The other side replied: " << &(str[2]) << std::endl;
-        }
-        else {
-            std::cout << "The other side says: " << &(str[1]) << std::endl;
-        }
+        });
+    }
+    else if (msg_start[0] == (char) 0xBC) {
+        std::cout << "The other side replied: " << &(msg_start[1]) << std::endl;
+    }
+    else {
+        std::cout << "The other side says: " << msg_start << std::endl;
     }
-    close(file);
 }
 
-//Writes a string to the proper device file
-int send_message(std::string *msg, int is_command){
-    int file = open(dev_file, O_RDWR);
-    if (file < 0) {
-        std::cout << "Could't open dev file " << std::endl;
-        return -1;
+void signal_handler(int sig_num) {
+    //std::cout << "Signal received: " << sig_num << std:: endl;
+    if (sig_num == SIGINT) {
+        std::cout << "Signaling kernel and terminating app"<< std::endl;
+        if (dev_link != NULL) {
+            ioctl(dev_link->fd(), USER_APP_UNREG);
+        }
+        exit(EXIT_SUCCESS);
     }
+}
 
+//Queues a string on the link and waits until the driver took it
+int send_message(std::string *msg, int is_command){
+    std::string message;
     if(is_command) {
-        char message[msg->length() + 1];
-        message[0] = 0xBB;
-        for (unsigned int i = 1; i < msg->length() + 1; i += 1) {
-            message[i] = msg->at(i-1);
-        }
-        if(write(file, message, msg->length() + 1) < 0) {
-            close(file);
-            return -1;
-        }
+        message.push_back(0xBB);
     }
-    else {
-        char message[msg->length()];
-        for (unsigned int i = 0; i < msg->length(); i += 1) {
-            message[i] = msg->at(i);
-        }
-        if(write(file, message, msg->length()) < 0) {
-            close(file);
-            return -1;
-        }
+    message += *msg;
+    if(dev_link->send(message.data(), message.length()).get() < 0) {
+        return -1;
     }
-
-    close(file);
     return 0;
 }
 
@@ -120,22 +98,27 @@ int main(int argc, char *argv[]) {
     }
 
     //Registering signals
-    signal(SIGDATARECV, signal_handler);
     signal(SIGINT, signal_handler);
 
-    int file = open(dev_file, O_RDWR);
-    if (file < 0) {
-        std::cout << "Could't open file " << std::endl;
-    }
-
-    //Registering the process to the driver
-    pid_t pid = getpid();
-    std::cout << "Process ID is " << pid << std::endl;
-    if(ioctl(file, USER_APP_REG, (int*) &pid)) {
+    //Opening the link registers to the driver, the loop thread waits for messages instead of a signal
+    loop = new GpioLinkLoop();
+    GpioLinkOptions options;
+    options.device = dev_file;
+    dev_link = loop->open(options, [](GpioLink &link, int address, const uint8_t *message, size_t length) {
+        handle_message(std::string((const char *) message, length));
+    });
+    if (dev_link == NULL) {
         std::cout << "Couldn't register to driver" << std::endl;
-        close(file);
         exit(EXIT_FAILURE);
-    };
+    }
+    options.start_link = false;
+    options.tx_class = GPIO_LINK_CLASS_REPLY;
+    reply_link = loop->open(options, NULL);
+    if (reply_link == NULL) {
+        std::cout << "Couldn't open the reply file" << std::endl;
+        delete loop;
+        exit(EXIT_FAILURE);
+    }
 
     //Terminal interface to send and print messages
     //Not beautiful but works well
@@ -0,0 +1,741 @@
+//User space backend of the link (see user_link.h). The HAL of protocol.c is implemented with libgpiod v2: the line is
+//switched between input and output low like the module does with gpio_direction_input/output, edges come from the
+//edge events of the line request and timed edges sleep with clock_nanosleep and spin the last few microseconds.
+//The protocol thread is the only one that touches the line, apps only use the rings, like with the module
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <gpiod.h>
+#include "user_link.h"
+
+//Configurations of the line, switching between them is a request to the kernel (and switching edge detection on and
+//off also takes the interrupt of the line), so edge detection is only turned on when the protocol waits for an edge
+#define LINE_INPUT 0
+#define LINE_INPUT_EDGE 1
+#define LINE_OUTPUT_LOW 2
+#define NUM_LINE_STATES 3
+
+#define EDGE_EVENT_BUFFER 16
+
+struct UserLink {
+    struct Link link;
+    struct UserLinkOptions options;
+
+    struct gpiod_chip *chip;
+    struct gpiod_line_request *request;
+    struct gpiod_line_config *line_configs[NUM_LINE_STATES];
+    struct gpiod_edge_event_buffer *events;
+    int line_state;
+
+    pthread_t thread;
+    int stop;
+    //Wakes the protocol thread up from its waits: new messages to send, room in the receive ring, closing the link,
+    //and falling edges of a software wire
+    int wake_fd;
+    //Tells the app something happened (see user_link_fd)
+    int notify_fd;
+
+    //Readers and writers are serialized among themselves, so every ring has a single producer and a single consumer
+    pthread_mutex_t read_mutex;
+    pthread_mutex_t write_mutex;
+    int bus_dest;
+    //Set when a message is given up, reported by the next write
+    int tx_error;
+    unsigned int rx_dropped;
+
+    //Software wire (wire_group), same handshake as the interrupt handler of the module
+    int wire_driving;
+    int edge_armed;
+    int edge_seen;
+    u64 edge_timestamp;
+    struct UserLink *wire_next;
+
+    //cleanup helper variables
+    int mutexes_initialized;
+    int thread_started;
+};
+
+//How many links pull each software wire low, and the links on it
+static int wire_low[USER_LINK_MAX_WIRES + 1];
+static struct UserLink *wire_links[USER_LINK_MAX_WIRES + 1];
+static pthread_mutex_t wire_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct UserLink *link_user(struct Link *link) {
+    return (struct UserLink *) link->hal_data;
+}
+
+static u64 monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void eventfd_signal(int fd) {
+    uint64_t one = 1;
+    if(write(fd, &one, sizeof(one)) < 0) {
+        //Only fails if the counter is about to overflow, then it is readable anyway
+    }
+}
+
+static void eventfd_drain(int fd) {
+    uint64_t count;
+    if(read(fd, &count, sizeof(count)) < 0) {
+        //Nothing was there
+    }
+}
+
+static unsigned int roundup_pow_of_two(unsigned int n) {
+    unsigned int depth = 1;
+    while(depth < n) {
+        depth <<= 1;
+    }
+    return depth;
+}
+
+static int ring_init(struct DataRing *ring, unsigned int depth) {
+    depth = roundup_pow_of_two(depth);
+    ring->own_head = 0;
+    ring->own_tail = 0;
+    ring->head = &ring->own_head;
+    ring->tail = &ring->own_tail;
+    ring->mask = depth - 1;
+    ring->slots = (struct Data *) calloc(depth, sizeof(struct Data));
+    if(ring->slots == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+//Sleeps until the wake eventfd is signaled or until deadline (0 means no deadline)
+static void wait_for_wake(struct UserLink *line, u64 deadline) {
+    struct pollfd fd = {line->wake_fd, POLLIN, 0};
+    struct timespec timeout;
+    u64 now = monotonic_ns();
+    if((deadline != 0) && (deadline <= now)) {
+        return;
+    }
+    timeout.tv_sec = (deadline - now) / 1000000000ULL;
+    timeout.tv_nsec = (deadline - now) % 1000000000ULL;
+    if(ppoll(&fd, 1, (deadline == 0) ? NULL : &timeout, NULL) > 0) {
+        eventfd_drain(line->wake_fd);
+    }
+}
+
+//--------------------Line--------------------
+
+static int set_line_state(struct UserLink *line, int state) {
+    if(line->line_state == state) {
+        return 0;
+    }
+    if(gpiod_line_request_reconfigure_lines(line->request, line->line_configs[state]) < 0) {
+        LINK_WARN("%s: reconfiguring the line failed\n", line->link.name);
+        return -1;
+    }
+    line->line_state = state;
+    return 0;
+}
+
+static struct gpiod_line_config *make_line_config(unsigned int offset, int state) {
+    struct gpiod_line_settings *settings = gpiod_line_settings_new();
+    struct gpiod_line_config *config = gpiod_line_config_new();
+    if((settings == NULL) || (config == NULL)) {
+        gpiod_line_settings_free(settings);
+        gpiod_line_config_free(config);
+        return NULL;
+    }
+    if(state == LINE_OUTPUT_LOW) {
+        gpiod_line_settings_set_direction(settings, GPIOD_LINE_DIRECTION_OUTPUT);
+        gpiod_line_settings_set_output_value(settings, GPIOD_LINE_VALUE_INACTIVE);
+    }
+    else {
+        gpiod_line_settings_set_direction(settings, GPIOD_LINE_DIRECTION_INPUT);
+    }
+    if(state == LINE_INPUT_EDGE) {
+        //Time stamps of the same clock as hal_now()
+        gpiod_line_settings_set_edge_detection(settings, GPIOD_LINE_EDGE_FALLING);
+        gpiod_line_settings_set_event_clock(settings, GPIOD_LINE_CLOCK_MONOTONIC);
+    }
+    if(gpiod_line_config_add_line_settings(config, &offset, 1, settings) < 0) {
+        gpiod_line_config_free(config);
+        config = NULL;
+    }
+    gpiod_line_settings_free(settings);
+    return config;
+}
+
+static int request_line(struct UserLink *line) {
+    struct gpiod_request_config *request_config;
+    const char *chip = line->options.chip;
+    char path[64];
+    int i;
+    //libgpiod v2 only opens paths
+    if(strchr(chip, '/') == NULL) {
+        snprintf(path, sizeof(path), "/dev/%s", chip);
+        chip = path;
+    }
+    for(i = 0; i < NUM_LINE_STATES; i += 1) {
+        line->line_configs[i] = make_line_config(line->options.offset, i);
+        if(line->line_configs[i] == NULL) {
+            return -1;
+        }
+    }
+    line->events = gpiod_edge_event_buffer_new(EDGE_EVENT_BUFFER);
+    line->chip = gpiod_chip_open(chip);
+    request_config = gpiod_request_config_new();
+    if((line->events == NULL) || (line->chip == NULL) || (request_config == NULL)) {
+        gpiod_request_config_free(request_config);
+        return -1;
+    }
+    gpiod_request_config_set_consumer(request_config, line->link.name);
+    gpiod_request_config_set_event_buffer_size(request_config, EDGE_EVENT_BUFFER);
+    line->request = gpiod_chip_request_lines(line->chip, request_config, line->line_configs[LINE_INPUT]);
+    gpiod_request_config_free(request_config);
+    if(line->request == NULL) {
+        return -1;
+    }
+    line->line_state = LINE_INPUT;
+    return 0;
+}
+
+//Drops the edge events that are already waiting, returns the time stamp of the first one or 0 if there were none
+static u64 read_edge_events(struct UserLink *line) {
+    struct pollfd fd = {gpiod_line_request_get_fd(line->request), POLLIN, 0};
+    u64 first = 0;
+    int n;
+    while(poll(&fd, 1, 0) > 0) {
+        n = gpiod_line_request_read_edge_events(line->request, line->events, EDGE_EVENT_BUFFER);
+        if(n <= 0) {
+            break;
+        }
+        if(first == 0) {
+            first = gpiod_edge_event_get_timestamp_ns(gpiod_edge_event_buffer_get_event(line->events, 0));
+        }
+    }
+    return first;
+}
+
+//Falling edge of a software wire, the protocol thread of the link gets it if it is waiting for one
+static void wire_edge(struct UserLink *line, u64 now) {
+    if(__atomic_load_n(&line->edge_armed, __ATOMIC_SEQ_CST)) {
+        line->edge_timestamp = now;
+        __atomic_store_n(&line->edge_armed, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&line->edge_seen, 1, __ATOMIC_RELEASE);
+        eventfd_signal(line->wake_fd);
+    }
+}
+
+static int wire_wait_for_edge(struct UserLink *line, u64 timeout_ns) {
+    struct Link *link = &line->link;
+    u64 deadline = (timeout_ns == 0) ? 0 : monotonic_ns() + timeout_ns;
+    //Edge detection of the line is turned on like without the wire, it just never sees anything
+    if(set_line_state(line, LINE_INPUT_EDGE) < 0) {
+        return -1;
+    }
+    __atomic_store_n(&line->edge_seen, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&line->edge_armed, 1, __ATOMIC_SEQ_CST);
+    //The wire might have gone low before the edge was armed
+    if((hal_line_read(link) == 0) && (!__atomic_load_n(&line->edge_seen, __ATOMIC_SEQ_CST))) {
+        __atomic_store_n(&line->edge_armed, 0, __ATOMIC_RELAXED);
+        link->timer = monotonic_ns();
+        return 0;
+    }
+    while((!__atomic_load_n(&line->edge_seen, __ATOMIC_ACQUIRE)) && (!hal_should_stop(link)) &&
+          ((deadline == 0) || (monotonic_ns() < deadline))) {
+        wait_for_wake(line, deadline);
+    }
+    __atomic_store_n(&line->edge_armed, 0, __ATOMIC_SEQ_CST);
+    if(!__atomic_load_n(&line->edge_seen, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+    link->timer = line->edge_timestamp;
+    return 0;
+}
+
+//Lines on a software wire pull it low by counting themselves in wire_low, the one that brings it from released to
+//low gives every other link on it the edge, like the module does with wire_groups
+static void wire_pull(struct UserLink *line) {
+    struct UserLink *other;
+    int group = line->options.wire_group;
+    if(line->wire_driving) {
+        return;
+    }
+    line->wire_driving = 1;
+    if(__atomic_add_fetch(&wire_low[group], 1, __ATOMIC_SEQ_CST) == 1) {
+        u64 now = monotonic_ns();
+        pthread_mutex_lock(&wire_lock);
+        for(other = wire_links[group]; other != NULL; other = other->wire_next) {
+            if(other != line) {
+                wire_edge(other, now);
+            }
+        }
+        pthread_mutex_unlock(&wire_lock);
+    }
+}
+
+static void wire_release(struct UserLink *line) {
+    if(line->wire_driving) {
+        line->wire_driving = 0;
+        __atomic_sub_fetch(&wire_low[line->options.wire_group], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+//--------------------HAL--------------------
+//What protocol.c needs from the line, see protocol.h. On a software wire the line is still switched and read through
+//libgpiod, so the GPIO calls cost the same, but the level is the one of the wire
+
+void hal_line_low(struct Link *link) {
+    struct UserLink *line = link_user(link);
+    set_line_state(line, LINE_OUTPUT_LOW);
+    if(line->options.wire_group != 0) {
+        wire_pull(line);
+    }
+}
+
+void hal_line_release(struct Link *link) {
+    struct UserLink *line = link_user(link);
+    if(line->line_state == LINE_OUTPUT_LOW) {
+        set_line_state(line, LINE_INPUT);
+    }
+    if(line->options.wire_group != 0) {
+        wire_release(line);
+    }
+}
+
+int hal_line_read(struct Link *link) {
+    struct UserLink *line = link_user(link);
+    int level = gpiod_line_request_get_value(line->request, line->options.offset) == GPIOD_LINE_VALUE_ACTIVE;
+    if(line->options.wire_group != 0) {
+        return __atomic_load_n(&wire_low[line->options.wire_group], __ATOMIC_SEQ_CST) == 0;
+    }
+    return level;
+}
+
+u64 hal_now(struct Link *link) {
+    return monotonic_ns();
+}
+
+//Sleeps with clock_nanosleep until shortly before the deadline, then busy waits the rest, same as the module.
+//Returns how late it is when the wait ends
+u64 hal_wait_until(struct Link *link, u64 deadline) {
+    u64 spin_window = (u64) link_user(link)->options.spin_window_us * NSEC_PER_USEC;
+    struct timespec wakeup;
+    u64 now;
+
+    if(deadline > monotonic_ns() + spin_window) {
+        wakeup.tv_sec = (deadline - spin_window) / 1000000000ULL;
+        wakeup.tv_nsec = (deadline - spin_window) % 1000000000ULL;
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wakeup, NULL) == EINTR) {}
+    }
+    while(deadline > (now = monotonic_ns())) {}
+    return now - deadline;
+}
+
+//Waits for the edge event of the line (or the wake eventfd, when the link is closed)
+int hal_wait_for_edge(struct Link *link, u64 timeout_ns) {
+    struct UserLink *line = link_user(link);
+    struct pollfd fds[2];
+    struct timespec timeout;
+    u64 deadline = (timeout_ns == 0) ? 0 : monotonic_ns() + timeout_ns;
+    u64 now;
+    u64 edge;
+
+    if(line->options.wire_group != 0) {
+        return wire_wait_for_edge(line, timeout_ns);
+    }
+    if(set_line_state(line, LINE_INPUT_EDGE) < 0) {
+        return -1;
+    }
+    //Edges from before are old news, and the line might already be low
+    read_edge_events(line);
+    if(hal_line_read(link) == 0) {
+        link->timer = monotonic_ns();
+        return 0;
+    }
+    fds[0].fd = gpiod_line_request_get_fd(line->request);
+    fds[0].events = POLLIN;
+    fds[1].fd = line->wake_fd;
+    fds[1].events = POLLIN;
+    while(!hal_should_stop(link)) {
+        now = monotonic_ns();
+        if((deadline != 0) && (now >= deadline)) {
+            break;
+        }
+        timeout.tv_sec = (deadline - now) / 1000000000ULL;
+        timeout.tv_nsec = (deadline - now) % 1000000000ULL;
+        if(ppoll(fds, 2, (deadline == 0) ? NULL : &timeout, NULL) <= 0) {
+            continue;
+        }
+        if(fds[1].revents & POLLIN) {
+            eventfd_drain(line->wake_fd);
+        }
+        if(fds[0].revents & POLLIN) {
+            edge = read_edge_events(line);
+            if(edge != 0) {
+                link->timer = edge;
+                return 0;
+            }
+        }
+    }
+    return -1;
+}
+
+void hal_wait_for_tx(struct Link *link, u64 ns) {
+    if(link_tx_pending(link) == 0) {
+        wait_for_wake(link_user(link), monotonic_ns() + ns);
+    }
+}
+
+//user_link_read wakes this up
+void hal_wait_for_rx_space(struct Link *link, u64 ns) {
+    if(data_ring_claim(&link->rx_ring) == NULL) {
+        wait_for_wake(link_user(link), monotonic_ns() + ns);
+    }
+}
+
+int hal_should_stop(struct Link *link) {
+    return __atomic_load_n(&link_user(link)->stop, __ATOMIC_ACQUIRE);
+}
+
+//Only drops when a reader isn't in the middle of reading
+int hal_rx_drop_oldest(struct Link *link) {
+    struct UserLink *line = link_user(link);
+    if(pthread_mutex_trylock(&line->read_mutex) != 0) {
+        return -1;
+    }
+    if(data_ring_peek(&link->rx_ring) != NULL) {
+        data_ring_commit(&link->rx_ring);
+        line->rx_dropped += 1;
+    }
+    pthread_mutex_unlock(&line->read_mutex);
+    return 0;
+}
+
+void hal_message_received(struct Link *link) {
+    eventfd_signal(link_user(link)->notify_fd);
+}
+
+void hal_message_sent(struct Link *link) {
+    eventfd_signal(link_user(link)->notify_fd);
+}
+
+void hal_message_failed(struct Link *link) {
+    __atomic_store_n(&link_user(link)->tx_error, 1, __ATOMIC_RELEASE);
+    eventfd_signal(link_user(link)->notify_fd);
+}
+
+//--------------------Thread--------------------
+
+static void *protocol_thread(void *p) {
+    struct UserLink *line = (struct UserLink *) p;
+    if(line->link.role == 0) {
+        link_master_loop(&line->link);
+    }
+    else {
+        link_slave_loop(&line->link);
+    }
+    return NULL;
+}
+
+//SCHED_FIFO keeps everything but interrupts and higher priority threads off the CPU while the thread is timing the
+//line. Without the rights for it (CAP_SYS_NICE or an rtprio limit) the thread runs as a normal one
+static int start_thread(struct UserLink *line) {
+    pthread_attr_t attr;
+    struct sched_param param;
+    cpu_set_t cpus;
+    int result;
+
+    pthread_attr_init(&attr);
+    if(line->options.cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(line->options.cpu, &cpus);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+    if(line->options.priority > 0) {
+        param.sched_priority = line->options.priority;
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        pthread_attr_setschedparam(&attr, &param);
+    }
+    result = pthread_create(&line->thread, &attr, protocol_thread, line);
+    if((result == EPERM) && (line->options.priority > 0)) {
+        LINK_WARN("%s: no permission for SCHED_FIFO, the protocol thread runs as a normal thread\n", line->link.name);
+        pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+        result = pthread_create(&line->thread, &attr, protocol_thread, line);
+    }
+    pthread_attr_destroy(&attr);
+    if(result != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+//--------------------API--------------------
+
+void user_link_default_options(struct UserLinkOptions *options) {
+    memset(options, 0, sizeof(*options));
+    options->chip = "/dev/gpiochip0";
+    options->cpu = -1;
+    options->priority = 80;
+    options->spin_window_us = 5;
+    options->tx_queue_depth = 256;
+    options->rx_queue_depth = 64;
+    options->class_queue_depth = 16;
+}
+
+struct UserLink *user_link_open(const struct UserLinkOptions *options, const struct LinkConfig *config) {
+    static pthread_once_t codecs_once = PTHREAD_ONCE_INIT;
+    static int next_index = 0;
+    struct UserLink *line;
+    int i;
+
+    if((options->role != 0) && (options->role != 1)) {
+        LINK_WARN("Invalid comm role\n");
+        return NULL;
+    }
+    if((options->timing_profile < 0) || (options->timing_profile >= NUM_TIMING_PROFILES) ||
+       (options->wire_group < 0) || (options->wire_group > USER_LINK_MAX_WIRES) ||
+       (options->tx_queue_depth < 1) || (options->rx_queue_depth < 1) || (options->class_queue_depth < 1) ||
+       (options->spin_window_us < 0)) {
+        LINK_WARN("Invalid link options\n");
+        return NULL;
+    }
+    if(config->tx_scheduler == TX_SCHEDULER_WEIGHTED) {
+        for(i = 0; i < NUM_TX_CLASSES; i += 1) {
+            if(config->tx_weights[i] < 1) {
+                LINK_WARN("The weighted scheduler needs a weight of at least 1 for every class\n");
+                return NULL;
+            }
+        }
+    }
+    pthread_once(&codecs_once, protocol_init);
+
+    line = (struct UserLink *) calloc(1, sizeof(struct UserLink));
+    if(line == NULL) {
+        return NULL;
+    }
+    line->options = *options;
+    line->wake_fd = -1;
+    line->notify_fd = -1;
+    line->link.hal_data = line;
+    line->link.index = __atomic_fetch_add(&next_index, 1, __ATOMIC_RELAXED);
+    line->link.role = options->role;
+    line->link.bus_address = (config->bus_mode && (options->role == 1)) ? options->bus_address : 0;
+    line->link.timing_profile = options->timing_profile;
+    snprintf(line->link.name, sizeof(line->link.name), "%s%d", (options->role == 0) ? "gpio_master" : "gpio_slave",
+             line->link.index);
+
+    pthread_mutex_init(&line->read_mutex, NULL);
+    pthread_mutex_init(&line->write_mutex, NULL);
+    line->mutexes_initialized = 1;
+    line->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    line->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if((line->wake_fd < 0) || (line->notify_fd < 0)) {
+        user_link_close(line);
+        return NULL;
+    }
+    for(i = 0; i < NUM_TX_CLASSES; i += 1) {
+        if(ring_init(&line->link.tx_rings[i],
+                     (i == TX_CLASS_NORMAL) ? options->tx_queue_depth : options->class_queue_depth) < 0) {
+            LINK_WARN("Allocating the message queues failed\n");
+            user_link_close(line);
+            return NULL;
+        }
+    }
+    if(ring_init(&line->link.rx_ring, options->rx_queue_depth) < 0) {
+        LINK_WARN("Allocating the message queues failed\n");
+        user_link_close(line);
+        return NULL;
+    }
+    if(request_line(line) < 0) {
+        LINK_WARN("%s: couldn't request line %u of %s\n", line->link.name, options->offset, options->chip);
+        user_link_close(line);
+        return NULL;
+    }
+    link_init(&line->link, config);
+
+    if(options->wire_group != 0) {
+        pthread_mutex_lock(&wire_lock);
+        line->wire_next = wire_links[options->wire_group];
+        wire_links[options->wire_group] = line;
+        pthread_mutex_unlock(&wire_lock);
+    }
+    //Page faults in the middle of a bit would be as bad as being preempted
+    if(options->lock_memory && (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)) {
+        LINK_WARN("%s: couldn't lock the memory of the process\n", line->link.name);
+    }
+    if(start_thread(line) < 0) {
+        LINK_WARN("%s: couldn't start the protocol thread\n", line->link.name);
+        user_link_close(line);
+        return NULL;
+    }
+    line->thread_started = 1;
+    return line;
+}
+
+void user_link_close(struct UserLink *line) {
+    struct UserLink **entry;
+    int i;
+    if(line == NULL) {
+        return;
+    }
+    if(line->thread_started) {
+        __atomic_store_n(&line->stop, 1, __ATOMIC_RELEASE);
+        eventfd_signal(line->wake_fd);
+        pthread_join(line->thread, NULL);
+    }
+    if(line->options.wire_group != 0) {
+        pthread_mutex_lock(&wire_lock);
+        for(entry = &wire_links[line->options.wire_group]; *entry != NULL; entry = &(*entry)->wire_next) {
+            if(*entry == line) {
+                *entry = line->wire_next;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&wire_lock);
+        hal_line_release(&line->link);
+    }
+    if(line->request != NULL) {
+        gpiod_line_request_release(line->request);
+    }
+    if(line->chip != NULL) {
+        gpiod_chip_close(line->chip);
+    }
+    gpiod_edge_event_buffer_free(line->events);
+    for(i = 0; i < NUM_LINE_STATES; i += 1) {
+        gpiod_line_config_free(line->line_configs[i]);
+    }
+    for(i = 0; i < NUM_TX_CLASSES; i += 1) {
+        free(line->link.tx_rings[i].slots);
+    }
+    free(line->link.rx_ring.slots);
+    if(line->wake_fd >= 0) {
+        close(line->wake_fd);
+    }
+    if(line->notify_fd >= 0) {
+        close(line->notify_fd);
+    }
+    if(line->mutexes_initialized) {
+        pthread_mutex_destroy(&line->read_mutex);
+        pthread_mutex_destroy(&line->write_mutex);
+    }
+    free(line);
+}
+
+ssize_t user_link_write(struct UserLink *line, const void *buff, size_t count) {
+    return user_link_write_class(line, buff, count, TX_CLASS_NORMAL, 0);
+}
+
+ssize_t user_link_write_class(struct UserLink *line, const void *buff, size_t count, int tx_class,
+                              unsigned int deadline_us) {
+    struct DataRing *ring;
+    struct Data *slot;
+
+    if(__atomic_exchange_n(&line->tx_error, 0, __ATOMIC_ACQ_REL)) {
+        errno = EIO;
+        return -1;
+    }
+    if((count > MAX_MESSAGE_LENGTH) || ((count > MAX_PAYLOAD_LENGTH) && (line->link.config->frame_mode == 0)) ||
+       (link_is_bus_master(&line->link) && (line->bus_dest == 0)) || (tx_class < 0) ||
+       (tx_class >= NUM_TX_CLASSES)) {
+        errno = EINVAL;
+        return -1;
+    }
+    ring = &line->link.tx_rings[tx_class];
+    pthread_mutex_lock(&line->write_mutex);
+    slot = data_ring_claim(ring);
+    if(slot == NULL) {
+        line->link.stats.tx_queue_full += 1;
+        pthread_mutex_unlock(&line->write_mutex);
+        errno = EAGAIN;
+        return -1;
+    }
+    memcpy(slot->buffer, buff, count);
+    slot->address = (uint8_t) line->bus_dest;
+    slot->length = count;
+    slot->deadline = (deadline_us > 0) ? (hal_now(&line->link) + (u64) deadline_us * 1000) : 0;
+    data_ring_publish(ring);
+    pthread_mutex_unlock(&line->write_mutex);
+    //The master may be waiting for the next poll
+    eventfd_signal(line->wake_fd);
+    return count;
+}
+
+ssize_t user_link_read(struct UserLink *line, void *buff, size_t count, int nonblock) {
+    struct Data *slot;
+    uint8_t *out = (uint8_t *) buff;
+    int prefix = link_is_bus_master(&line->link) ? 3 : 2;
+    struct pollfd fd = {line->notify_fd, POLLIN, 0};
+    size_t total = 0;
+
+    pthread_mutex_lock(&line->read_mutex);
+    slot = data_ring_peek(&line->link.rx_ring);
+    //Without nonblock the read sleeps until a message arrives
+    while(slot == NULL) {
+        pthread_mutex_unlock(&line->read_mutex);
+        if(nonblock) {
+            errno = EAGAIN;
+            return -1;
+        }
+        if(poll(&fd, 1, -1) > 0) {
+            eventfd_drain(line->notify_fd);
+        }
+        pthread_mutex_lock(&line->read_mutex);
+        slot = data_ring_peek(&line->link.rx_ring);
+    }
+    if(count < slot->length + (size_t) prefix) {
+        pthread_mutex_unlock(&line->read_mutex);
+        errno = EINVAL;
+        return -1;
+    }
+    while((slot != NULL) && (total + slot->length + prefix <= count)) {
+        out[total] = (uint8_t) (slot->length & 0xFF);
+        out[total + 1] = (uint8_t) (slot->length >> 8);
+        if(prefix == 3) {
+            out[total + 2] = slot->address;
+        }
+        memcpy(out + total + prefix, slot->buffer, slot->length);
+        total += slot->length + prefix;
+        data_ring_commit(&line->link.rx_ring);
+        slot = data_ring_peek(&line->link.rx_ring);
+    }
+    pthread_mutex_unlock(&line->read_mutex);
+    //The protocol thread may be waiting for room
+    eventfd_signal(line->wake_fd);
+    return total;
+}
+
+int user_link_set_dest(struct UserLink *line, int address) {
+    if((!link_is_bus_master(&line->link)) || (address < 1) || (address >= BUS_ADDRESSES)) {
+        errno = EINVAL;
+        return -1;
+    }
+    //Messages that are already queued keep the address they were written with
+    pthread_mutex_lock(&line->write_mutex);
+    line->bus_dest = address;
+    pthread_mutex_unlock(&line->write_mutex);
+    return 0;
+}
+
+int user_link_fd(struct UserLink *line) {
+    return line->notify_fd;
+}
+
+unsigned int user_link_tx_errors(struct UserLink *line) {
+    __atomic_store_n(&line->tx_error, 0, __ATOMIC_RELEASE);
+    return __atomic_load_n(&line->link.tx_failed, __ATOMIC_RELAXED);
+}
+
+const struct LinkStats *user_link_stats(struct UserLink *line) {
+    return &line->link.stats;
+}
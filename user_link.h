@@ -0,0 +1,84 @@
+//User space backend of the link: protocol.c runs on a thread of the app and drives the line through the GPIO
+//character device (/dev/gpiochipN, libgpiod v2), for machines that can't load the module. It is wire compatible
+//with the module, and messages go in and out the same way they do through /dev/gpio_master and /dev/gpio_slave
+#ifndef USER_LINK_H
+#define USER_LINK_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "protocol.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//Lines that share a software wire (see wire_group) can have numbers from 1 to this
+#define USER_LINK_MAX_WIRES 16
+
+//Where the line is and how its thread runs, the protocol options are in struct LinkConfig like for the module
+struct UserLinkOptions {
+    //GPIO chip ("/dev/gpiochip0", a name without a path like "gpiochip0" is looked up in /dev) and the offset of
+    //the line on it
+    const char *chip;
+    unsigned int offset;
+    //master == 0, slave == 1
+    int role;
+    int timing_profile;
+    //Slave address on a multi-drop bus (bus_mode), 0 on point to point links
+    int bus_address;
+    //CPU the protocol thread is bound to (an isolated one, see isolcpus), -1 leaves it to the scheduler
+    int cpu;
+    //SCHED_FIFO priority of the protocol thread (1-99), 0 runs it as a normal thread
+    int priority;
+    //Like the module parameter, timed edges sleep until this many microseconds before the deadline and spin the rest
+    int spin_window_us;
+    //tx_queue_depth is the send ring of the normal class, class_queue_depth the ones of the other classes
+    int tx_queue_depth;
+    int rx_queue_depth;
+    int class_queue_depth;
+    //For testing without jumper wires: links of this process with the same nonzero number share an open drain wire
+    //in memory instead of their lines, like the wire_groups parameter of the module. The line is still requested
+    //and switched through libgpiod like any other, only its level and its edges come from the wire
+    int wire_group;
+    //Locks all memory of the process (mlockall) when the link is opened, so page faults can't stall the protocol
+    //thread in the middle of a bit. That affects the whole process, so it is off unless the app asks for it
+    int lock_memory;
+};
+
+struct UserLink;
+
+//Fills in the defaults: no CPU binding, SCHED_FIFO priority 80, 5us spin window, the queue depths of the module
+//and no memory locking
+void user_link_default_options(struct UserLinkOptions *options);
+//Requests the line and starts the protocol thread. config has to stay valid until the link is closed.
+//Returns NULL if the line can't be used
+struct UserLink *user_link_open(const struct UserLinkOptions *options, const struct LinkConfig *config);
+//Stops the protocol thread and releases the line, messages that weren't sent are dropped
+void user_link_close(struct UserLink *link);
+
+//Same as write() on the device file: queues one message and returns count, or -1 with errno set to EAGAIN if the
+//send ring is full, EINVAL if the message is too long, or EIO once after a message was given up
+ssize_t user_link_write(struct UserLink *link, const void *buff, size_t count);
+//Same, but the message goes to the send ring of tx_class (TX_CLASS_URGENT to TX_CLASS_BULK) and is dropped if it
+//isn't sent within deadline_us microseconds (0 == never), like GPIO_SET_TX_CLASS on the device file
+ssize_t user_link_write_class(struct UserLink *link, const void *buff, size_t count, int tx_class,
+                              unsigned int deadline_us);
+//Same as read() on the device file: every message is its length (two bytes, little endian), on a bus master the
+//address of the slave, then the message. Returns as many whole messages as fit in count, or -1 with errno set to
+//EAGAIN if nonblock is set and nothing is there, or EINVAL if the first message doesn't fit
+ssize_t user_link_read(struct UserLink *link, void *buff, size_t count, int nonblock);
+//Slave address the next writes go to on a bus master, like GPIO_SET_DEST
+int user_link_set_dest(struct UserLink *link, int address);
+//eventfd that becomes readable when a message arrives, a message leaves the send ring or one is given up, so the
+//link can be polled along with other files. Reading it is up to the app, don't mix it with blocking reads
+int user_link_fd(struct UserLink *link);
+//Messages given up since the link was opened, like GPIO_GET_TX_ERRORS
+unsigned int user_link_tx_errors(struct UserLink *link);
+//Counters of the statistics file of the module, they can be a little out of date
+const struct LinkStats *user_link_stats(struct UserLink *link);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,209 @@
+//Tests of the user space backend (user_link.c) on the lines of gpio-sim, through libgpiod and the GPIO character
+//device. gpio-sim can't connect two lines, but every line has a pull that stands in for the other end of the wire
+//(/sys/bus/gpio/devices/gpiochipN/sim_gpioM/pull), so a lone link can be checked against it:
+//  master_alone   the master drives its resets through libgpiod and sees that nobody answers
+//  slave_resets   resets made with the pull come in as edge events and the slave answers every one of them
+//  wire_messages  both ends on a software wire (wire_group) with their lines still switched through libgpiod
+//Needs root and gpio-sim:
+//  make test-user
+//  sudo ./user_link_test --chip `sudo ./gpio_sim_setup.sh chip`
+#include <iostream>
+#include <string>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "user_link.h"
+
+#define SLAVE_RESETS 5
+
+static std::string chip;
+
+static void sleep_us(long us) {
+    struct timespec ts;
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = (us % 1000000) * 1000;
+    while(nanosleep(&ts, &ts) != 0) {}
+}
+
+//Sets the pull of a gpio-sim line, which is the level it reads while nothing drives it
+static int set_pull(unsigned int offset, const char *pull) {
+    std::string name = chip.substr(chip.find_last_of('/') + 1);
+    std::string path = "/sys/bus/gpio/devices/" + name + "/sim_gpio" + std::to_string(offset) + "/pull";
+    FILE *file = fopen(path.c_str(), "w");
+    int result;
+    if(file == NULL) {
+        std::cout << "Couldn't open " << path << " (is " << chip << " a gpio-sim chip?)" << std::endl;
+        return -1;
+    }
+    result = (fputs(pull, file) < 0) ? -1 : 0;
+    if(fclose(file) != 0) {
+        result = -1;
+    }
+    return result;
+}
+
+//Same defaults as the module
+static void default_config(struct LinkConfig *c) {
+    memset(c, 0, sizeof(*c));
+    c->max_retries = 2;
+    c->retry_backoff_us = 250;
+    c->idle_poll_min_us = 200;
+    c->idle_poll_max_us = 10000;
+    c->idle_poll_backoff = 2;
+    c->tx_weights[TX_CLASS_URGENT] = 8;
+    c->tx_weights[TX_CLASS_REPLY] = 4;
+    c->tx_weights[TX_CLASS_NORMAL] = 2;
+    c->tx_weights[TX_CLASS_BULK] = 1;
+}
+
+static struct UserLink *open_link(const struct LinkConfig *config, unsigned int offset, int role, int wire_group) {
+    struct UserLinkOptions options;
+    user_link_default_options(&options);
+    options.chip = chip.c_str();
+    options.offset = offset;
+    options.role = role;
+    options.wire_group = wire_group;
+    //Without the rights for SCHED_FIFO the links run as normal threads, the tests don't need tight timing
+    options.priority = 0;
+    return user_link_open(&options, config);
+}
+
+//A master without a slave keeps resetting the line and never sees a presence pulse
+static int test_master_alone() {
+    struct LinkConfig config;
+    struct UserLink *master;
+    struct LinkStats stats;
+    default_config(&config);
+    if(set_pull(0, "pull-up") < 0) {
+        return -1;
+    }
+    master = open_link(&config, 0, 0, 0);
+    if(master == NULL) {
+        return -1;
+    }
+    sleep_us(300000);
+    stats = *user_link_stats(master);
+    user_link_close(master);
+    printf("master_alone: resets %llu no_presence %llu\n", (unsigned long long) stats.resets,
+           (unsigned long long) stats.no_presence);
+    //The last reset may still be going on when the counters are read
+    if((stats.resets < 2) || (stats.no_presence + 1 < stats.resets)) {
+        return -1;
+    }
+    return 0;
+}
+
+//The pull plays the master: low long enough to be a reset without a message, then back up well before the slave is
+//done answering (its presence pulse drives the line through libgpiod meanwhile)
+static int test_slave_resets() {
+    struct LinkConfig config;
+    struct UserLink *slave;
+    struct LinkStats stats;
+    int i;
+    default_config(&config);
+    if(set_pull(1, "pull-up") < 0) {
+        return -1;
+    }
+    slave = open_link(&config, 1, 1, 0);
+    if(slave == NULL) {
+        return -1;
+    }
+    sleep_us(50000);
+    for(i = 0; i < SLAVE_RESETS; i += 1) {
+        if(set_pull(1, "pull-down") < 0) {
+            user_link_close(slave);
+            return -1;
+        }
+        sleep_us(450);
+        set_pull(1, "pull-up");
+        sleep_us(20000);
+    }
+    stats = *user_link_stats(slave);
+    user_link_close(slave);
+    printf("slave_resets: %d resets made, %llu answered\n", SLAVE_RESETS, (unsigned long long) stats.resets);
+    if(stats.resets < SLAVE_RESETS) {
+        return -1;
+    }
+    return 0;
+}
+
+//Messages from the master to the slave over a software wire, every edge and level change still goes through libgpiod
+static int test_wire_messages() {
+    struct LinkConfig config;
+    struct UserLink *master;
+    struct UserLink *slave;
+    uint8_t buffer[256];
+    char message[16];
+    int sent = 0;
+    int received = 0;
+    int corrupted = 0;
+    int i;
+    default_config(&config);
+    master = open_link(&config, 0, 0, 1);
+    slave = open_link(&config, 1, 1, 1);
+    if((master == NULL) || (slave == NULL)) {
+        user_link_close(master);
+        user_link_close(slave);
+        return -1;
+    }
+    for(i = 0; i < 10; i += 1) {
+        snprintf(message, sizeof(message), "msg %04d", i);
+        if(user_link_write(master, message, strlen(message)) == (ssize_t) strlen(message)) {
+            sent += 1;
+        }
+    }
+    for(i = 0; (i < 200) && (received < sent); i += 1) {
+        ssize_t length = user_link_read(slave, buffer, sizeof(buffer), 1);
+        ssize_t pos = 0;
+        while(pos + 2 <= length) {
+            int message_length = buffer[pos] | (buffer[pos + 1] << 8);
+            snprintf(message, sizeof(message), "msg %04d", received);
+            if((message_length != (int) strlen(message)) || (memcmp(&buffer[pos + 2], message, message_length) != 0)) {
+                corrupted += 1;
+            }
+            received += 1;
+            pos += 2 + message_length;
+        }
+        sleep_us(10000);
+    }
+    user_link_close(master);
+    user_link_close(slave);
+    printf("wire_messages: sent %d received %d corrupted %d\n", sent, received, corrupted);
+    if((sent != 10) || (received != sent) || (corrupted > 0)) {
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    static const struct {
+        const char *name;
+        int (*run)();
+    } tests[] = {
+        {"master_alone", test_master_alone},
+        {"slave_resets", test_slave_resets},
+        {"wire_messages", test_wire_messages},
+    };
+    int failed = 0;
+
+    if((argc != 3) || (strcmp(argv[1], "--chip") != 0)) {
+        std::cout << "Usage: user_link_test --chip /dev/gpiochipN (a gpio-sim chip with 2 lines, see gpio_sim_setup.sh)"
+                  << std::endl;
+        return 1;
+    }
+    chip = argv[2];
+    for(const auto &test : tests) {
+        if(test.run() < 0) {
+            printf("FAIL %s\n", test.name);
+            failed = 1;
+        }
+        else {
+            printf("PASS %s\n", test.name);
+        }
+    }
+    set_pull(0, "pull-down");
+    set_pull(1, "pull-down");
+    return failed;
+}